@@ -71,6 +71,8 @@ static void prepare_infopage()
     INFO_PAGE.glue_heartbeat      = 0; // glue code calls
     INFO_PAGE.faults_heartbeat    = 0; // protection faults
     INFO_PAGE.cpu_features        = 0;
+    INFO_PAGE.cpu_ext_features    = 0;
+    INFO_PAGE.cpu_ext_features2   = 0;
 }
 
 extern timer_v1::closure_t* init_timer(); // YIKES external declaration! FIXME
@@ -187,11 +187,12 @@ public:
         }
     }
 
-    static inline void cpuid(uint32_t func, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) ALWAYS_INLINE
+    /* Leaves 4, 7 and up take a subleaf in ECX, the rest ignore it. */
+    static inline void cpuid(uint32_t func, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx, uint32_t subfunc = 0) ALWAYS_INLINE
     {
         asm volatile ("cpuid"
                       : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
-                      : "a" (func));
+                      : "a" (func), "c" (subfunc));
     }
 
     /* Clear TS bit so we don't trap on FPU instructions. */
@@ -201,6 +202,12 @@ public:
         asm volatile ("clts");
     }
 
+    /* Let the OS save SSE state with fxsave/fxrstor and allow SSE instructions. */
+    static inline void enable_sse() ALWAYS_INLINE
+    {
+        cr4_set_flag(IA32_CR4_OSFXSR);
+    }
+
     static inline void init_cache()
     {
         asm volatile ("wbinvd\n"                    /* Flush cache */
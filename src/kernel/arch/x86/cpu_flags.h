@@ -46,6 +46,12 @@
 /* CPUID.1 ECX */
 #define X86_32_FEAT2_VMX   (1 << 5)
 
+/* CPUID.7 EBX */
+#define X86_32_FEAT7_ERMS  (1 << 9)       /* enhanced rep movsb/stosb     */
+
+/* CPUID.7 EDX */
+#define X86_32_FEAT7D_FSRM (1 << 4)       /* fast short rep movsb         */
+
 /**********************************************************************
  *    FLAGS register
  **********************************************************************/
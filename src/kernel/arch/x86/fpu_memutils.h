@@ -0,0 +1,210 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "memutils.h"
+#include "infopage.h"
+#include "cpu_flags.h"
+#include "ia32.h"
+
+/**
+ * @brief SSE2 variants of bulk memory operations for kernel code.
+ * Kernel is built without SSE, so these save the FPU/SSE state around the operation with fxsave/fxrstor.
+ * That costs about as much as copying a few hundred bytes, so only areas of BULK_THRESHOLD and more
+ * take this path, smaller ones and CPUs without SSE2 go to plain memutils.
+ *
+ * The SSE state is not preserved across a context switch, so callers must not be preempted by code
+ * that uses the FPU (boot time module loading and page operations inside the kernel are fine).
+ */
+namespace memutils {
+
+namespace internal {
+
+const size_t BULK_THRESHOLD = 4096;
+
+struct fpu_save_area_t
+{
+    uint8_t data[512];
+} __attribute__((aligned(16)));
+
+/**
+ * SSE is usable if the launcher has enabled it and nobody set TS to take the FPU lazily.
+ * smsw reads TS without needing privileges.
+ */
+inline bool
+can_use_sse()
+{
+    const uint32_t needed = X86_32_FEAT_FXSR | X86_32_FEAT_XMM2;
+    if ((INFO_PAGE.cpu_features & needed) != needed)
+        return false;
+
+    uint32_t msw;
+    asm volatile ("smsw %0" : "=r"(msw));
+    return !(msw & IA32_CR0_TS);
+}
+
+inline void
+fpu_save(fpu_save_area_t& area)
+{
+    asm volatile ("fxsave %0" : "=m"(area));
+}
+
+inline void
+fpu_restore(fpu_save_area_t& area)
+{
+    asm volatile ("fxrstor %0" :: "m"(area));
+}
+
+/**
+ * Copy @a blocks of 64 bytes to a 16 byte aligned @a dest.
+ */
+inline void
+sse_copy_blocks(void* dest, const void* src, size_t blocks)
+{
+    asm volatile (
+        "1:                         \n"
+        "movdqu   (%[s]), %%xmm0    \n"
+        "movdqu 16(%[s]), %%xmm1    \n"
+        "movdqu 32(%[s]), %%xmm2    \n"
+        "movdqu 48(%[s]), %%xmm3    \n"
+        "movdqa %%xmm0,   (%[d])    \n"
+        "movdqa %%xmm1, 16(%[d])    \n"
+        "movdqa %%xmm2, 32(%[d])    \n"
+        "movdqa %%xmm3, 48(%[d])    \n"
+        "add    $64, %[s]           \n"
+        "add    $64, %[d]           \n"
+        "dec    %[n]                \n"
+        "jnz    1b                  \n"
+        : [s] "+r"(src), [d] "+r"(dest), [n] "+r"(blocks)
+        :: "memory", "cc");
+}
+
+/**
+ * Zero @a blocks of 64 bytes at a 16 byte aligned @a dest.
+ */
+inline void
+sse_clear_blocks(void* dest, size_t blocks)
+{
+    asm volatile (
+        "pxor   %%xmm0, %%xmm0      \n"
+        "1:                         \n"
+        "movdqa %%xmm0,   (%[d])    \n"
+        "movdqa %%xmm0, 16(%[d])    \n"
+        "movdqa %%xmm0, 32(%[d])    \n"
+        "movdqa %%xmm0, 48(%[d])    \n"
+        "add    $64, %[d]           \n"
+        "dec    %[n]                \n"
+        "jnz    1b                  \n"
+        : [d] "+r"(dest), [n] "+r"(blocks)
+        :: "memory", "cc");
+}
+
+} // namespace internal
+
+/**
+ * Copy a large area of memory, using SSE2 when it pays off.
+ * @param[out] dest  Where to copy to
+ * @param[in]  src   Where to copy from
+ * @param[in]  count The size of the area.
+ * @return           Pointer to the start of the destination area.
+ */
+inline void*
+copy_bulk_memory(void* dest, const void* src, size_t count)
+{
+    using namespace internal;
+
+    if ((count < BULK_THRESHOLD) || !can_use_sse())
+        return copy_memory(dest, src, count);
+
+    char* d = reinterpret_cast<char*>(dest);
+    const char* s = reinterpret_cast<const char*>(src);
+    size_t head = -reinterpret_cast<address_t>(d) & 15;
+    copy_memory(d, s, head);
+    d += head;
+    s += head;
+    count -= head;
+
+    fpu_save_area_t area;
+    fpu_save(area);
+    sse_copy_blocks(d, s, count / 64);
+    fpu_restore(area);
+
+    size_t done = count & ~size_t(63);
+    copy_memory(d + done, s + done, count - done);
+    return dest;
+}
+
+inline address_t
+copy_bulk_memory(address_t dest, address_t src, size_t count)
+{
+    return reinterpret_cast<address_t>(copy_bulk_memory(reinterpret_cast<void*>(dest), reinterpret_cast<const void*>(src), count));
+}
+
+/**
+ * Zero a large area of memory, using SSE2 when it pays off.
+ * @param[out] dest  Pointer to the start of the area.
+ * @param[in]  count The size of the area.
+ * @return           Pointer to the start of the area.
+ */
+inline void*
+clear_bulk_memory(void* dest, size_t count)
+{
+    using namespace internal;
+
+    if ((count < BULK_THRESHOLD) || !can_use_sse())
+        return clear_memory(dest, count);
+
+    char* d = reinterpret_cast<char*>(dest);
+    size_t head = -reinterpret_cast<address_t>(d) & 15;
+    clear_memory(d, head);
+    d += head;
+    count -= head;
+
+    fpu_save_area_t area;
+    fpu_save(area);
+    sse_clear_blocks(d, count / 64);
+    fpu_restore(area);
+
+    size_t done = count & ~size_t(63);
+    clear_memory(d + done, count - done);
+    return dest;
+}
+
+/**
+ * Zero an area with non-temporal stores, so memory that will not be touched soon does not evict
+ * anything from the caches. Uses movnti from general purpose registers, so no FPU state is involved.
+ * @param[out] dest  Pointer to the start of the area, word aligned.
+ * @param[in]  count The size of the area, multiple of the word size.
+ * @return           Pointer to the start of the area.
+ */
+inline void*
+stream_clear_memory(void* dest, size_t count)
+{
+    if (!(INFO_PAGE.cpu_features & X86_32_FEAT_XMM2))
+        return clear_memory(dest, count);
+
+    void* d = dest;
+    size_t words = count / sizeof(address_t);
+    if (words)
+    {
+        asm volatile (
+            "1:                     \n"
+            "movnti %[zero], (%[d]) \n"
+            "add    %[size], %[d]   \n"
+            "dec    %[n]            \n"
+            "jnz    1b              \n"
+            "sfence                 \n"
+            : [d] "+r"(d), [n] "+r"(words)
+            : [zero] "r"(address_t(0)), [size] "i"(sizeof(address_t))
+            : "memory", "cc");
+    }
+    return dest;
+}
+
+} // namespace memutils
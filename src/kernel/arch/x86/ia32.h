@@ -36,6 +36,9 @@ static const size_t    PAGE_SIZE = 0x1000;
 static const address_t PAGE_MASK = 0xFFFFF000;
 static const size_t    PAGE_WIDTH = 12; // replace this with page_t::width
 static const size_t    FRAME_WIDTH = 12;
+// Large pages map a whole page directory entry, needs PSE.
+static const size_t    LARGE_PAGE_SIZE = 0x400000;
+static const size_t    LARGE_PAGE_WIDTH = 22;
 
 // Page attributes
 #define IA32_PAGE_PRESENT        (1<<0)
@@ -53,6 +56,7 @@ static const size_t    FRAME_WIDTH = 12;
 
 // CR0 register
 #define IA32_CR0_PE (1 <<  0)   /**< enable protected mode                                       */
+#define IA32_CR0_TS (1 <<  3)   /**< task switched, FPU/SSE use traps until cleared              */
 #define IA32_CR0_WP (1 << 16)   /**< force write protection on user read only pages for kernel   */
 #define IA32_CR0_AM (1 << 18)   /**< enable alignment checks                                     */
 #define IA32_CR0_PG (1 << 31)   /**< enable paging                                               */
@@ -28,7 +28,9 @@ struct information_page_t
              glue_heartbeat,
              faults_heartbeat;
 
-    uint32_t cpu_features;
+    uint32_t cpu_features;       /* CPUID.1 EDX */
+    uint32_t cpu_ext_features;   /* CPUID.7 EBX */
+    uint32_t cpu_ext_features2;  /* CPUID.7 EDX */
 
     void* protection_domains;
 
@@ -34,6 +34,27 @@ public:
         __sync_synchronize();
     }
 
+    /**
+     * Hint to the CPU that we are busy-waiting. Lowers power use and the penalty of leaving the spin loop.
+     */
+    static inline void relax()
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        asm volatile("pause" ::: "memory");
+#else
+        asm volatile("" ::: "memory");
+#endif
+    }
+
+    /**
+     * Read @p *lock from memory every time, for use in spin loops.
+     * NB: This is an acquire barrier, later accesses are not moved before it.
+     */
+    static inline address_t load(address_t *lock)
+    {
+        return __atomic_load_n(lock, __ATOMIC_ACQUIRE);
+    }
+
     /**
      * An atomic exchange operation. It writes value into @p *lock, and returns the previous contents of @p *lock.
      * Use carefully, as the only allowed @p new_val could be 1.
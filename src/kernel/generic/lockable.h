@@ -10,29 +10,63 @@
 
 #include "atomic.h"
 #include "types.h"
-#include "default_console.h"//debug
+
+/**
+ * Contention counters, attached to a lock with set_stats().
+ * Updated only by the lock holder, so no atomic operations are needed.
+ */
+struct lock_stats_t
+{
+    uint64_t acquisitions; //!< Times the lock was taken.
+    uint64_t contended;    //!< Times it was already held by someone else.
+    uint64_t spins;        //!< Spin loop iterations spent waiting.
+
+    inline lock_stats_t() { reset(); }
+
+    inline void reset()
+    {
+        acquisitions = contended = spins = 0;
+    }
+
+    inline void count(uint64_t n_spins)
+    {
+        ++acquisitions;
+        if (n_spins)
+        {
+            ++contended;
+            spins += n_spins;
+        }
+    }
+};
 
 /**
  * A class that implements a spinlock/binary semaphore.
+ * Waiters spin reading the lock word and only retry the atomic exchange when it looks free,
+ * so they do not keep stealing the cache line from the holder. Not fair, see ticket_lock_t.
  */
 class lockable_t
 {
 public:
-    inline lockable_t() : lock_value(0) {}
+    inline lockable_t() : lock_value(0), stats(0) {}
 
     /**
      * Spin until we get the lock.
      */
     inline void lock()
     {
-        uint32_t new_val = 1;
+        uint64_t spins = 0;
         // If we exchange the lock value with 1 and get 1 out, it was locked.
-        while (atomic_ops::tas(&lock_value, new_val) == 1)
+        while (atomic_ops::tas(&lock_value, 1) == 1)
         {
-            // Do nothing. Could notify scheduler here.
-            kconsole << "object already locked, spinning!" << endl;
+            while (atomic_ops::load(&lock_value))
+            {
+                atomic_ops::relax();
+                ++spins;
+            }
         }
         // We got the lock, return.
+        if (stats)
+            stats->count(spins);
     }
 
     /**
@@ -41,9 +75,10 @@ public:
      */
     inline bool try_lock()
     {
-        uint32_t new_val = 1;
-        if (atomic_ops::tas(&lock_value, new_val) == 0) // will actually lock!
+        if (atomic_ops::tas(&lock_value, 1) == 0) // will actually lock!
         {
+            if (stats)
+                stats->count(0);
             return true;
         }
         return false;
@@ -51,7 +86,7 @@ public:
 
     inline bool has_lock()
     {
-        return lock_value;
+        return atomic_ops::load(&lock_value);
     }
 
     /**
@@ -62,8 +97,154 @@ public:
         atomic_ops::release(&lock_value);
     }
 
+    /**
+     * Start counting contention into @a s, or stop if it is null.
+     */
+    inline void set_stats(lock_stats_t* s)
+    {
+        stats = s;
+    }
+
+private:
+    address_t lock_value; //!< The actual lock variable.
+    lock_stats_t* stats;
+};
+
+/**
+ * Fair spinlock: waiters take a ticket and are served in arrival order.
+ * All waiters spin on the same word, so it suits locks with a handful of contenders, use mcs_lock_t beyond that.
+ */
+class ticket_lock_t
+{
+public:
+    inline ticket_lock_t() : next_ticket(0), now_serving(0), stats(0) {}
+
+    inline void lock()
+    {
+        uint64_t spins = 0;
+        address_t ticket = atomic_ops::faa(&next_ticket, 1);
+        while (atomic_ops::load(&now_serving) != ticket)
+        {
+            atomic_ops::relax();
+            ++spins;
+        }
+        if (stats)
+            stats->count(spins);
+    }
+
+    /**
+     * Take a ticket only if it would be served right away.
+     * @return true if the lock was obtained.
+     */
+    inline bool try_lock()
+    {
+        address_t ticket = atomic_ops::load(&now_serving);
+        if (!atomic_ops::bcas(&next_ticket, ticket, ticket + 1))
+            return false;
+        if (stats)
+            stats->count(0);
+        return true;
+    }
+
+    inline bool has_lock()
+    {
+        return atomic_ops::load(&next_ticket) != atomic_ops::load(&now_serving);
+    }
+
+    inline void unlock()
+    {
+        // Only the holder writes now_serving, the atomic add doubles as a release barrier.
+        atomic_ops::faa(&now_serving, 1);
+    }
+
+    inline void set_stats(lock_stats_t* s)
+    {
+        stats = s;
+    }
+
+private:
+    address_t next_ticket;
+    address_t now_serving;
+    lock_stats_t* stats;
+};
+
+/**
+ * Queue node of an MCS lock waiter, normally on the waiter's stack.
+ */
+struct mcs_node_t
+{
+    mcs_node_t* next;
+    address_t   locked;
+};
+
+/**
+ * MCS queue lock: fair, and every waiter spins on its own queue node, so handing the lock over
+ * touches only the next waiter's cache line. Each lock/unlock pair needs a node that lives
+ * until unlock, use mcs_scope_lock_t to get one.
+ */
+class mcs_lock_t
+{
+public:
+    inline mcs_lock_t() : tail(0), stats(0) {}
+
+    inline void lock(mcs_node_t& node)
+    {
+        uint64_t spins = 0;
+        node.next = 0;
+        node.locked = 1;
+
+        mcs_node_t* pred = reinterpret_cast<mcs_node_t*>(atomic_ops::tas(reinterpret_cast<address_t*>(&tail), reinterpret_cast<address_t>(&node)));
+        if (pred)
+        {
+            __atomic_store_n(&pred->next, &node, __ATOMIC_RELEASE);
+            while (atomic_ops::load(&node.locked))
+            {
+                atomic_ops::relax();
+                ++spins;
+            }
+        }
+        if (stats)
+            stats->count(spins);
+    }
+
+    inline bool try_lock(mcs_node_t& node)
+    {
+        node.next = 0;
+        node.locked = 0;
+        if (!atomic_ops::bcas(reinterpret_cast<address_t*>(&tail), 0, reinterpret_cast<address_t>(&node)))
+            return false;
+        if (stats)
+            stats->count(0);
+        return true;
+    }
+
+    inline bool has_lock()
+    {
+        return atomic_ops::load(reinterpret_cast<address_t*>(&tail)) != 0;
+    }
+
+    inline void unlock(mcs_node_t& node)
+    {
+        mcs_node_t* next = __atomic_load_n(&node.next, __ATOMIC_ACQUIRE);
+        if (!next)
+        {
+            // No known successor: either we are the last one, or a new waiter is just linking itself in.
+            if (atomic_ops::bcas(reinterpret_cast<address_t*>(&tail), reinterpret_cast<address_t>(&node), 0))
+                return;
+            while (!(next = __atomic_load_n(&node.next, __ATOMIC_ACQUIRE)))
+                atomic_ops::relax();
+        }
+        __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+    }
+
+    inline void set_stats(lock_stats_t* s)
+    {
+        stats = s;
+    }
+
 private:
-    uint32_t lock_value; //!< The actual lock variable.
+    mcs_node_t* tail;
+    lock_stats_t* stats;
 };
 
 /**
@@ -99,3 +280,27 @@ public:
  * Spinlock scoped lock object.
  */
 typedef scope_lock_t<lockable_t> lockable_scope_lock_t;
+typedef scope_lock_t<ticket_lock_t> ticket_scope_lock_t;
+
+/**
+ * Scoped MCS lock, carries the queue node.
+ */
+class mcs_scope_lock_t
+{
+    mcs_lock_t& lockable;
+    mcs_node_t node;
+
+    mcs_scope_lock_t();
+    mcs_scope_lock_t(const mcs_scope_lock_t&);
+    mcs_scope_lock_t& operator =(const mcs_scope_lock_t&);
+
+public:
+    mcs_scope_lock_t(mcs_lock_t& obj) : lockable(obj)
+    {
+        lockable.lock(node);
+    }
+    ~mcs_scope_lock_t()
+    {
+        lockable.unlock(node);
+    }
+};
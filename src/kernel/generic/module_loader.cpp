@@ -16,6 +16,7 @@
 #include "panic.h"
 #include "fourcc.h"
 #include "infopage.h"
+#include "fpu_memutils.h"
 #include "bootinfo.h" // for print_module_map()
 // #include "exceptions.h"
 #include "symbol_table_finder.h"
@@ -293,6 +294,11 @@ void* module_loader_t::load_module(const char* name, elf_parser_t& module, const
             reinterpret_cast<elf32::section_header_t*>(out_mod->entry.strtab_start));
 
         address_t symbol = finder.find_symbol(closure_name);
+        if (!symbol)
+        {
+            logger::debug() << "Module " << name << " does not export " << closure_name;
+            return 0;
+        }
         address_t entry = reinterpret_cast<address_t>(*(void**)(symbol));
         logger::debug() << "Returning closure symbol " << symbol << ", pointer " << entry;
         return reinterpret_cast<void*>(symbol);
@@ -350,12 +356,12 @@ void* module_loader_t::load_module(const char* name, elf_parser_t& module, const
                     address_t section_addr = ph.vaddr + section_base - start;
                     kconsole << "Allocating this section at " << section_addr << endl;
                     kconsole << "Copying " << ph.filesz << " bytes" << endl;
-                    memutils::copy_memory(section_addr, module.start() + ph.offset, ph.filesz);
+                    memutils::copy_bulk_memory(section_addr, module.start() + ph.offset, ph.filesz);
                     // Zero BSS
                     if (ph.memsz > ph.filesz)
                     {
                         kconsole << "Clearing " << ph.memsz - ph.filesz << " bytes" << endl;
-                        memutils::fill_memory((void*)(section_addr + ph.filesz), 0, ph.memsz - ph.filesz);
+                        memutils::clear_bulk_memory((void*)(section_addr + ph.filesz), ph.memsz - ph.filesz);
                     }
                 }
             }
@@ -410,12 +416,12 @@ void* module_loader_t::load_module(const char* name, elf_parser_t& module, const
                 if (sh.type == SHT_NOBITS)
                 {
                     logger::trace() << "Clearing " << int(sh.size) << " bytes at " << sh.vaddr;
-                    memutils::clear_memory((void*)sh.vaddr, sh.size);
+                    memutils::clear_bulk_memory((void*)sh.vaddr, sh.size);
                 }
                 else
                 {
                     logger::trace() << "Copying " << int(sh.size) << " bytes from " << (module.start() + sh.offset) << " to " << sh.vaddr;
-                    memutils::copy_memory(sh.vaddr, module.start() + sh.offset, sh.size);
+                    memutils::copy_bulk_memory(sh.vaddr, module.start() + sh.offset, sh.size);
                 }
                 // Adjust module end address.
                 if (sh.vaddr + sh.size > *d_last_available_address) {
@@ -438,7 +444,7 @@ void* module_loader_t::load_module(const char* name, elf_parser_t& module, const
             memutils::copy_memory(*d_last_available_address, address_t(symbol_table), sizeof(*symbol_table));
             elf32::section_header_t* new_symtab = reinterpret_cast<elf32::section_header_t*>(*d_last_available_address);
             *d_last_available_address += sizeof(*symbol_table);
-            memutils::copy_memory(*d_last_available_address, module.start() + symbol_table->offset, symbol_table->size);
+            memutils::copy_bulk_memory(*d_last_available_address, module.start() + symbol_table->offset, symbol_table->size);
             logger::debug() << "### symbol table copied to " << *d_last_available_address;
             // TODO: new_symtab uses offset field as an absolute address in memory where the section starts.
             // for now simply patch a new offset into the old section header!!
@@ -459,7 +465,7 @@ void* module_loader_t::load_module(const char* name, elf_parser_t& module, const
             memutils::copy_memory(*d_last_available_address, address_t(string_table), sizeof(*string_table));
             elf32::section_header_t* new_strtab = reinterpret_cast<elf32::section_header_t*>(*d_last_available_address);
             *d_last_available_address += sizeof(*string_table);
-            memutils::copy_memory(*d_last_available_address, module.start() + string_table->offset, string_table->size);
+            memutils::copy_bulk_memory(*d_last_available_address, module.start() + string_table->offset, string_table->size);
             logger::debug() << "### string table copied to " << *d_last_available_address;
             new_strtab->offset = *d_last_available_address - this_loaded_module.entry.load_base;
 
@@ -538,6 +544,11 @@ void* module_loader_t::load_module(const char* name, elf_parser_t& module, const
         symbol_table_finder_t finder(this_loaded_module.entry);
 
         address_t symbol = finder.find_symbol(closure_name);
+        if (!symbol)
+        {
+            logger::debug() << "Module " << name << " does not export " << closure_name;
+            return 0;
+        }
         address_t entry = reinterpret_cast<address_t>(*(void**)(symbol));
         logger::debug() << "Returning closure symbol " << symbol << ", pointer " << entry;
         return reinterpret_cast<void*>(symbol);//entry);
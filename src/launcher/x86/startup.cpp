@@ -156,6 +156,13 @@ static void SECTION(".init.cpu") check_cpu_features()
         ia32_mmu_t::enable_global_pages();
     }
 
+    /* Bulk kernel copies use SSE2 with explicit state saving, see fpu_memutils.h */
+    if ((avail_features & (X86_32_FEAT_FXSR | X86_32_FEAT_XMM2)) == (X86_32_FEAT_FXSR | X86_32_FEAT_XMM2))
+    {
+        kconsole << "Enabling SSE" << endl;
+        x86_cpu_t::enable_sse();
+    }
+
     /* If we have a 486 or above enable alignment checking */
     if (family >= 4)
     {
@@ -180,6 +187,17 @@ static void SECTION(".init.cpu") check_cpu_features()
     }
 
     INFO_PAGE.cpu_features = avail_features;
+
+    /* Structured extended features, memutils picks string copy variants from these */
+    if (max_cpuid >= 7)
+    {
+        uint32_t ext_features, ext_features2;
+        x86_cpu_t::cpuid(7, &dummy, &ext_features, &dummy, &ext_features2, 0);
+        INFO_PAGE.cpu_ext_features = ext_features;
+        INFO_PAGE.cpu_ext_features2 = ext_features2;
+        if (ext_features & X86_32_FEAT7_ERMS)
+            kconsole << "Enhanced rep movsb/stosb available" << endl;
+    }
 }
 
 /* Clear out the information page */
@@ -191,6 +209,8 @@ static void prepare_infopage()
     INFO_PAGE.glue_heartbeat      = 0; // glue code calls
     INFO_PAGE.faults_heartbeat    = 0; // protection faults
     INFO_PAGE.cpu_features        = 0;
+    INFO_PAGE.cpu_ext_features    = 0;
+    INFO_PAGE.cpu_ext_features2   = 0;
 }
 
 extern timer_v1::closure_t* init_timer(); // YIKES external declaration! FIXME
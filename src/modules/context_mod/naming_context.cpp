@@ -76,6 +76,8 @@ static naming_context_v1::names
 list(naming_context_v1::closure_t* self)
 {
     naming_context_v1::names n(context_allocator(self->d_state->heap));
+    // IDL sequences are std::vectors, they grow by copying rather than with heap_v1.realloc, so size it up front.
+    n.reserve(self->d_state->map.size());
     for (auto x : self->d_state->map)
     {
         n.push_back(x.first);
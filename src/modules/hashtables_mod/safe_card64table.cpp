@@ -24,7 +24,7 @@
 
 using namespace std;
 
-DECLARE_MAP(card64table, map_card64_address_v1::key, map_card64_address_v1::value);
+DECLARE_SLAB_MAP(card64table, map_card64_address_v1::key, map_card64_address_v1::value);
 
 struct map_card64_address_v1::state_t
 {
@@ -89,10 +89,9 @@ static map_card64_address_v1::closure_t*
 map_card64_address_factory_v1_create(map_card64_address_factory_v1::closure_t* self, heap_v1::closure_t* heap)
 {
 	map_card64_address_v1::state_t* state = new(heap) map_card64_address_v1::state_t;
-    auto heap_alloc = new(heap) card64table_heap_allocator(heap); // FIXME: a mem leak!
 	// TODO: if (!state) raise Exception -- heap will raise no_memory itself!
 	state->heap = heap;
-	state->table = new(heap) card64table_t(*heap_alloc);
+	state->table = new(heap) card64table_t(card64table_slab_allocator(heap));
 	closure_init(&state->closure, &map_methods, state);
 	return &state->closure;
 }
@@ -27,7 +27,7 @@
 
 using namespace std;
 
-DECLARE_MAP(stringtable, map_string_address_v1::key, map_string_address_v1::value);
+DECLARE_SLAB_MAP(stringtable, map_string_address_v1::key, map_string_address_v1::value);
 
 struct map_string_address_v1::state_t
 {
@@ -143,10 +143,9 @@ static map_string_address_v1::closure_t*
 map_string_address_factory_v1_create(map_string_address_factory_v1::closure_t* self, heap_v1::closure_t* heap)
 {
 	map_string_address_v1::state_t* state = new(heap) map_string_address_v1::state_t;
-    auto heap_alloc = new(heap) stringtable_heap_allocator(heap); // FIXME: a mem leak!
 	// TODO: if (!state) raise Exception
 	state->heap = heap;
-	state->table = new(heap) stringtable_t(*heap_alloc);
+	state->table = new(heap) stringtable_t(stringtable_slab_allocator(heap));
 	closure_init(&state->closure, &map_methods, state);
 	return &state->closure;
 }
@@ -0,0 +1,271 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "arena_heap.h"
+#include "heap_v1_impl.h"
+#include "stretch_v1_interface.h"
+#include "memory.h"
+#include "memutils.h"
+#include "macros.h"
+#include "default_console.h"
+#include "exceptions.h"
+#include "logger.h"
+
+#define ARENA_ALIGN (sizeof(uint64_t))
+#define ARENA_MIN_CHUNK_SIZE (16*KiB)
+
+/**
+ * Header at the start of every arena chunk.
+ */
+struct arena_chunk_t
+{
+    arena_chunk_t*         next;
+    stretch_v1::closure_t* stretch;
+};
+
+/**
+ * Arena state lives in its first chunk, right after the chunk header.
+ */
+struct arena_state_t
+{
+    heap_v1::closure_t               closure;
+    stretch_allocator_v1::closure_t* allocator;
+    protection_domain_v1::id         pdid;
+    memory_v1::size                  chunk_size;
+    arena_chunk_t*                   chunks;    //!< Most recent first, the first chunk is last.
+    address_t                        top;       //!< Next free byte in the current chunk.
+    address_t                        end;       //!< End of the current chunk.
+    address_t                        last;      //!< Most recent block, can be resized in place.
+    memory_v1::size                  total;     //!< Size of all chunks.
+    memory_v1::size                  used;      //!< Bytes handed out.
+    uint64_t                         allocations;
+};
+
+static inline arena_state_t* arena_state(heap_v1::closure_t* self)
+{
+    return reinterpret_cast<arena_state_t*>(self->d_state);
+}
+
+/**
+ * Get a new chunk with at least @a size bytes usable after the chunk header.
+ */
+static arena_chunk_t* arena_new_chunk(stretch_allocator_v1::closure_t* allocator, protection_domain_v1::id pdid, memory_v1::size chunk_size, memory_v1::size size, address_t* end)
+{
+    size = page_align_up(size + sizeof(arena_chunk_t));
+    if (size < chunk_size)
+        size = chunk_size;
+
+    stretch_v1::closure_t* stretch = allocator->create(size, stretch_v1::rights());
+    if (!stretch)
+        return NULL;
+
+    if (pdid != NULL_PDID)
+        stretch->set_rights(pdid, stretch_v1::rights(stretch_v1::right_read).add(stretch_v1::right_write));
+
+    memory_v1::size stretch_size;
+    arena_chunk_t* chunk = reinterpret_cast<arena_chunk_t*>(stretch->info(&stretch_size));
+    chunk->next = NULL;
+    chunk->stretch = stretch;
+    *end = reinterpret_cast<address_t>(chunk) + stretch_size;
+
+    return chunk;
+}
+
+//======================================================================================================================
+// heap_v1 arena implementation
+//======================================================================================================================
+
+static memory_v1::address arena_heap_v1_allocate(heap_v1::closure_t* self, memory_v1::size size)
+{
+    arena_state_t* state = arena_state(self);
+
+    size = align_up(size, ARENA_ALIGN);
+    if (size > state->end - state->top)
+    {
+        address_t end;
+        arena_chunk_t* chunk = arena_new_chunk(state->allocator, state->pdid, state->chunk_size, size, &end);
+        if (!chunk)
+        {
+            if (PVS(exceptions))
+                OS_RAISE((exception_support_v1::id)"heap_v1.no_memory", NULL);
+            return 0;
+        }
+
+        chunk->next = state->chunks;
+        state->chunks = chunk;
+        state->top = reinterpret_cast<address_t>(chunk + 1);
+        state->end = end;
+        state->total += end - reinterpret_cast<address_t>(chunk);
+    }
+
+    address_t res = state->top;
+    state->last = res;
+    state->top += size;
+    state->used += size;
+    ++state->allocations;
+    return res;
+}
+
+static void arena_heap_v1_free(heap_v1::closure_t*, memory_v1::address)
+{
+    // Memory is only given back when the whole arena is destroyed.
+}
+
+/**
+ * Arenas do not record block sizes. The most recent block is resized in place, others are copied
+ * up to the new size or the end of the used part of their chunk, whichever comes first.
+ */
+static memory_v1::address arena_heap_v1_realloc(heap_v1::closure_t* self, memory_v1::address ptr, memory_v1::size size)
+{
+    arena_state_t* state = arena_state(self);
+
+    if (!ptr)
+        return arena_heap_v1_allocate(self, size);
+
+    if (ptr == state->last)
+    {
+        memory_v1::size old_size = state->top - ptr;
+        size = align_up(size, ARENA_ALIGN);
+        if (size <= state->end - ptr)
+        {
+            state->top = ptr + size;
+            state->used = state->used - old_size + size;
+            return ptr;
+        }
+    }
+
+    address_t limit = state->top;
+    if ((ptr < reinterpret_cast<address_t>(state->chunks)) || (ptr >= state->end))
+    {
+        for (arena_chunk_t* chunk = state->chunks->next; chunk; chunk = chunk->next)
+        {
+            memory_v1::size chunk_size;
+            address_t base = chunk->stretch->info(&chunk_size);
+            if ((ptr >= base) && (ptr < base + chunk_size))
+            {
+                limit = base + chunk_size;
+                break;
+            }
+        }
+    }
+
+    memory_v1::address res = arena_heap_v1_allocate(self, size);
+    if (!res)
+        return 0;
+
+    memutils::copy_memory(res, ptr, limit - ptr < size ? limit - ptr : size);
+    return res;
+}
+
+static void arena_heap_v1_check(heap_v1::closure_t*, bool)
+{
+}
+
+/**
+ * Only the tail of the current chunk is free, space left at the end of older chunks is lost.
+ */
+static heap_v1::stats arena_heap_v1_get_stats(heap_v1::closure_t* self)
+{
+    arena_state_t* state = arena_state(self);
+    heap_v1::stats s;
+
+    s.total_bytes = state->total;
+    s.free_bytes = state->end - state->top;
+    s.largest_free = s.free_bytes;
+    s.fragmentation = 0;
+    s.classes = 1;
+    s.lock_acquisitions = 0;
+    s.lock_contended = 0;
+    s.lock_spins = 0;
+
+    return s;
+}
+
+/**
+ * Arenas have no size classes, everything is reported as a single class.
+ */
+static bool arena_heap_v1_get_class_stats(heap_v1::closure_t* self, uint32_t index, heap_v1::class_stats* s)
+{
+    arena_state_t* state = arena_state(self);
+
+    if (index != 0)
+        return false;
+
+    s->max_size = state->chunk_size;
+    s->live_bytes = state->used;
+    s->peak_bytes = state->used;
+    s->allocations = state->allocations;
+    s->frees = 0;
+    s->free_blocks = 0;
+
+    return true;
+}
+
+static const heap_v1::ops_t arena_heap_v1_methods =
+{
+    arena_heap_v1_allocate,
+    arena_heap_v1_free,
+    arena_heap_v1_realloc,
+    arena_heap_v1_check,
+    arena_heap_v1_get_stats,
+    arena_heap_v1_get_class_stats
+};
+
+//======================================================================================================================
+// arena creation and destruction
+//======================================================================================================================
+
+heap_v1::closure_t* create_arena_heap(stretch_allocator_v1::closure_t* allocator, protection_domain_v1::id pdid, memory_v1::size chunk_size)
+{
+    chunk_size = page_align_up(chunk_size);
+    if (chunk_size < ARENA_MIN_CHUNK_SIZE)
+        chunk_size = ARENA_MIN_CHUNK_SIZE;
+
+    address_t end;
+    arena_chunk_t* chunk = arena_new_chunk(allocator, pdid, chunk_size, sizeof(arena_state_t), &end);
+    if (!chunk)
+    {
+        logger::warning() << __FUNCTION__ << ": cannot get the first " << chunk_size << " bytes chunk";
+        return NULL;
+    }
+
+    arena_state_t* state = reinterpret_cast<arena_state_t*>(chunk + 1);
+    closure_init(&state->closure, &arena_heap_v1_methods, reinterpret_cast<heap_v1::state_t*>(state));
+    state->allocator = allocator;
+    state->pdid = pdid;
+    state->chunk_size = chunk_size;
+    state->chunks = chunk;
+    state->top = align_up(reinterpret_cast<address_t>(state + 1), ARENA_ALIGN);
+    state->end = end;
+    state->last = 0;
+    state->total = end - reinterpret_cast<address_t>(chunk);
+    state->used = 0;
+    state->allocations = 0;
+
+    return &state->closure;
+}
+
+bool destroy_arena_heap(heap_v1::closure_t* arena)
+{
+    if (arena->d_methods != &arena_heap_v1_methods)
+        return false;
+
+    arena_state_t* state = arena_state(arena);
+    stretch_allocator_v1::closure_t* allocator = state->allocator;
+    arena_chunk_t* chunk = state->chunks;
+
+    // The first chunk holding the state comes last in the list.
+    while (chunk)
+    {
+        arena_chunk_t* next = chunk->next;
+        allocator->destroy_stretch(chunk->stretch);
+        chunk = next;
+    }
+
+    return true;
+}
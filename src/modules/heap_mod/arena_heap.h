@@ -0,0 +1,20 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "heap_v1_interface.h"
+#include "stretch_allocator_v1_interface.h"
+
+/**
+ * Arena heaps hand out memory by bumping a pointer inside stretch-backed chunks. Blocks carry no headers,
+ * free is a no-op and the whole arena is released at once by destroy_arena_heap().
+ * An arena is not locked, it must only be used by one thread at a time.
+ */
+heap_v1::closure_t* create_arena_heap(stretch_allocator_v1::closure_t* allocator, protection_domain_v1::id pdid, memory_v1::size chunk_size);
+bool destroy_arena_heap(heap_v1::closure_t* arena);
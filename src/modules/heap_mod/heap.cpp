@@ -8,7 +8,7 @@
 //
 #include "heap.h"
 #include "memory.h"
-#include "debugger.h"
+#include "memutils.h"
 #include "logger.h"
 #include "default_console.h"
 #include "panic.h"
@@ -24,30 +24,22 @@
 #define HEAP_MAGIC        0xfa11dead
 #define MIN_HEAP_OVERHEAD (sizeof(heap_rec_t)*3)
 
-#define OTHER_INDEX (COUNT-1)
-
 #define WORD_SIZE (sizeof(uint64_t))
-static inline size_t BLOCK_ALIGN(size_t _x) { return ((_x)+WORD_SIZE) & -(WORD_SIZE); }
+static inline size_t BLOCK_ALIGN(size_t _x) { return ((_x)+WORD_SIZE-1) & -(WORD_SIZE); }
 #define _S(_x) (_x * WORD_SIZE)
 
-/* Size of minimum fragment: this should be sizeof(heap_rec_t) + all_sizes[0] */
+/* Size of minimum fragment: this should be sizeof(heap_rec_t) + smallest block size */
 #define MIN_FRAG (sizeof(heap_rec_t) + _S(1))
 
 #define SMALL_LIMIT _S(16)
-#define LARGE_LIMIT _S(1296)
+
+/* Free list index marking blocks which live outside of the heap, busy heap blocks have -1. */
+#define LARGE_INDEX (-2)
 #define SMALL_INDEX(x) ((x-1) / WORD_SIZE)
 
-const memory_v1::size heap_t::all_sizes[heap_t::COUNT] =
-{
-    _S(1),   _S(2),   _S(3),   _S(4),   _S(5),   _S(6),   _S(7),    _S(8),
-    _S(9),   _S(10),  _S(11),  _S(12),  _S(13),  _S(14),  _S(15),   _S(16),
-    
-    _S(19),  _S(23),  _S(28),  _S(34),  _S(41),  _S(49),  _S(59),   _S(71),
-    _S(85),  _S(102), _S(122), _S(146), _S(175), _S(210), _S(252),  _S(302),
-    _S(362), _S(434), _S(521), _S(625), _S(750), _S(900), _S(1080), _S(1296),
-    
-    ~0U
-};
+/* Find first/last set bit, bits are numbered from 0. Argument must be non-zero. */
+static inline int ffs_bit(unsigned long x) { return __builtin_ctzl(x); }
+static inline int fls_bit(unsigned long x) { return int(sizeof(unsigned long) * 8) - 1 - __builtin_clzl(x); }
 
 inline heap_t::heap_rec_t* heap_t::prev_block(heap_rec_t* rec)
 {
@@ -59,6 +51,14 @@ inline heap_t::heap_rec_t* heap_t::next_block(heap_rec_t* rec)
     return reinterpret_cast<heap_rec_t*>(reinterpret_cast<char*>(rec + 1) + rec->size);
 }
 
+/**
+ * Free blocks are doubly linked, backlink lives in the first payload word.
+ */
+inline heap_t::heap_rec_t*& heap_t::prev_free(heap_rec_t* rec)
+{
+    return *reinterpret_cast<heap_rec_t**>(rec + 1);
+}
+
 void heap_t::init(address_t start, address_t end)//, heap_v1_closure* heap_closure)
 {
     start_address = start;
@@ -66,35 +66,54 @@ void heap_t::init(address_t start, address_t end)//, heap_v1_closure* heap_closu
 
     kconsole << "Initializing heap (" << start << ".." << end << ")." << endl;
 
-    for (int i = 0; i < COUNT; ++i)
-        blocks[i] = NULL;
+    fl_bitmap = 0;
+    for (int i = 0; i < FL_COUNT; ++i)
+    {
+        sl_bitmap[i] = 0;
+        for (int j = 0; j < SL_COUNT; ++j)
+            blocks[i][j] = NULL;
+    }
+    for (int i = 0; i < STAT_CLASSES; ++i)
+        free_counts[i] = 0;
+    free_bytes = 0;
+    total_bytes = 0;
+
+    null_malloc = init_segment(start, end);
+    empty_segment = NULL;
+}
 
-    // First entry is null_malloc marker.
-    heap_rec_t* null_m = reinterpret_cast<heap_rec_t*>(start);
-    null_m->prev = HEAP_MAGIC;
-    null_m->size = 0;
-    null_m->index = -1;
-    null_m->heap = this;// heap_closure;
+/**
+ * Lay out a segment as start marker, one free block and end marker. End marker points back to the start marker.
+ * @return start marker.
+ */
+heap_t::heap_rec_t* heap_t::init_segment(address_t start, address_t end)
+{
+    total_bytes += end - start;
 
-    null_malloc = null_m;
+    // First entry is start marker, it doubles as null_malloc marker for the initial segment.
+    heap_rec_t* start_rec = reinterpret_cast<heap_rec_t*>(start);
+    start_rec->prev = HEAP_MAGIC;
+    start_rec->size = 0;
+    start_rec->index = -1;
+    start_rec->heap = this;// heap_closure;
 
-    // Second entry is all free space in the heap.
-    heap_rec_t* rec = null_m + 1;
+    // Second entry is all free space in the segment.
+    heap_rec_t* rec = start_rec + 1;
     rec->prev = HEAP_MAGIC;
     rec->size = (end - start) - MIN_HEAP_OVERHEAD;
-    rec->index = OTHER_INDEX;
-    rec->next = NULL;
-    
-    blocks[OTHER_INDEX] = rec;
-    
+    insert_free_block(rec);
+
     // Third entry is end marker.
     heap_rec_t* end_rec = next_block(rec);
     end_rec->prev = rec->size;
     end_rec->size = 0;
     end_rec->index = 0;
-    
-    ASSERT(reinterpret_cast<char*>(end_rec) == reinterpret_cast<char*>(end_address) - sizeof(heap_rec_t));
+    end_rec->next = start_rec;
+
+    ASSERT(reinterpret_cast<char*>(end_rec) == reinterpret_cast<char*>(end) - sizeof(heap_rec_t));
     ASSERT(prev_block(end_rec) == rec);
+
+    return start_rec;
 }
 
 // heap_t::~heap_t()
@@ -103,157 +122,169 @@ void heap_t::init(address_t start, address_t end)//, heap_v1_closure* heap_closu
     //Print leak summary.
 // }
 
-int heap_t::find_index(size_t size)
+/**
+ * Map block size to the list it belongs to. Every block in list (fl, sl) is at least as large as the list's lower bound.
+ */
+void heap_t::mapping_insert(size_t size, int* fl, int* sl)
 {
-    if (size <= SMALL_LIMIT)
+    if (size < SMALL_BLOCK_SIZE)
     {
-        return SMALL_INDEX(size);
+        *fl = 0;
+        *sl = size / WORD_SIZE;
     }
-    else if (size <= LARGE_LIMIT)
+    else
     {
-        int mi;
-        int lo = SMALL_BLOCKS;
-        int hi = OTHER_INDEX-1;
-
-        for (; lo + 4 < hi;)
-        {
-            mi = (lo + hi) / 2;
-            if (size == all_sizes[mi])
-            {
-                return mi;
-            }
-            else if (size < all_sizes[mi])
-                hi = mi;
-            else
-                lo = mi;
-        }
-        for(mi = lo; mi <= hi; mi++)
-        {
-            if (size <= all_sizes[mi])
-            {
-                return mi;
-            }
-        }
+        int f = fls_bit(size);
+        *sl = (size >> (f - SL_LOG)) ^ SL_COUNT;
+        *fl = f - FL_SHIFT + 1;
     }
-    return OTHER_INDEX;
 }
 
-void heap_t::coalesce()
+/**
+ * Map requested size to the first list where every block is guaranteed to fit it.
+ */
+void heap_t::mapping_search(size_t size, int* fl, int* sl)
 {
-    int32_t index;
-
-    for (index = 0; index <= OTHER_INDEX; ++index)
-        coalesce_merge_blocks(index);
-
-    for (index = 0; index <= OTHER_INDEX; ++index)
-        coalesce_move_blocks(index);
+    if (size >= SMALL_BLOCK_SIZE)
+        size += (1UL << (fls_bit(size) - SL_LOG)) - 1;
+    mapping_insert(size, fl, sl);
 }
 
-void heap_t::coalesce_merge_blocks(int32_t index)
+heap_t::heap_rec_t* heap_t::find_suitable_block(int fl, int sl)
 {
-    heap_rec_t* before_block;
-    heap_rec_t* after_block;
-    heap_rec_t* free_block;
-    heap_rec_t** ptr;
+    if (fl >= FL_COUNT)
+        return NULL;
 
-    for (ptr = &blocks[index]; (free_block = *ptr); )
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map)
     {
-        if (free_block->prev != HEAP_MAGIC) // previous block is unallocated indeed!
-        {
-            before_block = prev_block(free_block);
-            if (next_block(before_block) != free_block)
-                PANIC("Out of sanity!");
-                
-            before_block->size += free_block->size + sizeof(heap_rec_t);
-            after_block = next_block(free_block);
-            after_block->prev = before_block->size;
-            
-            *ptr = free_block->next;
-        }
-        else
-        {
-            ptr = &(free_block->next);
-        }
+        if (fl + 1 >= FL_COUNT)
+            return NULL;
+        size_t fl_map = fl_bitmap & (~0UL << (fl + 1));
+        if (!fl_map)
+            return NULL;
+        fl = ffs_bit(fl_map);
+        sl_map = sl_bitmap[fl];
     }
+
+    return blocks[fl][ffs_bit(sl_map)];
 }
 
-void heap_t::coalesce_move_blocks(int32_t index)
+void heap_t::insert_free_block(heap_rec_t* rec)
 {
-    heap_rec_t* free_block;
-    heap_rec_t** ptr;
+    int fl, sl;
+    mapping_insert(rec->size, &fl, &sl);
+
+    rec->index = fl * SL_COUNT + sl;
+    rec->next = blocks[fl][sl];
+    prev_free(rec) = NULL;
+    if (rec->next)
+        prev_free(rec->next) = rec;
+    blocks[fl][sl] = rec;
 
-    for (ptr = &blocks[index]; (free_block = *ptr); )
+    fl_bitmap |= 1UL << fl;
+    sl_bitmap[fl] |= 1U << sl;
+
+    ++free_counts[size_class(rec->size)];
+    free_bytes += rec->size;
+}
+
+void heap_t::remove_free_block(heap_rec_t* rec)
+{
+    int fl = rec->index / SL_COUNT;
+    int sl = rec->index % SL_COUNT;
+    heap_rec_t* prev = prev_free(rec);
+    heap_rec_t* next = rec->next;
+
+    --free_counts[size_class(rec->size)];
+    free_bytes -= rec->size;
+
+    if (next)
+        prev_free(next) = prev;
+
+    if (prev)
+        prev->next = next;
+    else
     {
-        int new_index = find_index(free_block->size);
-        if (new_index != free_block->index)
-        {
-            *ptr = free_block->next;
-            new_index = OTHER_INDEX; // FIXME: hack to make get_new_block_internal find this block even if it's in
-            // a smaller free list than "all sizes"... redo this properly
-            free_block->next = blocks[new_index];
-            blocks[new_index] = free_block;
-            free_block->index = new_index;
-        }
-        else
+        blocks[fl][sl] = next;
+        if (!next)
         {
-            ptr = &(free_block->next);
+            sl_bitmap[fl] &= ~(1U << sl);
+            if (!sl_bitmap[fl])
+                fl_bitmap &= ~(1UL << fl);
         }
     }
 }
 
-heap_t::heap_rec_t* heap_t::get_new_block_internal(size_t size, int index)
+/**
+ * Merge a block being freed with its free physical neighbours using the boundary tags.
+ * @return the resulting block, not yet on any free list.
+ */
+heap_t::heap_rec_t* heap_t::merge_free_neighbours(heap_rec_t* rec)
 {
-    heap_rec_t* free_block;
-    heap_rec_t* allocated_block;
-    heap_rec_t** ptr;
+    heap_rec_t* next = next_block(rec);
 
-    for (ptr = &blocks[OTHER_INDEX]; (free_block = *ptr); ptr = &(free_block->next))
+    // Zero size marks the segment end marker.
+    if ((next->size != 0) && (next_block(next)->prev != HEAP_MAGIC))
     {
-        if (free_block->size >= size)
-        {
-            if (free_block->size - size >= MIN_FRAG)
-            {
-                // Allocate from the end of free_block
-                allocated_block = reinterpret_cast<heap_rec_t*>(reinterpret_cast<char*>(free_block) + free_block->size - size);
-                allocated_block->size = size;
-                allocated_block->index = index;
-                
-                free_block->size -= size + sizeof(heap_rec_t);
-                allocated_block->prev = free_block->size;
-                
-                return allocated_block;
-            }
-            
-            // Too small to split - take all.
-            free_block->index = index;
-            *ptr = free_block->next;
-
-            return free_block;
-        }
+        remove_free_block(next);
+        rec->size += next->size + sizeof(heap_rec_t);
     }
-    
-    return NULL;
+
+    if (rec->prev != HEAP_MAGIC)
+    {
+        heap_rec_t* prev = prev_block(rec);
+        remove_free_block(prev);
+        prev->size += rec->size + sizeof(heap_rec_t);
+        rec = prev;
+    }
+
+    return rec;
 }
 
-heap_t::heap_rec_t* heap_t::get_new_block(size_t size, int index)
+/**
+ * Shrink busy block @a rec to @a size bytes, returning the tail to the free lists if it is large enough.
+ * The tail is merged with the following block if that one is free.
+ * @return false if the tail was too small to split off, @a rec is unchanged then.
+ */
+bool heap_t::split_block(heap_rec_t* rec, size_t size)
 {
-    heap_rec_t* new_free_block;
+    if (rec->size - size < MIN_FRAG)
+        return false;
+
+    heap_rec_t* remainder = reinterpret_cast<heap_rec_t*>(reinterpret_cast<char*>(rec + 1) + size);
+    remainder->size = rec->size - size - sizeof(heap_rec_t);
+    remainder->prev = HEAP_MAGIC;
+    rec->size = size;
 
-    if (index != OTHER_INDEX)
-        size = all_sizes[index];
+    remainder = merge_free_neighbours(remainder);
+    insert_free_block(remainder);
+    next_block(remainder)->prev = remainder->size;
 
-    if ((new_free_block = get_new_block_internal(size, index)))
-        return new_free_block;
+    return true;
+}
+
+heap_t::heap_rec_t* heap_t::allocate_block(size_t size)
+{
+    int fl, sl;
+    heap_rec_t* free_block;
+
+    mapping_search(size, &fl, &sl);
+    free_block = find_suitable_block(fl, sl);
+    // Out of space, heap_mod grows the heap with expand_heap() and retries.
+    if (!free_block)
+        return NULL;
 
-    // coalesce some blocks to free up unfragmented space.
-    coalesce();
+    remove_free_block(free_block);
 
-    if ((new_free_block = get_new_block_internal(size, index)))
-        return new_free_block;
+    // If the tail is too small to split - take all.
+    if (!split_block(free_block, size))
+        next_block(free_block)->prev = HEAP_MAGIC;
 
-    // TODO: grow heap if still no space (by approx size + half the current size: flesh out the right numbers)
+    free_block->index = -1;
+    free_block->heap = this;
 
-    return 0;
+    return free_block;
 }
 
 void *heap_t::allocate(size_t size)
@@ -267,37 +298,22 @@ void *heap_t::allocate(size_t size)
     kconsole << "Heap check before allocate(" << size << ")" << endl;
     check_integrity();
 #endif
-    int index;
-    heap_rec_t* free_block;
+    heap_rec_t* block;
 
     if (size == 0)
         return null_malloc;
 
-    size = BLOCK_ALIGN(size);
-    index = find_index(size);
-    free_block = blocks[index];
-    
-    if ((!free_block) || (index == OTHER_INDEX))
-    {
-        free_block = get_new_block(size, index);
-        if (!free_block)
-            return NULL;
-    }
-    else
-    {
-        blocks[index] = free_block->next;
-    }
-    
-    free_block->heap = this;
-    next_block(free_block)->prev = HEAP_MAGIC;
+    block = allocate_block(BLOCK_ALIGN(size));
+    if (!block)
+        return NULL;
 
 #if HEAP_DEBUG
     kconsole << "Heap check after allocate(" << size << ")" << endl;
     check_integrity();
 #endif
 
-    logger::trace() << "heap_t::allocate(" << size << ") returning " << (free_block + 1);
-    return free_block + 1;
+    logger::trace() << "heap_t::allocate(" << size << ") returning " << (block + 1);
+    return block + 1;
 }
 
 void heap_t::free(void *p)
@@ -318,12 +334,15 @@ void heap_t::free(void *p)
     
     to_free = reinterpret_cast<heap_rec_t*>(p) - 1;
     logger::trace() << "heap_t::free(" << p << ") freeing " << to_free;
-    nextblock = next_block(to_free);
-    
-    to_free->next = blocks[to_free->index];
-    blocks[to_free->index] = to_free;
 
+    to_free = merge_free_neighbours(to_free);
+    insert_free_block(to_free);
+    nextblock = next_block(to_free);
     nextblock->prev = to_free->size;
+
+    // Whole expanded segment is free now, it may be given back.
+    if ((nextblock->size == 0) && (nextblock->next == to_free - 1) && (nextblock->next != null_malloc))
+        empty_segment = nextblock->next;
     
 #if HEAP_DEBUG
     kconsole << "Heap check after free(" << p << ")" << endl;
@@ -331,98 +350,247 @@ void heap_t::free(void *p)
 #endif
 }
 
-void* heap_t::realloc(void *ptr, size_t size)
+int heap_t::small_class(size_t size)
+{
+    if (size == 0)
+        return -1;
+
+    size = BLOCK_ALIGN(size);
+    if (size > SMALL_LIMIT)
+        return -1;
+
+    return SMALL_INDEX(size);
+}
+
+int heap_t::block_class(void* p)
 {
-    debugger_t::checkpoint("heap_t::realloc");
-    UNUSED(size);
-    return ptr;
+    if ((p == NULL) || (p == null_malloc))
+        return -1;
+
+    size_t size = (reinterpret_cast<heap_rec_t*>(p) - 1)->size;
+    if (size > SMALL_LIMIT)
+        return -1;
+
+    return SMALL_INDEX(size);
 }
 
-void heap_t::expand(size_t new_size)
+int heap_t::size_class(size_t size)
 {
-/*
-#if HEAP_DEBUG
-    check_integrity();
-#endif
-    // Sanity check.
-    ASSERT(new_size > size());
+    if (size == 0)
+        return -1;
+
+    if (size <= SMALL_LIMIT)
+        return SMALL_INDEX(size);
+
+    int fl, sl;
+    mapping_insert(size, &fl, &sl);
+    return SMALL_BLOCKS + fl - 1;
+}
+
+size_t heap_t::class_max_size(int index)
+{
+    if (index < SMALL_BLOCKS)
+        return _S((index + 1));
+
+    // First level fl holds sizes [2^(fl + FL_SHIFT - 1), 2^(fl + FL_SHIFT)).
+    int bits = index - SMALL_BLOCKS + 1 + FL_SHIFT;
+    if (bits >= int(sizeof(size_t) * 8))
+        return ~size_t(0);
+    return (size_t(1) << bits) - 1;
+}
+
+size_t heap_t::block_size(void* p)
+{
+    if ((p == NULL) || (p == null_malloc))
+        return 0;
+
+    return (reinterpret_cast<heap_rec_t*>(p) - 1)->size;
+}
 
-    kconsole << "Heap expanding from " << int(size()) << " to " << int(new_size) << endl;
+size_t heap_t::largest_free_block()
+{
+    ASSERT(has_lock());
+
+    if (!fl_bitmap)
+        return 0;
 
-    // Get the nearest following page boundary.
-    new_size = page_align_up<size_t>(new_size);
+    // Blocks in the highest non-empty list are larger than in any other list, but not sorted among themselves.
+    int fl = fls_bit(fl_bitmap);
+    int sl = fls_bit(sl_bitmap[fl]);
+    size_t largest = 0;
+    for (heap_rec_t* rec = blocks[fl][sl]; rec; rec = rec->next)
+    {
+        if (rec->size > largest)
+            largest = rec->size;
+    }
+    return largest;
+}
 
-    // Make sure we are not overreaching ourselves.
-    ASSERT(start_address + new_size <= max_address);
+size_t heap_t::allocate_batch(int index, size_t count, void** chain)
+{
+    ASSERT(has_lock());
+    ASSERT(index >= 0 && index < SMALL_BLOCKS);
 
-    // This should always be on a page boundary.
-    uint32_t old_size = size();
+    size_t n;
+    heap_rec_t* free_block;
 
-    uint32_t i = old_size;
-    while(i < new_size)
+    for (n = 0; n < count; ++n)
     {
-        nucleus.mem_mgr().page_frame_allocator().alloc_frame(nucleus.mem_mgr().get_kernel_directory()->mapping(start_address+i), is_kernel);
-        i += PAGE_SIZE;
+        if (!(free_block = allocate_block(_S((index + 1)))))
+            break;
+
+        void** payload = reinterpret_cast<void**>(free_block + 1);
+        *payload = *chain;
+        *chain = payload;
     }
 
-    end_address = start_address + new_size;
-#if HEAP_DEBUG
-    check_integrity();
-#endif
-*/
+    return n;
 }
 
-size_t heap_t::contract(size_t new_size)
+void heap_t::free_batch(void* chain, size_t count)
 {
-/*
-#if HEAP_DEBUG
-    check_integrity();
-#endif
-    // Sanity check.
-    ASSERT(new_size < size());
+    ASSERT(has_lock());
+
+    while (chain && count--)
+    {
+        void* next = *reinterpret_cast<void**>(chain);
+        free(chain);
+        chain = next;
+    }
+}
+
+void* heap_t::init_large_block(address_t start, address_t end)
+{
+    heap_rec_t* rec = reinterpret_cast<heap_rec_t*>(start);
+    rec->prev = HEAP_MAGIC;
+    rec->size = end - start - sizeof(heap_rec_t);
+    rec->index = LARGE_INDEX;
+    rec->heap = NULL;
+    return rec + 1;
+}
+
+bool heap_t::is_large_block(void* p)
+{
+    if ((p == NULL) || (p == null_malloc))
+        return false;
+
+    return (reinterpret_cast<heap_rec_t*>(p) - 1)->index == LARGE_INDEX;
+}
+
+address_t heap_t::large_block_start(void* p)
+{
+    return reinterpret_cast<address_t>(reinterpret_cast<heap_rec_t*>(p) - 1);
+}
+
+void* heap_t::realloc(void* ptr, size_t size)
+{
+    ASSERT(has_lock());
+
+    if ((ptr == NULL) || (ptr == null_malloc))
+        return allocate(size);
+
+    if (size == 0)
+    {
+        free(ptr);
+        return null_malloc;
+    }
+
+    if (resize(ptr, size))
+        return ptr;
 
-    // get the nearest following page boundary.
-    new_size = page_align_up<size_t>(new_size);
+    // Resize only fails when growing, so the whole old block fits.
+    void* res = allocate(size);
+    if (!res)
+        return NULL;
 
-    // Don't contract too far.
-    if (new_size < HEAP_MIN_SIZE)
-        new_size = HEAP_MIN_SIZE;
+    memutils::copy_memory(res, ptr, block_size(ptr));
+    free(ptr);
+    return res;
+}
 
-    // Not gonna contract anymore anyway
-    if (size() == HEAP_MIN_SIZE)
-        return size();
+bool heap_t::resize(void* p, size_t size)
+{
+    ASSERT(has_lock());
 
-    kconsole << "Heap contracting from " << int(size()) << " to " << int(new_size) << endl;
+    if ((p == NULL) || (p == null_malloc) || (size == 0))
+        return false;
 
-    // Make sure we are not overreaching ourselves.
-    ASSERT(new_size > 0);
+    heap_rec_t* rec = reinterpret_cast<heap_rec_t*>(p) - 1;
+    size = BLOCK_ALIGN(size);
 
-    uint32_t old_size = size();
+    // Large blocks have no neighbours in the heap.
+    if (rec->index == LARGE_INDEX)
+        return size <= rec->size;
 
-    uint32_t i = new_size;
-    while(i < old_size)
+    if (size <= rec->size)
     {
-        nucleus.mem_mgr().page_frame_allocator().free_frame(nucleus.mem_mgr().get_kernel_directory()->mapping(start_address+i));
-        i += PAGE_SIZE;
+        split_block(rec, size);
+        return true;
     }
 
-    end_address = start_address + new_size;
-#if HEAP_DEBUG
-    check_integrity();
-#endif
-*/
-    return new_size;
+    // Zero size marks the segment end marker.
+    heap_rec_t* next = next_block(rec);
+    if ((next->size == 0) || (next_block(next)->prev == HEAP_MAGIC))
+        return false;
+
+    if (rec->size + sizeof(heap_rec_t) + next->size < size)
+        return false;
+
+    logger::trace() << "heap_t::resize(" << p << ", " << size << ") growing into " << next;
+    remove_free_block(next);
+    rec->size += sizeof(heap_rec_t) + next->size;
+
+    if (!split_block(rec, size))
+        next_block(rec)->prev = HEAP_MAGIC;
+
+    return true;
+}
+
+void heap_t::expand(address_t start, address_t end)
+{
+    ASSERT(has_lock());
+    ASSERT(end - start >= MIN_HEAP_OVERHEAD + MIN_FRAG);
+
+    logger::trace() << "heap_t::expand(" << start << ".." << end << ")";
+    init_segment(start, end);
+}
+
+address_t heap_t::contract(address_t keep)
+{
+    ASSERT(has_lock());
+
+    heap_rec_t* start_rec = empty_segment;
+    empty_segment = NULL;
+
+    if (!start_rec || (reinterpret_cast<address_t>(start_rec) == keep))
+        return 0;
+
+    // Segment may have been allocated from again since it became free.
+    heap_rec_t* rec = start_rec + 1;
+    heap_rec_t* end_rec = next_block(rec);
+    if ((end_rec->size != 0) || (end_rec->prev == HEAP_MAGIC))
+        return 0;
+
+    logger::trace() << "heap_t::contract() releasing segment " << start_rec;
+    remove_free_block(rec);
+    total_bytes -= (reinterpret_cast<address_t>(end_rec + 1) - reinterpret_cast<address_t>(start_rec));
+    return reinterpret_cast<address_t>(start_rec);
 }
 
 void heap_t::check_integrity()
+{
+    check_segment(start_address, end_address);
+}
+
+void heap_t::check_segment(address_t start, address_t end_addr)
 {
 #if HEAP_DEBUG
-    // We should, by starting at start_address be able to walk through all blocks/holes and check their magic numbers.
+    // We should, by starting at the segment start be able to walk through all blocks/holes and check their magic numbers.
     heap_rec_t* last_header = NULL;
-    heap_rec_t* this_header = reinterpret_cast<heap_rec_t*>(start_address);
+    heap_rec_t* this_header = reinterpret_cast<heap_rec_t*>(start);
     heap_rec_t* next_header = next_block(this_header);
 
-    void *end = reinterpret_cast<void*>(end_address);
+    void *end = reinterpret_cast<void*>(end_addr);
 
     if (next_header >= end)
         next_header = NULL;
@@ -432,12 +600,12 @@ void heap_t::check_integrity()
     while (this_header)
     {
         kconsole << "Heap: checking block " << this_header << endl;
-        if (this_header->index > OTHER_INDEX)
+        if (this_header->index >= FL_COUNT * SL_COUNT)
         {
             kconsole << LIGHTRED << "Heap integrity check: free list index " << this_header->index << " in block " << this_header << " is invalid." << endl;
             PANIC("Heap corruption!");
         }
-        if (start_address + this_header->size >= end_address)
+        if (start + this_header->size >= end_addr)
         {
             kconsole << LIGHTRED << "Heap integrity check: block " << this_header << " size " << int(this_header->size) << " is invalid." << endl;
             PANIC("Heap corruption!");
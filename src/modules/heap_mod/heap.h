@@ -12,27 +12,28 @@
 #include "heap_v1_interface.h"
 #include "lockable.h"
 
-//At least sizeof(heap_t)+3*sizeof(heap_t::heap_rec_t)
-#define HEAP_MIN_SIZE (256)
+// Smallest space for blocks in a raw heap, not counting the heap_v1 state and heap_t in front of it.
+// One page, so the heap serves some allocations before it needs a stretch allocator to expand.
+#define HEAP_MIN_SIZE (4096)
 
 /**
- * Implements a heap. The algorithm is based on dlmalloc and uses tagged
- * areas plus free blocks lists (sorted by allocation size).
+ * Implements a heap. The algorithm is based on TLSF and uses tagged
+ * areas plus segregated free blocks lists indexed by a two-level bitmap.
  * Every free or allocated area (block) has a header and footer around it.
  * The footer has a pointer to the header, with the header also containing
  * size information.
  */
-class heap_t : public lockable_t
+class heap_t : public mcs_lock_t
 {
 public:
-    inline heap_t() : lockable_t() {}
+    inline heap_t() : mcs_lock_t() {}
 
     /**
      * Create a new Heap, with start address @a start, initial size @a end minus @a start,
      * and expanding up to a maximum address of @a max.
      */
     inline heap_t(address_t start, address_t end)//, heap_v1_closure* heap_closure)
-        : lockable_t()
+        : mcs_lock_t()
     {
         init(start, end);//, heap_closure);
     }
@@ -53,15 +54,28 @@ public:
 
     /**
      * Reallocate memory block starting at @a ptr to be of size @a size.
-     * @return start address of the memory block.
+     * The block is resized in place if possible, otherwise moved.
+     * @return start address of the memory block, or NULL if out of memory (@a ptr stays valid then).
      */
     void* realloc(void* ptr, size_t size);
 
     /**
-     * Tries to detect buffer overruns by walking the heap and checking magic numbers.
+     * Resize allocated block @a p in place to @a size bytes. Shrinking returns the tail to the free lists,
+     * growing takes space from the following block if it is free.
+     * @return false if the block cannot be grown in place.
+     */
+    bool resize(void* p, size_t size);
+
+    /**
+     * Tries to detect buffer overruns by walking the initial segment and checking magic numbers.
      */
     void check_integrity();
 
+    /**
+     * Same check for segment [@a start, @a end) added by @a expand.
+     */
+    void check_segment(address_t start, address_t end);
+
     /**
      * @return the current heap size. For analysis purposes.
      */
@@ -70,29 +84,121 @@ public:
         return end_address - start_address;
     }
 
-private:
     /**
-     * Increase the size of the heap, by requesting pages to be allocated.
-     * Heap size increases from @a size to the nearest page boundary above @a new_size.
+     * @return small size class serving an allocation of @a size bytes, or -1 if the request is
+     * not served from one of the SMALL_BLOCKS free lists.
+     */
+    static int small_class(size_t size);
+
+    /**
+     * @return size class of allocated block @a p, or -1 for NULL and zero-sized allocations.
      */
-    void expand(size_t new_size);
+    int block_class(void* p);
 
     /**
-     * Decrease the size of the heap, by requesting pages to be deallocated.
-     * Heap size decreases from @a size to the nearest page boundary above @a new_size.
-     * @returns the new size (end_address minus start_address) which is not guaranteed to be the
-     * same as @a new_size.
+     * Allocate up to @a count blocks of small class @a index at once, chained through their
+     * first payload word into @a chain. Used to refill per-vcpu magazines.
+     * @return number of blocks actually allocated.
      */
-    size_t contract(size_t new_size);
+    size_t allocate_batch(int index, size_t count, void** chain);
 
-    int find_index(size_t size);
+    /**
+     * Release @a count blocks chained through their first payload word starting at @a chain.
+     * Used to drain per-vcpu magazines.
+     */
+    void free_batch(void* chain, size_t count);
+
+    /**
+     * Increase the size of the heap by adding memory region [@a start, @a end) to it.
+     * The region is an independent segment, blocks are never merged across segments.
+     */
+    void expand(address_t start, address_t end);
+
+    /**
+     * Decrease the size of the heap by taking out the most recent segment that became entirely free,
+     * unless it is the segment starting at @a keep.
+     * @return start of the segment taken out, or 0 if there is none.
+     */
+    address_t contract(address_t keep);
+
+    /**
+     * @return true if some expanded segment became entirely free. Only a hint when called without the lock.
+     */
+    inline bool can_contract()
+    {
+        return empty_segment != NULL;
+    }
+
+    /**
+     * @return statistics size class of a block with @a size bytes of payload, or -1 for zero size.
+     * Small sizes have a class per SMALL_BLOCKS size, larger ones a class per power of two.
+     */
+    static int size_class(size_t size);
+
+    /**
+     * @return largest block size belonging to statistics size class @a index.
+     */
+    static size_t class_max_size(int index);
+
+    /**
+     * @return payload size of allocated block @a p, or 0 for NULL and zero-sized allocations.
+     */
+    size_t block_size(void* p);
+
+    /**
+     * @return number of free blocks of statistics size class @a index.
+     */
+    inline size_t free_blocks(int index)
+    {
+        return free_counts[index];
+    }
+
+    /**
+     * @return total payload size of all free blocks.
+     */
+    inline size_t free_size()
+    {
+        return free_bytes;
+    }
+
+    /**
+     * @return memory managed by the heap in all segments, including block headers.
+     */
+    inline size_t total_size()
+    {
+        return total_bytes;
+    }
+
+    /**
+     * @return payload size of the largest free block. Walks one free list.
+     */
+    size_t largest_free_block();
+
+    /**
+     * Lay out a large block over memory [@a start, @a end) obtained outside of the heap.
+     * Large blocks carry the same header as heap blocks, so block_size() works on them.
+     * @return start of the block payload.
+     */
+    static void* init_large_block(address_t start, address_t end);
+
+    /**
+     * @return true if @a p was set up with init_large_block() rather than allocated from this heap.
+     */
+    bool is_large_block(void* p);
+
+    /**
+     * @return start address large block @a p was laid out from.
+     */
+    static address_t large_block_start(void* p);
+
+    static const int SMALL_BLOCKS = 16;
 
 private:
     struct heap_rec_t
     {
         memory_v1::size  prev;  // either a magic or size of previous block (backlink).
         memory_v1::size  size;  // size of allocated block, including the end footer.
-        int32_t          index; // allocation table index.
+        int32_t          index; // free list index (when free).
         union {
             heap_t*      heap;  // when busy
             heap_rec_t*  next;  // when free
@@ -101,27 +207,53 @@ private:
 
     static heap_rec_t* prev_block(heap_rec_t* rec);
     static heap_rec_t* next_block(heap_rec_t* rec);
-    heap_rec_t* get_new_block(size_t size, int index);
-    heap_rec_t* get_new_block_internal(size_t size, int index);
+    static heap_rec_t*& prev_free(heap_rec_t* rec);
+    heap_rec_t* init_segment(address_t start, address_t end);
 
-    void coalesce();
-    void coalesce_merge_blocks(int32_t index);
-    void coalesce_move_blocks(int32_t index);
+    /**
+     * Two-level segregated fit: first level splits sizes by power of two, second level splits
+     * each power of two range linearly into SL_COUNT lists. Sizes below SMALL_BLOCK_SIZE all
+     * live in first level 0 with one list per word size. A bitmap of non-empty lists at each
+     * level lets us find a fitting block with a couple of find-first-set operations.
+     */
+    static void mapping_insert(size_t size, int* fl, int* sl);
+    static void mapping_search(size_t size, int* fl, int* sl);
+    heap_rec_t* find_suitable_block(int fl, int sl);
+    void insert_free_block(heap_rec_t* rec);
+    void remove_free_block(heap_rec_t* rec);
+    heap_rec_t* allocate_block(size_t size);
+    bool split_block(heap_rec_t* rec, size_t size);
+    heap_rec_t* merge_free_neighbours(heap_rec_t* rec);
 
-    static const int SMALL_BLOCKS = 16;
-    static const int LARGE_BLOCKS = 24;
-    static const int COUNT = (SMALL_BLOCKS + LARGE_BLOCKS + 1);
-    static const memory_v1::size all_sizes[COUNT];
+    static const int SL_LOG = 4;
+    static const int SL_COUNT = 1 << SL_LOG;
+    static const int FL_SHIFT = SL_LOG + 3; // 3 for word alignment
+    static const int FL_COUNT = sizeof(size_t) * 8 - FL_SHIFT + 1;
+    static const size_t SMALL_BLOCK_SIZE = 1 << FL_SHIFT;
+
+public:
+    static const int STAT_CLASSES = SMALL_BLOCKS + FL_COUNT - 1;
+    static const size_t LARGE_OVERHEAD = sizeof(heap_rec_t); // header space init_large_block() needs
+
+private:
 
-    heap_rec_t* blocks[COUNT];
+    size_t fl_bitmap;
+    uint32_t sl_bitmap[FL_COUNT];
+    heap_rec_t* blocks[FL_COUNT][SL_COUNT];
     heap_rec_t* null_malloc;
+    heap_rec_t* empty_segment; // start marker of an expanded segment which became entirely free
+
+    // Statistics, updated together with the free lists.
+    size_t free_counts[STAT_CLASSES];
+    size_t free_bytes;
+    size_t total_bytes;
 
     /**
      * The start of our allocated space.
      */
     address_t start_address;
     /**
-     * The end of our currently allocated space. May be expanded if heap type supports it.
+     * The end of our initial space. Expanded segments are placed elsewhere.
      */
     address_t end_address;
 };
@@ -0,0 +1,99 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "heap.h"
+
+/**
+ * Per-vcpu magazine of small blocks in front of heap_t.
+ *
+ * Blocks parked in a magazine stay allocated as far as heap_t is concerned and are chained
+ * through their first payload word. Push and pop run without the heap lock, only a refill
+ * or drain of a whole batch goes to the locked heap_t.
+ */
+struct heap_magazine_t
+{
+    static const size_t ROUNDS = 32; // maximum blocks cached per size class
+    static const size_t BATCH = 16;  // blocks moved between magazine and heap_t at once
+
+    struct stack_t
+    {
+        void*  top;
+        size_t count;
+    };
+
+    stack_t stacks[heap_t::SMALL_BLOCKS];
+
+    inline void init()
+    {
+        for (int i = 0; i < heap_t::SMALL_BLOCKS; ++i)
+        {
+            stacks[i].top = 0;
+            stacks[i].count = 0;
+        }
+    }
+
+    inline void* pop(int index)
+    {
+        stack_t& s = stacks[index];
+        void* p = s.top;
+        if (p)
+        {
+            s.top = *reinterpret_cast<void**>(p);
+            --s.count;
+        }
+        return p;
+    }
+
+    /**
+     * @return false if the stack is full and must be drained first.
+     */
+    inline bool push(int index, void* p)
+    {
+        stack_t& s = stacks[index];
+        if (s.count >= ROUNDS)
+            return false;
+        *reinterpret_cast<void**>(p) = s.top;
+        s.top = p;
+        ++s.count;
+        return true;
+    }
+
+    /**
+     * Adopt a chain of @a count blocks obtained from heap_t::allocate_batch().
+     */
+    inline void load(int index, void* chain, size_t count)
+    {
+        stacks[index].top = chain;
+        stacks[index].count = count;
+    }
+
+    /**
+     * Detach up to BATCH blocks from the top of the stack for heap_t::free_batch().
+     * @return number of blocks detached, chain head in @a chain.
+     */
+    inline size_t unload(int index, void** chain)
+    {
+        stack_t& s = stacks[index];
+        size_t n = 0;
+        void* last = 0;
+
+        *chain = s.top;
+        for (void* p = s.top; p && n < BATCH; p = *reinterpret_cast<void**>(p), ++n)
+            last = p;
+
+        if (last)
+        {
+            s.top = *reinterpret_cast<void**>(last);
+            *reinterpret_cast<void**>(last) = 0;
+        }
+        s.count -= n;
+        return n;
+    }
+};
@@ -11,73 +11,463 @@
 #include "heap_factory_v1_impl.h"
 #include "heap_v1_interface.h"
 #include "heap_v1_impl.h"
+#include "stretch_v1_interface.h"
+#include "stretch_allocator_v1_interface.h"
 #include "heap.h"
+#include "heap_magazine.h"
+#include "arena_heap.h"
+#include "per_cpu.h"
 #include "memory.h"
+#include "memutils.h"
+#include "macros.h"
 #include "default_console.h"
 #include "exceptions.h"
 #include "panic.h"
+#include "logger.h"
 
 //======================================================================================================================
 // heap_v1 implementation
 //======================================================================================================================
 
+// Minimum size of a stretch to grow the heap by.
+#define HEAP_CHUNK_SIZE (64*KiB)
+// Allocations of this size and up get a stretch of their own in realized heaps.
+#define HEAP_LARGE_SIZE (16*KiB)
+
+/**
+ * Header placed at the start of every stretch the heap was expanded with.
+ */
+struct heap_chunk_t
+{
+    heap_chunk_t*          next;
+    stretch_v1::closure_t* stretch;
+    memory_v1::size        size;    //!< Size of the stretch, the heap segment follows this header.
+};
+
+/**
+ * Header placed at the start of a large allocation stretch, followed by the heap_t block header.
+ */
+struct heap_large_t
+{
+    stretch_v1::closure_t* stretch;
+    memory_v1::size        size;
+};
+
+/**
+ * Usage counters of one size class, kept per vcpu so that counting needs no lock.
+ * Live bytes go negative on a vcpu which frees blocks allocated by another one.
+ */
+struct heap_class_counters_t
+{
+    uint64_t allocations;
+    uint64_t frees;
+    int64_t  live_bytes;
+    int64_t  peak_bytes;
+};
+
 struct heap_v1::state_t
 {
     heap_v1::closure_t closure;
     heap_t* heap;
+    heap_magazine_t magazines[MAX_CPUS];
+    heap_class_counters_t counters[MAX_CPUS][heap_t::STAT_CLASSES];
+
+    lock_stats_t lock_stats;
+
+    memory_v1::address where;      //!< Raw heap location, as passed to create_raw.
+    memory_v1::size size;
+
+    // Only set for realized heaps.
+    stretch_v1::closure_t* stretch;               //!< Stretch mapped over the raw heap.
+    stretch_allocator_v1::closure_t* allocator;   //!< Source of stretches to expand with.
+    protection_domain_v1::id pdid;                //!< Owner of expansion stretches.
+    heap_chunk_t* chunks;                         //!< Expansion stretches, most recent first.
+    memory_v1::size large_bytes;                  //!< Size of all large allocation stretches.
+    bool expanding;                               //!< Stretch allocator call in progress.
 };
 
-static memory_v1::address heap_v1_allocate(heap_v1::closure_t* self, memory_v1::size size)
+typedef mcs_scope_lock_t heap_scope_lock_t;
+
+static inline heap_magazine_t& local_magazine(heap_v1::state_t* state)
 {
-#if !SMP
-    ASSERT(!self->d_state->heap->has_lock());
-#endif
-    lockable_scope_lock_t lock(*self->d_state->heap);
-    void* res = 0;
+    return state->magazines[this_cpu()];
+}
+
+/**
+ * Account an allocated block of @a size bytes. Caller must be in a per-vcpu section.
+ */
+static inline void count_allocation(heap_v1::state_t* state, size_t size)
+{
+    int index = heap_t::size_class(size);
+    if (index < 0)
+        return;
+
+    heap_class_counters_t& c = state->counters[this_cpu()][index];
+    ++c.allocations;
+    c.live_bytes += size;
+    if (c.live_bytes > c.peak_bytes)
+        c.peak_bytes = c.live_bytes;
+}
+
+static inline void count_free(heap_v1::state_t* state, size_t size)
+{
+    int index = heap_t::size_class(size);
+    if (index < 0)
+        return;
 
-    // This mega-ugly is here because we behave differently before and after the exceptions module is instantiated...
-    if (PVS(exceptions))
+    heap_class_counters_t& c = state->counters[this_cpu()][index];
+    ++c.frees;
+    c.live_bytes -= size;
+}
+
+/**
+ * Serve a small allocation from the local magazine, refilling it with a batch from the heap when empty.
+ * @return NULL if the heap is exhausted, caller then takes the slow path to report it.
+ */
+static void* magazine_allocate(heap_v1::state_t* state, int index)
+{
+    per_cpu_section_t guard;
+    heap_magazine_t& mag = local_magazine(state);
+
+    void* res = mag.pop(index);
+    if (!res)
     {
-        OS_TRY {
-            res = self->d_state->heap->allocate(size);
+        void* chain = 0;
+        size_t n;
+        {
+            heap_scope_lock_t lock(*state->heap);
+            n = state->heap->allocate_batch(index, heap_magazine_t::BATCH, &chain);
         }
-        OS_FINALLY {
-            lock.unlock();
+        mag.load(index, chain, n);
+        res = mag.pop(index);
+    }
+    if (res)
+        count_allocation(state, state->heap->block_size(res));
+    return res;
+}
+
+static void magazine_free(heap_v1::state_t* state, int index, void* ptr)
+{
+    per_cpu_section_t guard;
+    heap_magazine_t& mag = local_magazine(state);
+
+    count_free(state, state->heap->block_size(ptr));
+
+    if (!mag.push(index, ptr))
+    {
+        void* chain;
+        size_t n = mag.unload(index, &chain);
+        {
+            heap_scope_lock_t lock(*state->heap);
+            state->heap->free_batch(chain, n);
         }
-        OS_ENDTRY
+        mag.push(index, ptr);
+    }
+}
 
-        if (!res)
-            OS_RAISE((exception_support_v1::id)"heap_v1.no_memory", NULL);
+/**
+ * Get a stretch of at least @a size bytes accessible to the heap owner.
+ * Must be called without the heap lock, as the stretch allocator allocates from this heap too.
+ * The stretch is zeroed, frames may come from another domain and must not leak their contents into blocks.
+ */
+static stretch_v1::closure_t* new_stretch(heap_v1::state_t* state, memory_v1::size size)
+{
+    if (!state->allocator || state->expanding)
+        return NULL;
+
+    state->expanding = true;
+    memory_v1::physmem_desc null_pmem; // Not used by the nailed allocator.
+    stretch_v1::closure_t* stretch = state->allocator->create_at(size, stretch_v1::rights(), ANY_ADDRESS, memory_v1::attrs_zeroed, null_pmem);
+    state->expanding = false;
+
+    if (!stretch)
+    {
+        logger::warning() << __FUNCTION__ << ": cannot get a " << size << " bytes stretch";
+        return NULL;
     }
-    else
+
+    stretch->set_rights(state->pdid, stretch_v1::rights(stretch_v1::right_read).add(stretch_v1::right_write));
+    return stretch;
+}
+
+/**
+ * Expand a realized heap with a new stretch big enough for allocation of @a size bytes.
+ */
+static bool expand_heap(heap_v1::state_t* state, memory_v1::size size)
+{
+    // Leave room for the chunk header, segment markers and free list rounding.
+    memory_v1::size chunk_size = page_align_up(size + (size >> 3) + sizeof(heap_chunk_t) + PAGE_SIZE);
+    if (chunk_size < HEAP_CHUNK_SIZE)
+        chunk_size = HEAP_CHUNK_SIZE;
+
+    stretch_v1::closure_t* stretch = new_stretch(state, chunk_size);
+    if (!stretch)
+        return false;
+
+    memory_v1::size stretch_size;
+    heap_chunk_t* chunk = reinterpret_cast<heap_chunk_t*>(stretch->info(&stretch_size));
+    chunk->stretch = stretch;
+    chunk->size = stretch_size;
+
+    heap_scope_lock_t lock(*state->heap);
+    chunk->next = state->chunks;
+    state->chunks = chunk;
+    state->heap->expand(reinterpret_cast<address_t>(chunk + 1), reinterpret_cast<address_t>(chunk) + stretch_size);
+
+    return true;
+}
+
+/**
+ * Give back an expansion stretch which became entirely free. The most recent one is kept to avoid
+ * thrashing on allocate/free cycles around the heap size boundary.
+ */
+static void contract_heap(heap_v1::state_t* state)
+{
+    if (!state->chunks || !state->heap->can_contract())
+        return;
+
+    heap_chunk_t* chunk = NULL;
     {
-        // Cannot RAISE here at all!
-        res = self->d_state->heap->allocate(size);
+        heap_scope_lock_t lock(*state->heap);
+        address_t start = state->heap->contract(reinterpret_cast<address_t>(state->chunks + 1));
+        if (!start)
+            return;
+
+        for (heap_chunk_t** ptr = &state->chunks; *ptr; ptr = &(*ptr)->next)
+        {
+            if (reinterpret_cast<address_t>(*ptr + 1) == start)
+            {
+                chunk = *ptr;
+                *ptr = chunk->next;
+                break;
+            }
+        }
     }
 
+    ASSERT(chunk);
+    state->allocator->destroy_stretch(chunk->stretch);
+}
+
+/**
+ * Give a large allocation a stretch of its own, so that it neither fragments the heap nor keeps memory after free.
+ * @return NULL if there is no stretch allocator or it fails, caller then falls back to the heap.
+ */
+static void* allocate_large(heap_v1::state_t* state, memory_v1::size size)
+{
+    stretch_v1::closure_t* stretch = new_stretch(state, page_align_up(size + sizeof(heap_large_t) + heap_t::LARGE_OVERHEAD));
+    if (!stretch)
+        return NULL;
+
+    memory_v1::size stretch_size;
+    heap_large_t* large = reinterpret_cast<heap_large_t*>(stretch->info(&stretch_size));
+    large->stretch = stretch;
+    large->size = stretch_size;
+
+    {
+        heap_scope_lock_t lock(*state->heap);
+        state->large_bytes += stretch_size;
+    }
+
+    address_t start = reinterpret_cast<address_t>(large + 1);
+    return heap_t::init_large_block(start, reinterpret_cast<address_t>(large) + stretch_size);
+}
+
+static void free_large(heap_v1::state_t* state, void* ptr)
+{
+    heap_large_t* large = reinterpret_cast<heap_large_t*>(heap_t::large_block_start(ptr)) - 1;
+
+    {
+        heap_scope_lock_t lock(*state->heap);
+        state->large_bytes -= large->size;
+    }
+
+    state->allocator->destroy_stretch(large->stretch);
+}
+
+static void* locked_allocate(heap_v1::state_t* state, memory_v1::size size)
+{
+#if !SMP
+    ASSERT(!state->heap->has_lock());
+#endif
+    heap_scope_lock_t lock(*state->heap);
+    return state->heap->allocate(size);
+}
+
+static memory_v1::address heap_v1_allocate(heap_v1::closure_t* self, memory_v1::size size)
+{
+    int index = heap_t::small_class(size);
+    if (index >= 0)
+    {
+        void* res = magazine_allocate(self->d_state, index);
+        if (res)
+            return reinterpret_cast<memory_v1::address>(res);
+        // Fall through to the locked path which raises no_memory properly.
+    }
+
+    void* res = NULL;
+    if (size >= HEAP_LARGE_SIZE)
+        res = allocate_large(self->d_state, size);
+
+    if (!res)
+        res = locked_allocate(self->d_state, size);
+
+    if (!res && expand_heap(self->d_state, size))
+        res = locked_allocate(self->d_state, size);
+
+    if (res)
+    {
+        per_cpu_section_t guard;
+        count_allocation(self->d_state, self->d_state->heap->block_size(res));
+    }
+
+    // We behave differently before and after the exceptions module is instantiated...
+    if (!res && PVS(exceptions))
+        OS_RAISE((exception_support_v1::id)"heap_v1.no_memory", NULL);
+
     return reinterpret_cast<memory_v1::address>(res);
 }
 
 static void heap_v1_free(heap_v1::closure_t* self, memory_v1::address ptr)
 {
+    // Caller owns the block, so its header is stable without the lock.
+    int index = self->d_state->heap->block_class(reinterpret_cast<void*>(ptr));
+    if (index >= 0 && index < heap_t::SMALL_BLOCKS)
+    {
+        magazine_free(self->d_state, index, reinterpret_cast<void*>(ptr));
+    }
+    else
+    {
+        {
+            per_cpu_section_t guard;
+            count_free(self->d_state, self->d_state->heap->block_size(reinterpret_cast<void*>(ptr)));
+        }
+
+        if (self->d_state->heap->is_large_block(reinterpret_cast<void*>(ptr)))
+        {
+            free_large(self->d_state, reinterpret_cast<void*>(ptr));
+            return;
+        }
+
 #if !SMP
-    ASSERT(!self->d_state->heap->has_lock());
+        ASSERT(!self->d_state->heap->has_lock());
 #endif
-    lockable_scope_lock_t lock(*self->d_state->heap);
-    self->d_state->heap->free(reinterpret_cast<void*>(ptr));
+        heap_scope_lock_t lock(*self->d_state->heap);
+        self->d_state->heap->free(reinterpret_cast<void*>(ptr));
+    }
+
+    contract_heap(self->d_state);
+}
+
+/**
+ * Blocks are resized in place when possible, which counts as a free and an allocation in the statistics.
+ * Large blocks stay in their stretch as long as the new size is still large and fits.
+ */
+static memory_v1::address heap_v1_realloc(heap_v1::closure_t* self, memory_v1::address ptr, memory_v1::size size)
+{
+    heap_v1::state_t* state = self->d_state;
+    void* p = reinterpret_cast<void*>(ptr);
+
+    if (!p)
+        return heap_v1_allocate(self, size);
+
+    size_t old_size = state->heap->block_size(p);
+    bool resized = false;
+
+    if (state->heap->is_large_block(p))
+        resized = (size >= HEAP_LARGE_SIZE) && (size <= old_size);
+    else if (size > 0)
+    {
+        heap_scope_lock_t lock(*state->heap);
+        resized = state->heap->resize(p, size);
+    }
+
+    if (resized)
+    {
+        per_cpu_section_t guard;
+        count_free(state, old_size);
+        count_allocation(state, state->heap->block_size(p));
+        return ptr;
+    }
+
+    memory_v1::address res = heap_v1_allocate(self, size);
+    if (!res)
+        return 0;
+
+    memutils::copy_memory(res, ptr, old_size < size ? old_size : size);
+    heap_v1_free(self, ptr);
+    return res;
 }
 
 static void heap_v1_check(heap_v1::closure_t* self, bool /*check_free_blocks*/)
 {
-    lockable_scope_lock_t lock(*self->d_state->heap);
-    self->d_state->heap->check_integrity();
+    heap_v1::state_t* state = self->d_state;
+    heap_scope_lock_t lock(*state->heap);
+    state->heap->check_integrity();
+    for (heap_chunk_t* chunk = state->chunks; chunk; chunk = chunk->next)
+        state->heap->check_segment(reinterpret_cast<address_t>(chunk + 1), reinterpret_cast<address_t>(chunk) + chunk->size);
+}
+
+/**
+ * Blocks parked in magazines count as live here, as they are not available to other vcpus.
+ */
+static heap_v1::stats heap_v1_get_stats(heap_v1::closure_t* self)
+{
+    heap_v1::state_t* state = self->d_state;
+    heap_v1::stats s;
+
+    heap_scope_lock_t lock(*state->heap);
+
+    s.total_bytes = state->heap->total_size() + state->large_bytes;
+    s.free_bytes = state->heap->free_size();
+    s.largest_free = state->heap->largest_free_block();
+    s.fragmentation = s.free_bytes ? uint32_t(100 - (uint64_t(s.largest_free) * 100) / s.free_bytes) : 0;
+    s.classes = heap_t::STAT_CLASSES;
+    s.lock_acquisitions = state->lock_stats.acquisitions;
+    s.lock_contended = state->lock_stats.contended;
+    s.lock_spins = state->lock_stats.spins;
+
+    return s;
+}
+
+/**
+ * Peak bytes are summed over per-vcpu peaks, so they are exact on uniprocessor and an upper bound otherwise.
+ */
+static bool heap_v1_get_class_stats(heap_v1::closure_t* self, uint32_t index, heap_v1::class_stats* s)
+{
+    heap_v1::state_t* state = self->d_state;
+
+    if (index >= uint32_t(heap_t::STAT_CLASSES))
+        return false;
+
+    int64_t live = 0, peak = 0;
+    s->max_size = heap_t::class_max_size(index);
+    s->allocations = 0;
+    s->frees = 0;
+    for (size_t cpu = 0; cpu < MAX_CPUS; ++cpu)
+    {
+        heap_class_counters_t& c = state->counters[cpu][index];
+        s->allocations += c.allocations;
+        s->frees += c.frees;
+        live += c.live_bytes;
+        peak += c.peak_bytes;
+    }
+    s->live_bytes = live > 0 ? live : 0;
+    s->peak_bytes = peak;
+
+    heap_scope_lock_t lock(*state->heap);
+    s->free_blocks = state->heap->free_blocks(index);
+
+    return true;
 }
 
 static const heap_v1::ops_t heap_v1_methods =
 {
     heap_v1_allocate,
     heap_v1_free,
-    heap_v1_check
+    heap_v1_realloc,
+    heap_v1_check,
+    heap_v1_get_stats,
+    heap_v1_get_class_stats
 };
 
 //======================================================================================================================
@@ -89,7 +479,7 @@ static heap_v1::closure_t* heap_factory_v1_create_raw(heap_factory_v1::closure_t
     kconsole << __FUNCTION__ << ": at " << where << " with " << int(size) << " bytes." << endl;
 
     size = page_align_up(size);
-    if (size < HEAP_MIN_SIZE - sizeof(heap_v1::state_t))
+    if (size < HEAP_MIN_SIZE + sizeof(heap_v1::state_t) + sizeof(heap_t))
     {
         kconsole << __FUNCTION__ << ": too small heap requested, not allocating!" << endl;
         return 0;
@@ -104,33 +494,77 @@ static heap_v1::closure_t* heap_factory_v1_create_raw(heap_factory_v1::closure_t
     address_t start = where + sizeof(heap_v1::state_t) + sizeof(heap_t);
     // TODO: heap could be constructed as a member of state_t?
     state->heap = new(reinterpret_cast<void*>(where + sizeof(heap_v1::state_t))) heap_t(start, end);
+    for (int i = 0; i < MAX_CPUS; ++i)
+    {
+        state->magazines[i].init();
+        memutils::clear_memory(state->counters[i], sizeof(state->counters[i]));
+    }
+    state->lock_stats.reset();
+    state->heap->set_stats(&state->lock_stats);
+
+    state->where = where;
+    state->size = size;
+    state->stretch = NULL;
+    state->allocator = NULL;
+    state->pdid = NULL_PDID;
+    state->chunks = NULL;
+    state->large_bytes = 0;
+    state->expanding = false;
 
     return ret;
 }
 
 static memory_v1::address heap_factory_v1_where(heap_factory_v1::closure_t* self, heap_v1::closure_t* heap, memory_v1::size* size)
 {
-    return 0;
+    *size = heap->d_state->size;
+    return heap->d_state->where;
 }
 
 /**
  * Realize is used to turn a 'raw' heap into a stretch-based one, and requires that the given stretch maps exactly over
- * the frames of the original heap.
+ * the frames of the original heap. A realized heap expands on demand with stretches from @a allocator, accessible to
+ * protection domain @a pdid, and gives them back when they become entirely free.
  */
-static heap_v1::closure_t* heap_factory_v1_realize(heap_factory_v1::closure_t* self, heap_v1::closure_t* raw_heap, stretch_v1::closure_t* stretch)
+static heap_v1::closure_t* heap_factory_v1_realize(heap_factory_v1::closure_t* self, heap_v1::closure_t* raw_heap, stretch_v1::closure_t* stretch, stretch_allocator_v1::closure_t* allocator, protection_domain_v1::id pdid)
 {
-    // switch heap type to 'stretch'
-    // clear out all stretches
-    // map given stretch as a single stretch
-    // replace ops with stretch based ones
+    heap_v1::state_t* state = raw_heap->d_state;
+
+    memory_v1::size size;
+    memory_v1::address base = stretch->info(&size);
+    if ((base != page_align_down(state->where)) || (base + size < state->where + state->size))
+    {
+        kconsole << __FUNCTION__ << ": stretch [" << base << ".." << base + size << ") does not cover heap at " << state->where << endl;
+        return raw_heap;
+    }
+
+    state->stretch = stretch;
+    state->allocator = allocator;
+    state->pdid = pdid;
+
     return raw_heap;
 }
 
+static heap_v1::closure_t* heap_factory_v1_create_arena(heap_factory_v1::closure_t* self, stretch_allocator_v1::closure_t* allocator, protection_domain_v1::id pdid, memory_v1::size chunk_size)
+{
+    heap_v1::closure_t* arena = create_arena_heap(allocator, pdid, chunk_size);
+    if (!arena && PVS(exceptions))
+        OS_RAISE((exception_support_v1::id)"heap_v1.no_memory", NULL);
+    return arena;
+}
+
+static void heap_factory_v1_destroy_arena(heap_factory_v1::closure_t* self, heap_v1::closure_t* arena)
+{
+    if (!destroy_arena_heap(arena))
+        kconsole << __FUNCTION__ << ": heap " << arena << " is not an arena!" << endl;
+}
+
 static const heap_factory_v1::ops_t heap_factory_v1_methods =
 {
     heap_factory_v1_create_raw,
     heap_factory_v1_where,
-    heap_factory_v1_realize
+    heap_factory_v1_realize,
+    heap_factory_v1_create_arena,
+    heap_factory_v1_destroy_arena
 };
 
 static heap_factory_v1::closure_t clos =
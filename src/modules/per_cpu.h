@@ -0,0 +1,50 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "vcpu_v1_interface.h"
+#include "infopage.h"
+#include "cpu.h"
+
+// x86_cpu_t::id() is always 0 until SMP bringup is done.
+#define MAX_CPUS 1
+
+inline size_t this_cpu()
+{
+    return x86_cpu_t::id();
+}
+
+/**
+ * Per-vcpu data is only touched by the vcpu itself, so keeping activations off is enough to own it.
+ * Before the vcpu is set up in pervasives we are running single-threaded anyway.
+ */
+class per_cpu_section_t
+{
+    vcpu_v1::closure_t* vcpu;
+    bool reenable;
+public:
+    inline per_cpu_section_t() : vcpu(PVS(vcpu)), reenable(false)
+    {
+        if (vcpu)
+        {
+            reenable = vcpu->are_activations_enabled();
+            if (reenable)
+                vcpu->disable_activations();
+        }
+    }
+    inline ~per_cpu_section_t()
+    {
+        if (reenable)
+        {
+            vcpu->enable_activations();
+            if (vcpu->are_events_pending())
+                vcpu->rfa();
+        }
+    }
+};
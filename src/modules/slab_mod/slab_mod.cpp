@@ -0,0 +1,419 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "slab_factory_v1_interface.h"
+#include "slab_factory_v1_impl.h"
+#include "slab_cache_v1_interface.h"
+#include "slab_cache_v1_impl.h"
+#include "slab_object_v1_interface.h"
+#include "heap_v1_interface.h"
+#include "heap_new.h"
+#include "per_cpu.h"
+#include "lockable.h"
+#include "memory.h"
+#include "default_console.h"
+#include "exceptions.h"
+#include "panic.h"
+
+// Slabs are sized to about a page, but hold at least SLAB_MIN_OBJECTS objects.
+#define SLAB_TARGET_SIZE PAGE_SIZE
+#define SLAB_MIN_OBJECTS 8
+// Maximum objects kept on a per-vcpu free list.
+#define SLAB_ROUNDS 32
+// Objects moved between per-vcpu and shared free lists at once.
+#define SLAB_BATCH 16
+
+//======================================================================================================================
+// state structures
+//======================================================================================================================
+
+/**
+ * Header at the start of every slab, objects follow it.
+ */
+struct slab_t
+{
+    slab_t*   next;
+    address_t objects;
+    size_t    n_free;   //!< Only valid during reap.
+};
+
+/**
+ * Per-vcpu free list and counters.
+ */
+struct free_list_t
+{
+    void*    top;
+    size_t   count;
+    uint64_t allocations;
+    uint64_t frees;
+};
+
+struct slab_cache_v1::state_t
+{
+    slab_cache_v1::closure_t   closure;
+    ticket_lock_t              lock;         //!< Protects slabs and the shared free list.
+    heap_v1::closure_t*        heap;
+    slab_object_v1::closure_t* hooks;
+    memory_v1::size            object_size;
+    memory_v1::size            link_offset;
+    memory_v1::size            align;
+    memory_v1::size            slab_size;
+    size_t                     objects_per_slab;
+    slab_t*                    slabs;
+    size_t                     n_slabs;
+    void*                      free_objects;
+    size_t                     n_free;
+    free_list_t                cpu[MAX_CPUS];
+};
+
+//======================================================================================================================
+// helper functions
+//======================================================================================================================
+
+/**
+ * Free objects are chained through a link word, which is the first word of the object unless constructor hooks
+ * are used. Constructed objects must keep their state while free, so the link is then placed after the object.
+ */
+static inline void*& next_free(slab_cache_v1::state_t* state, void* object)
+{
+    return *reinterpret_cast<void**>(reinterpret_cast<char*>(object) + state->link_offset);
+}
+
+static inline free_list_t& local_list(slab_cache_v1::state_t* state)
+{
+    return state->cpu[this_cpu()];
+}
+
+/**
+ * Move up to SLAB_BATCH objects from the shared free list to the per-vcpu one.
+ */
+static void refill_local(slab_cache_v1::state_t* state, free_list_t& local)
+{
+    ticket_scope_lock_t lock(state->lock);
+    for (size_t n = 0; (n < SLAB_BATCH) && state->free_objects; ++n)
+    {
+        void* object = state->free_objects;
+        state->free_objects = next_free(state, object);
+        --state->n_free;
+        next_free(state, object) = local.top;
+        local.top = object;
+        ++local.count;
+    }
+}
+
+/**
+ * Move up to @a count objects from the per-vcpu free list to the shared one.
+ */
+static void drain_local(slab_cache_v1::state_t* state, free_list_t& local, size_t count)
+{
+    ticket_scope_lock_t lock(state->lock);
+    for (size_t n = 0; (n < count) && local.top; ++n)
+    {
+        void* object = local.top;
+        local.top = next_free(state, object);
+        --local.count;
+        next_free(state, object) = state->free_objects;
+        state->free_objects = object;
+        ++state->n_free;
+    }
+}
+
+/**
+ * Allocate a new slab from the heap and put its objects on the shared free list.
+ * Runs without any locks held, since the heap may need to expand.
+ */
+static bool grow_cache(slab_cache_v1::state_t* state)
+{
+    slab_t* slab = reinterpret_cast<slab_t*>(state->heap->allocate(state->slab_size));
+    if (!slab)
+        return false;
+
+    slab->objects = align_up(reinterpret_cast<address_t>(slab + 1), state->align);
+
+    void* first = NULL;
+    void* last = NULL;
+    for (size_t i = state->objects_per_slab; i > 0; --i)
+    {
+        void* object = reinterpret_cast<void*>(slab->objects + (i - 1) * state->object_size);
+        if (state->hooks)
+            state->hooks->construct(reinterpret_cast<memory_v1::address>(object));
+        next_free(state, object) = first;
+        first = object;
+        if (!last)
+            last = object;
+    }
+
+    ticket_scope_lock_t lock(state->lock);
+    slab->next = state->slabs;
+    state->slabs = slab;
+    ++state->n_slabs;
+    next_free(state, last) = state->free_objects;
+    state->free_objects = first;
+    state->n_free += state->objects_per_slab;
+
+    return true;
+}
+
+static void release_slab(slab_cache_v1::state_t* state, slab_t* slab)
+{
+    if (state->hooks)
+    {
+        for (size_t i = 0; i < state->objects_per_slab; ++i)
+            state->hooks->destruct(slab->objects + i * state->object_size);
+    }
+    state->heap->free(reinterpret_cast<memory_v1::address>(slab));
+}
+
+//======================================================================================================================
+// slab_cache_v1 methods
+//======================================================================================================================
+
+static memory_v1::address slab_cache_v1_allocate(slab_cache_v1::closure_t* self)
+{
+    slab_cache_v1::state_t* state = self->d_state;
+
+    for (;;)
+    {
+        {
+            per_cpu_section_t guard;
+            free_list_t& local = local_list(state);
+
+            if (!local.top)
+                refill_local(state, local);
+
+            void* object = local.top;
+            if (object)
+            {
+                local.top = next_free(state, object);
+                --local.count;
+                ++local.allocations;
+                return reinterpret_cast<memory_v1::address>(object);
+            }
+        }
+
+        // Heap raises no_memory by itself once exceptions are up.
+        if (!grow_cache(state))
+            return 0;
+    }
+}
+
+static void slab_cache_v1_free(slab_cache_v1::closure_t* self, memory_v1::address object)
+{
+    if (!object)
+        return;
+
+    slab_cache_v1::state_t* state = self->d_state;
+    per_cpu_section_t guard;
+    free_list_t& local = local_list(state);
+
+    void* p = reinterpret_cast<void*>(object);
+    next_free(state, p) = local.top;
+    local.top = p;
+    ++local.count;
+    ++local.frees;
+
+    if (local.count > SLAB_ROUNDS)
+        drain_local(state, local, SLAB_BATCH);
+}
+
+static slab_cache_v1::stats slab_cache_v1_get_stats(slab_cache_v1::closure_t* self)
+{
+    slab_cache_v1::state_t* state = self->d_state;
+    slab_cache_v1::stats s;
+
+    ticket_scope_lock_t lock(state->lock);
+
+    s.object_size = state->object_size;
+    s.slab_size = state->slab_size;
+    s.slabs = state->n_slabs;
+    s.objects_free = state->n_free;
+    s.allocations = 0;
+    s.frees = 0;
+    for (size_t i = 0; i < MAX_CPUS; ++i)
+    {
+        s.objects_free += state->cpu[i].count;
+        s.allocations += state->cpu[i].allocations;
+        s.frees += state->cpu[i].frees;
+    }
+    s.objects_in_use = state->n_slabs * state->objects_per_slab - s.objects_free;
+
+    return s;
+}
+
+/**
+ * Reaping counts free objects per slab by walking the shared free list, which is O(free objects * slabs).
+ * It is meant to be called rarely, e.g. under memory pressure.
+ */
+static void slab_cache_v1_reap(slab_cache_v1::closure_t* self)
+{
+    slab_cache_v1::state_t* state = self->d_state;
+    slab_t* empty = NULL;
+
+    {
+        per_cpu_section_t guard;
+        free_list_t& local = local_list(state);
+        drain_local(state, local, local.count);
+    }
+
+    {
+        ticket_scope_lock_t lock(state->lock);
+        const size_t objects_bytes = state->objects_per_slab * state->object_size;
+
+        for (slab_t* slab = state->slabs; slab; slab = slab->next)
+            slab->n_free = 0;
+
+        for (void* object = state->free_objects; object; object = next_free(state, object))
+        {
+            address_t a = reinterpret_cast<address_t>(object);
+            for (slab_t* slab = state->slabs; slab; slab = slab->next)
+            {
+                if ((a >= slab->objects) && (a < slab->objects + objects_bytes))
+                {
+                    ++slab->n_free;
+                    break;
+                }
+            }
+        }
+
+        // Unlink empty slabs.
+        for (slab_t** ptr = &state->slabs; *ptr; )
+        {
+            slab_t* slab = *ptr;
+            if (slab->n_free == state->objects_per_slab)
+            {
+                *ptr = slab->next;
+                slab->next = empty;
+                empty = slab;
+                --state->n_slabs;
+            }
+            else
+                ptr = &slab->next;
+        }
+
+        if (!empty)
+            return;
+
+        // Take their objects off the shared free list.
+        for (void** ptr = &state->free_objects; *ptr; )
+        {
+            address_t a = reinterpret_cast<address_t>(*ptr);
+            bool in_empty = false;
+            for (slab_t* slab = empty; slab && !in_empty; slab = slab->next)
+                in_empty = (a >= slab->objects) && (a < slab->objects + objects_bytes);
+
+            if (in_empty)
+            {
+                *ptr = next_free(state, *ptr);
+                --state->n_free;
+            }
+            else
+                ptr = &next_free(state, *ptr);
+        }
+    }
+
+    while (empty)
+    {
+        slab_t* next = empty->next;
+        release_slab(state, empty);
+        empty = next;
+    }
+}
+
+static void slab_cache_v1_destroy(slab_cache_v1::closure_t* self)
+{
+    slab_cache_v1::state_t* state = self->d_state;
+
+    slab_t* slab = state->slabs;
+    while (slab)
+    {
+        slab_t* next = slab->next;
+        release_slab(state, slab);
+        slab = next;
+    }
+
+    state->heap->free(reinterpret_cast<memory_v1::address>(state));
+}
+
+static const slab_cache_v1::ops_t slab_cache_v1_methods =
+{
+    slab_cache_v1_allocate,
+    slab_cache_v1_free,
+    slab_cache_v1_get_stats,
+    slab_cache_v1_reap,
+    slab_cache_v1_destroy
+};
+
+//======================================================================================================================
+// slab_factory_v1 methods
+//======================================================================================================================
+
+static slab_cache_v1::closure_t*
+slab_factory_v1_create(slab_factory_v1::closure_t* self, memory_v1::size object_size, memory_v1::size align, heap_v1::closure_t* heap, slab_object_v1::closure_t* hooks)
+{
+    if (align < sizeof(void*))
+        align = sizeof(void*);
+    if (align & (align - 1))
+    {
+        kconsole << __FUNCTION__ << ": alignment " << align << " is not a power of two!" << endl;
+        return NULL;
+    }
+
+    memory_v1::size link_offset = 0;
+    if (hooks)
+    {
+        link_offset = align_up(object_size, sizeof(void*));
+        object_size = link_offset + sizeof(void*);
+    }
+    if (object_size < sizeof(void*))
+        object_size = sizeof(void*);
+    object_size = align_up(object_size, align);
+
+    auto state = new(heap) slab_cache_v1::state_t;
+    if (!state)
+        return NULL;
+
+    state->heap = heap;
+    state->hooks = hooks;
+    state->object_size = object_size;
+    state->link_offset = link_offset;
+    state->align = align;
+
+    size_t overhead = sizeof(slab_t) + align - 1;
+    state->objects_per_slab = (SLAB_TARGET_SIZE - overhead) / object_size;
+    if (state->objects_per_slab < SLAB_MIN_OBJECTS)
+        state->objects_per_slab = SLAB_MIN_OBJECTS;
+    state->slab_size = overhead + state->objects_per_slab * object_size;
+
+    state->slabs = NULL;
+    state->n_slabs = 0;
+    state->free_objects = NULL;
+    state->n_free = 0;
+    for (size_t i = 0; i < MAX_CPUS; ++i)
+    {
+        state->cpu[i].top = NULL;
+        state->cpu[i].count = 0;
+        state->cpu[i].allocations = 0;
+        state->cpu[i].frees = 0;
+    }
+
+    closure_init(&state->closure, &slab_cache_v1_methods, state);
+    return &state->closure;
+}
+
+static const slab_factory_v1::ops_t slab_factory_v1_methods =
+{
+    slab_factory_v1_create
+};
+
+static slab_factory_v1::closure_t clos =
+{
+    &slab_factory_v1_methods,
+    NULL
+};
+
+EXPORT_CLOSURE_TO_ROOTDOM(slab_factory, v1, clos);
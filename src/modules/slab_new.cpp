@@ -0,0 +1,23 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "slab_new.h"
+#include "default_console.h"
+#include "logger.h"
+
+void* operator new(size_t size, slab_cache_v1::closure_t* cache) throw()
+{
+    logger::trace() << __PRETTY_FUNCTION__ << " size " << size << ", cache " << cache;
+    return reinterpret_cast<void*>(cache->allocate());
+}
+
+void operator delete(void* p, slab_cache_v1::closure_t* cache) throw()
+{
+    logger::trace() << __PRETTY_FUNCTION__ << " p " << p << ", cache " << cache;
+    cache->free(reinterpret_cast<memory_v1::address>(p));
+}
@@ -0,0 +1,26 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "slab_cache_v1_interface.h"
+
+void* operator new(size_t size, slab_cache_v1::closure_t* cache) throw();
+void operator delete(void* p, slab_cache_v1::closure_t* cache) throw();
+
+/**
+ * Destroy object @a p allocated with new(cache) and return it to the @a cache.
+ */
+template <class T>
+inline void slab_delete(slab_cache_v1::closure_t* cache, T* p)
+{
+    if (!p)
+        return;
+    p->~T();
+    cache->free(reinterpret_cast<memory_v1::address>(p));
+}
@@ -0,0 +1,272 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+#include "memory.h"
+
+/**
+ * Buddy allocator for the logical frames of a memory region.
+ *
+ * Free blocks of each order are kept in a hierarchical bitmap: the bottom level has a bit per block,
+ * every level above has a bit per word of the level below, set while that word is non-zero. The lowest
+ * free block of an order is found by descending from the single top word, so allocation and free take
+ * O(log n) steps instead of a scan over all frames.
+ *
+ * Block numbers are derived from absolute frame numbers, so a block of order k is also aligned
+ * to 2^k frames in memory. All frame indices in the interface are relative to the region start.
+ *
+ * Bitmap words live in caller-provided storage of required_size() bytes.
+ */
+class buddy_bitmap_t
+{
+public:
+    static const size_t MAX_ORDER = 20;  //!< Largest block, 4GiB of 4KiB frames.
+    static const size_t MAX_LEVELS = 6;  //!< Enough for 2^30 blocks of one order.
+    static const size_t NONE = ~size_t(0);
+
+    /**
+     * Size of bitmap storage for a region of @a n_frames starting at absolute frame number @a base.
+     */
+    static size_t required_size(size_t base, size_t n_frames)
+    {
+        size_t top = top_order(base, n_frames);
+        size_t n_words = 0;
+
+        for (size_t order = 0; order <= top; ++order)
+        {
+            size_t bits = blocks_at(base, n_frames, top, order);
+            do {
+                bits = (bits + 31) / 32;
+                n_words += bits;
+            } while (bits > 1);
+        }
+
+        return align_up(n_words * sizeof(uint32_t), sizeof(address_t));
+    }
+
+    /**
+     * Set up an empty allocator, all frames are in use until freed.
+     */
+    void init(uint32_t* storage, size_t base, size_t n_frames)
+    {
+        top = top_order(base, n_frames);
+        skew = base - ((base >> top) << top);
+        words = storage;
+
+        size_t offset = 0;
+        for (size_t order = 0; order <= top; ++order)
+        {
+            size_t bits = blocks_at(base, n_frames, top, order);
+            n_levels[order] = 0;
+            do {
+                bits = (bits + 31) / 32;
+                offsets[order][n_levels[order]++] = offset;
+                offset += bits;
+            } while (bits > 1);
+        }
+
+        for (size_t i = 0; i < offset; ++i)
+            words[i] = 0;
+    }
+
+    /**
+     * Return frames to the allocator, merging them with free buddies.
+     */
+    void free_range(size_t first, size_t count)
+    {
+        insert_range(first + skew, count);
+    }
+
+    /**
+     * Take specific frames out of the allocator.
+     * @return number of frames taken, stops at the first frame which is not free.
+     */
+    size_t claim_range(size_t first, size_t count)
+    {
+        size_t frame = first + skew;
+        size_t end = frame + count;
+
+        while (frame < end)
+        {
+            size_t order;
+            if (!find_block(frame, &order))
+                break;
+
+            size_t block = (frame >> order) << order;
+            size_t block_end = block + (size_t(1) << order);
+            size_t claim_end = (block_end < end) ? block_end : end;
+
+            // Split the block, giving back the parts around the claimed frames.
+            clear_bit(order, frame >> order);
+            insert_range(block, frame - block);
+            insert_range(claim_end, block_end - claim_end);
+
+            frame = claim_end;
+        }
+
+        return frame - (first + skew);
+    }
+
+    /**
+     * Allocate @a count contiguous frames aligned to 2^@a align_order frames, the lowest possible ones.
+     * @param limit Allocated frames must end at or below this frame index, NONE if there is no limit.
+     * @param first Index of the first allocated frame.
+     * @return false if there is no suitable free block.
+     */
+    bool allocate(size_t count, size_t align_order, size_t limit, size_t* first)
+    {
+        if (count == 0)
+            return false;
+
+        size_t k = align_order;
+        while ((size_t(1) << k) < count)
+            ++k;
+
+        for (size_t order = k; order <= top; ++order)
+        {
+            size_t index = find_first(order);
+            if (index == NONE)
+                continue;
+
+            size_t frame = index << order;
+            if ((limit != NONE) && (frame - skew + count > limit))
+                continue;
+
+            clear_bit(order, index);
+            while (order > k)
+            {
+                --order;
+                index <<= 1;
+                set_bit(order, index | 1);
+            }
+            insert_range(frame + count, (size_t(1) << k) - count);
+
+            *first = frame - skew;
+            return true;
+        }
+
+        return false;
+    }
+
+private:
+    static size_t top_order(size_t base, size_t n_frames)
+    {
+        if (n_frames <= 1)
+            return 0;
+
+        size_t order = 0;
+        while ((order < MAX_ORDER) && ((base >> order) != ((base + n_frames - 1) >> order)))
+            ++order;
+        return order;
+    }
+
+    static size_t blocks_at(size_t base, size_t n_frames, size_t top, size_t order)
+    {
+        size_t last = (n_frames > 0) ? base + n_frames - 1 : base;
+        size_t n_top_blocks = (last >> top) - (base >> top) + 1;
+        return n_top_blocks << (top - order);
+    }
+
+    inline uint32_t* level(size_t order, size_t l)
+    {
+        return words + offsets[order][l];
+    }
+
+    inline bool test_bit(size_t order, size_t index)
+    {
+        return level(order, 0)[index >> 5] & (1U << (index & 31));
+    }
+
+    void set_bit(size_t order, size_t index)
+    {
+        for (size_t l = 0; l < n_levels[order]; ++l, index >>= 5)
+        {
+            uint32_t* word = level(order, l) + (index >> 5);
+            bool was_empty = (*word == 0);
+            *word |= 1U << (index & 31);
+            if (!was_empty)
+                break;
+        }
+    }
+
+    void clear_bit(size_t order, size_t index)
+    {
+        for (size_t l = 0; l < n_levels[order]; ++l, index >>= 5)
+        {
+            uint32_t* word = level(order, l) + (index >> 5);
+            *word &= ~(1U << (index & 31));
+            if (*word != 0)
+                break;
+        }
+    }
+
+    size_t find_first(size_t order)
+    {
+        size_t l = n_levels[order] - 1;
+        if (level(order, l)[0] == 0)
+            return NONE;
+
+        size_t index = 0;
+        for (;;)
+        {
+            index = (index << 5) | __builtin_ctz(level(order, l)[index]);
+            if (l == 0)
+                return index;
+            --l;
+        }
+    }
+
+    /**
+     * Find the free block containing @a frame.
+     */
+    bool find_block(size_t frame, size_t* order)
+    {
+        for (*order = 0; *order <= top; ++(*order))
+        {
+            if (test_bit(*order, frame >> *order))
+                return true;
+        }
+        return false;
+    }
+
+    void free_block(size_t index, size_t order)
+    {
+        while ((order < top) && test_bit(order, index ^ 1))
+        {
+            clear_bit(order, index ^ 1);
+            index >>= 1;
+            ++order;
+        }
+        set_bit(order, index);
+    }
+
+    /**
+     * Free a range of frames in internal numbering, split into the largest aligned blocks.
+     */
+    void insert_range(size_t frame, size_t count)
+    {
+        while (count)
+        {
+            size_t order = 0;
+            while ((order < top) && !(frame & (size_t(1) << order)) && ((size_t(2) << order) <= count))
+                ++order;
+
+            free_block(frame >> order, order);
+            frame += size_t(1) << order;
+            count -= size_t(1) << order;
+        }
+    }
+
+    uint32_t* words;
+    size_t top;                                    //!< Largest order, blocks of it cover the region.
+    size_t skew;                                   //!< Region start frame within the first top order block.
+    uint32_t n_levels[MAX_ORDER + 1];
+    uint32_t offsets[MAX_ORDER + 1][MAX_LEVELS];   //!< Start word of each bitmap level.
+};
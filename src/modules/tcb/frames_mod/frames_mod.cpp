@@ -14,6 +14,7 @@
 #include "frame_allocator_v1_impl.h"
 #include "system_frame_allocator_v1_interface.h"
 #include "system_frame_allocator_v1_impl.h"
+#include "stretch_driver_v1_interface.h"
 #include "types.h"
 #include "macros.h"
 #include "default_console.h"
@@ -22,6 +23,16 @@
 #include "domain.h"
 #include "algorithm"
 #include "logger.h"
+#include "fpu_memutils.h"
+#include "buddy_bitmap.h"
+#include "per_cpu.h"
+
+struct zero_pool_t;
+struct frame_cache_t;
+struct frame_accounts_t;
+
+// Guarantee of the system client, which is not subject to quotas.
+static const size_t UNLIMITED_FRAMES = ~size_t(0);
 
 /**
  * Frame allocator client record.
@@ -36,16 +47,16 @@ struct frame_allocator_v1::state_t
     uint32_t n_allocated_phys_frames;      //<! Number of already allocated RAM frames.
 
     uint32_t owner;                        //!< Owner ID.
-    size_t guaranteed_frames;
-    size_t extra_frames;
+    size_t guaranteed_frames;              //!< Frames which can always be allocated.
+    size_t extra_frames;                   //!< Limit of guaranteed plus optimistic frames.
+    stretch_driver_v1::closure_t* revoker; //!< Asked to give back optimistic frames, may be NULL.
+    frame_allocator_v1::state_t* next_client; //<! Next client with a quota.
 
     heap_v1::closure_t* heap;
     frames_module_v1::state_t* module_state;  //<! Back pointer to shared state.
-};
-
-struct frame_st
-{
-    uint32_t free;
+    zero_pool_t* zero_pool;                   //<! Shared pool of pre-zeroed frames.
+    frame_cache_t* frame_cache;               //<! Shared per-vcpu caches of free frames.
+    frame_accounts_t* accounts;               //<! Shared frame accounting.
 };
 
 /**
@@ -59,7 +70,57 @@ struct frames_module_v1::state_t
     memory_v1::attrs attrs;
     ramtab_v1::closure_t* ramtab;
     frames_module_v1::state_t* next;
-    frame_st* frames;
+    buddy_bitmap_t free_frames;           //<! Free logical frames, bitmap storage follows the record.
+};
+
+/**
+ * Pool of frames zeroed ahead of time by zero_frames().
+ * Pooled frames are owned by the system client until handed out. frames_mod can only write to frames
+ * it can address, so the pool is filled from the identity mapped RAM below direct_limit.
+ * Frames are pooled in contiguous runs of RUN frames stacked in ascending order, so a request of up to RUN frames
+ * can be served by the top of the stack as long as it lies within one run.
+ */
+struct zero_pool_t
+{
+    static const size_t RUN = 64;
+    static const size_t CAPACITY = 2 * RUN;
+
+    address_t direct_limit;                //<! End of identity mapped RAM.
+    frame_allocator_v1::state_t* system;   //<! System client, owner of pooled frames.
+    size_t count;
+    address_t frames[CAPACITY];
+};
+
+/**
+ * Per-vcpu stacks of free single 4KiB frames. Cached frames are out of the buddy allocators and owned by nobody,
+ * so single frame allocate and free only touch the ramtab entry of the frame. Stacks are refilled from and drained
+ * to the buddy allocators BATCH frames at a time.
+ */
+struct frame_cache_t
+{
+    static const size_t CAPACITY = 32;
+    static const size_t BATCH = 16;
+
+    struct cpu_t
+    {
+        size_t count;
+        address_t frames[CAPACITY];
+    };
+
+    cpu_t cpu[MAX_CPUS];
+};
+
+/**
+ * Frame accounting shared by all clients.
+ * The unused parts of client guarantees are reserved: optimistic allocations must leave at least
+ * reserved_frames free, and can be revoked to honour a guarantee.
+ */
+struct frame_accounts_t
+{
+    size_t total_frames;                   //<! RAM frames in all regions.
+    size_t committed_frames;               //<! Frames allocated by all clients.
+    size_t reserved_frames;                //<! Guaranteed frames not allocated yet.
+    frame_allocator_v1::state_t* clients;  //<! Clients with quotas.
 };
 
 //======================================================================================================================
@@ -73,6 +134,8 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
 static uint32_t system_frame_allocator_v1_query(frame_allocator_v1::closure_t* self, memory_v1::address addr, memory_v1::attrs* attr);
 static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self, memory_v1::address addr, memory_v1::size bytes);
 static void system_frame_allocator_v1_destroy(frame_allocator_v1::closure_t* self);
+static memory_v1::size system_frame_allocator_v1_query_quota(frame_allocator_v1::closure_t* self, memory_v1::size* guaranteed, memory_v1::size* optimistic);
+static void system_frame_allocator_v1_set_revoker(frame_allocator_v1::closure_t* self, stretch_driver_v1::closure_t* driver);
 
 static memory_v1::address frame_allocator_v1_allocate(frame_allocator_v1::closure_t* self, memory_v1::size bytes, uint32_t frame_width)
 {
@@ -99,54 +162,168 @@ static void frame_allocator_v1_destroy(frame_allocator_v1::closure_t* self)
     system_frame_allocator_v1_destroy(self);
 }
 
+static memory_v1::size frame_allocator_v1_query_quota(frame_allocator_v1::closure_t* self, memory_v1::size* guaranteed, memory_v1::size* optimistic)
+{
+    return system_frame_allocator_v1_query_quota(self, guaranteed, optimistic);
+}
+
+static void frame_allocator_v1_set_revoker(frame_allocator_v1::closure_t* self, stretch_driver_v1::closure_t* driver)
+{
+    system_frame_allocator_v1_set_revoker(self, driver);
+}
+
 static const frame_allocator_v1::ops_t frame_allocator_v1_methods =
 {
     frame_allocator_v1_allocate,
     frame_allocator_v1_allocate_range,
     frame_allocator_v1_query,
     frame_allocator_v1_free,
-    frame_allocator_v1_destroy
+    frame_allocator_v1_destroy,
+    frame_allocator_v1_query_quota,
+    frame_allocator_v1_set_revoker
 };
 
 //======================================================================================================================
 // implementation helper functions
 //======================================================================================================================
 
-static void mark_frames_used(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* state, address_t first_frame, size_t n_frames)
+inline bool has_quota(frame_allocator_v1::state_t* client)
+{
+    return client->guaranteed_frames != UNLIMITED_FRAMES;
+}
+
+/**
+ * Part of the client guarantee which is not allocated yet.
+ */
+inline size_t unused_guarantee(frame_allocator_v1::state_t* client)
+{
+    if (!has_quota(client) || (client->n_allocated_phys_frames >= client->guaranteed_frames))
+        return 0;
+    return client->guaranteed_frames - client->n_allocated_phys_frames;
+}
+
+inline size_t free_frames(frame_accounts_t* accounts)
+{
+    return (accounts->total_frames > accounts->committed_frames) ? accounts->total_frames - accounts->committed_frames : 0;
+}
+
+/**
+ * Account @a n_frames newly allocated by the client.
+ */
+static void charge_frames(frame_allocator_v1::state_t* client, size_t n_frames)
+{
+    size_t unused = unused_guarantee(client);
+    client->n_allocated_phys_frames += n_frames;
+    client->accounts->committed_frames += n_frames;
+    client->accounts->reserved_frames -= unused - unused_guarantee(client);
+}
+
+/**
+ * Account @a n_frames freed by the client.
+ */
+static void credit_frames(frame_allocator_v1::state_t* client, size_t n_frames)
+{
+    // Protect from wrapping.
+    if (n_frames > client->n_allocated_phys_frames)
+    {
+        logger::warning() << __FUNCTION__ << ": freeing more frames than I own (ignored)";
+        n_frames = client->n_allocated_phys_frames;
+    }
+
+    size_t unused = unused_guarantee(client);
+    client->n_allocated_phys_frames -= n_frames;
+    client->accounts->committed_frames -= n_frames;
+    client->accounts->reserved_frames += unused_guarantee(client) - unused;
+}
+
+/**
+ * Ask clients other than @a requester to give back up to @a n_frames of their optimistic frames.
+ * Revokers free the frames through their own frame allocator, so the accounts show how many were actually returned.
+ * No client registers a revoker yet: the null and nailed stretch drivers hold no frames they could give back,
+ * so this frees nothing until a paged stretch driver calls set_revoker().
+ * @return number of frames freed.
+ */
+static size_t revoke_optimistic_frames(frame_accounts_t* accounts, frame_allocator_v1::state_t* requester, size_t n_frames)
+{
+    size_t committed = accounts->committed_frames;
+    auto freed = [accounts, committed]
+    {
+        return (committed > accounts->committed_frames) ? committed - accounts->committed_frames : 0;
+    };
+
+    for (auto client = accounts->clients; client && (freed() < n_frames); client = client->next_client)
+    {
+        if ((client == requester) || !client->revoker || (client->n_allocated_phys_frames <= client->guaranteed_frames))
+            continue;
+
+        size_t wanted = std::min(client->n_allocated_phys_frames - client->guaranteed_frames, n_frames - freed());
+        logger::debug() << __FUNCTION__ << ": revoking " << wanted << " frames from client " << client->owner;
+        client->revoker->revoke_frames(wanted);
+    }
+
+    logger::debug() << __FUNCTION__ << ": " << freed() << " of " << n_frames << " frames revoked";
+    return freed();
+}
+
+/**
+ * Check that the client may allocate @a n_frames more.
+ * Allocations within the guarantee always pass if there is free memory, revoking optimistic frames of other clients
+ * when needed. Allocations beyond it must leave enough free frames for guarantees of all other clients, and never
+ * cause revocation, so a client can not push others out of memory.
+ */
+static bool admit_frames(frame_allocator_v1::state_t* client, size_t n_frames)
 {
-    for (size_t j = first_frame; j < (first_frame + n_frames); ++j)
-        state->frames[j].free = 0;
+    if (!has_quota(client))
+        return true;
+
+    if (client->n_allocated_phys_frames + n_frames > client->extra_frames)
+    {
+        logger::warning() << __FUNCTION__ << ": client " << client->owner << " exceeded quota!";
+        return false;
+    }
+
+    frame_accounts_t* accounts = client->accounts;
+    size_t guaranteed = std::min(n_frames, unused_guarantee(client));
+    size_t needed = n_frames + accounts->reserved_frames - guaranteed;
+
+    if ((free_frames(accounts) < needed) && (guaranteed > 0))
+        revoke_optimistic_frames(accounts, client, needed - free_frames(accounts));
+
+    if (free_frames(accounts) >= needed)
+        return true;
 
+    // Revocation fell short, but the allocation is inside the guarantee, so it may use other clients' reserve
+    // while free frames remain.
+    if ((guaranteed == n_frames) && (free_frames(accounts) >= n_frames))
+        return true;
+
+    logger::warning() << __FUNCTION__ << ": no memory for " << n_frames << " optimistic frames of client " << client->owner;
+    return false;
+}
+
+/**
+ * Record the owner of frames just taken out of the free bitmap.
+ * The ramtab keeps the allocation frame width, which may be larger than the region one (e.g. for superpages),
+ * so that free() and the mmu can tell how the frames were allocated.
+ */
+static void mark_frames_used(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* state, address_t first_frame, size_t n_frames, size_t frame_width = FRAME_WIDTH)
+{
     if (state->ramtab)
     {
         uint32_t ridx = state->start >> FRAME_WIDTH;
         size_t fshift = state->frame_width - FRAME_WIDTH; /* frame_width >= FRAME_WIDTH */
+        frame_width = std::max(frame_width, state->frame_width);
         for (size_t j = first_frame; j < (first_frame + n_frames); ++j)
         {
             for(size_t k = 0; k < (1UL << fshift); ++k)
             {
                 // Effectively, set only owner and frame_width. Frames are yet unused (neither mapped nor nailed).
-                state->ramtab->put(ridx + (j << fshift) + k, client_state->owner, state->frame_width, ramtab_v1::state_unused);
+                state->ramtab->put(ridx + (j << fshift) + k, client_state->owner, frame_width, ramtab_v1::state_unused);
             }
         }
     }
 }
 
-/**
- * After allocation, update predecessors free frames info.
- */
-static void alloc_update_free_predecessors(frames_module_v1::state_t* cur_state, address_t first_frame)
-{
-    uint32_t start_free = cur_state->frames[first_frame].free;
-    for (address_t i = first_frame; i != 0; )
-    {
-        --i;
-        if (cur_state->frames[i].free == 0)
-            break;
-        cur_state->frames[i].free -= start_free;
-    }
-}
-
 // FIXME: Lots of reinterpret casts suck, do something about it!
 
 static bool add_range_element(frame_allocator_v1::state_t* client_state, address_t start, size_t n_phys_frames, size_t frame_width)
@@ -238,7 +415,18 @@ inline address_t frame_address(frames_module_v1::state_t* cur_state, address_t f
     return cur_state->start + (frame_index << cur_state->frame_width);
 }
 
-static frames_module_v1::state_t* alloc_any(frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t align, address_t* first_log_frame, size_t* n_log_frames)
+/**
+ * Check that "size" bytes at "start" end at or below "limit". NO_ADDRESS means there is no limit.
+ */
+inline bool fits_below(address_t start, size_t size, address_t limit)
+{
+    return (limit == NO_ADDRESS) || ((start < limit) && (limit - start >= size));
+}
+
+/**
+ * Take free frames out of the first region which has a suitable block, only considering the ones which end below "limit".
+ */
+static frames_module_v1::state_t* alloc_any(frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t align, address_t* first_log_frame, size_t* n_log_frames, address_t limit = NO_ADDRESS)
 {
     frame_allocator_v1::state_t* client_state = self->d_state;
     frames_module_v1::state_t* state = client_state->module_state;
@@ -248,20 +436,20 @@ static frames_module_v1::state_t* alloc_any(frame_allocator_v1::closure_t* self,
 
     while (cur_state)
     {
-        if (!cur_state->attrs)
+        if (!cur_state->attrs && fits_below(cur_state->start, 0, limit))
         {
-            *n_log_frames = n_physical_frames >> (cur_state->frame_width - FRAME_WIDTH);
-
-            if (*n_log_frames != n_physical_frames)
-            {
-                PANIC("Region with non-standard frame width! Unsupported.");
-            }
+            // Regions with wider logical frames hand out whole frames.
+            *n_log_frames = size_in_whole_frames(n_physical_frames, cur_state->frame_width - FRAME_WIDTH);
 
             // We need at least n_physical_frames contiguous frames starting aligned to "align"
-            for (*first_log_frame = 0; *first_log_frame < cur_state->n_logical_frames; ++(*first_log_frame))
+            size_t align_order = (align > cur_state->frame_width) ? align - cur_state->frame_width : 0;
+            size_t limit_frame = (limit == NO_ADDRESS) ? buddy_bitmap_t::NONE : (limit - cur_state->start) >> cur_state->frame_width;
+            size_t first;
+
+            if (cur_state->free_frames.allocate(*n_log_frames, align_order, limit_frame, &first))
             {
-                if (cur_state->frames[*first_log_frame].free >= *n_log_frames && is_aligned_to_frame_width(frame_address(cur_state, *first_log_frame), align))
-                    return cur_state;
+                *first_log_frame = first;
+                return cur_state;
             }
         }
         cur_state = cur_state->next;
@@ -270,9 +458,9 @@ static frames_module_v1::state_t* alloc_any(frame_allocator_v1::closure_t* self,
     return NULL; // out of physical memory
 }
 
-static frames_module_v1::state_t* alloc_any(system_frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t align, address_t* first_log_frame, size_t* n_log_frames)
+static frames_module_v1::state_t* alloc_any(system_frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t align, address_t* first_log_frame, size_t* n_log_frames, address_t limit = NO_ADDRESS)
 {
-    return alloc_any(reinterpret_cast<frame_allocator_v1::closure_t*>(self), n_physical_frames, align, first_log_frame, n_log_frames);
+    return alloc_any(reinterpret_cast<frame_allocator_v1::closure_t*>(self), n_physical_frames, align, first_log_frame, n_log_frames, limit);
 }
 
 static frames_module_v1::state_t* alloc_range(frame_allocator_v1::closure_t* self, size_t n_physical_frames, address_t start, address_t* first_log_frame, size_t* n_log_frames)
@@ -297,11 +485,15 @@ static frames_module_v1::state_t* alloc_range(frame_allocator_v1::closure_t* sel
     *n_log_frames = align_to_frame_width(n_physical_frames, fshift) >> fshift; //bytes_to_log_frames, actually, too?
     *first_log_frame = bytes_to_log_frames(start - cur_state->start, cur_state->frame_width);
 
-    if (cur_state->frames[*first_log_frame].free < *n_log_frames)
+    if (*first_log_frame + *n_log_frames > cur_state->n_logical_frames)
+        *n_log_frames = cur_state->n_logical_frames - *first_log_frame;
+
+    size_t n_claimed = cur_state->free_frames.claim_range(*first_log_frame, *n_log_frames);
+    if (n_claimed < *n_log_frames)
     {
         /* not enough space at requested address: give as much as possible */
         kconsole << "alloc_range: less than " << int(*n_log_frames << cur_state->frame_width) << " bytes free at requested address " << start;
-        *n_log_frames = cur_state->frames[*first_log_frame].free;
+        *n_log_frames = n_claimed;
         kconsole << ", returning as much as available - " << int(*n_log_frames << cur_state->frame_width) << endl;
         return cur_state;
     }
@@ -316,6 +508,173 @@ static frames_module_v1::state_t* alloc_range(system_frame_allocator_v1::closure
     return alloc_range(reinterpret_cast<frame_allocator_v1::closure_t*>(self), n_frames, start, first_log_frame, n_log_frames);
 }
 
+/**
+ * Hand @a n_frames contiguous frames from the zeroed pool over to the client.
+ * @return address of the first frame or NO_ADDRESS if the top of the pool does not hold such a run.
+ */
+static address_t take_zeroed_frames(frame_allocator_v1::state_t* client_state, size_t n_frames)
+{
+    zero_pool_t* pool = client_state->zero_pool;
+    if (!pool || (pool->count < n_frames))
+        return NO_ADDRESS;
+
+    size_t first = pool->count - n_frames;
+    address_t start = pool->frames[first];
+    for (size_t i = 1; i < n_frames; ++i)
+    {
+        if (pool->frames[first + i] != start + (i << FRAME_WIDTH))
+            return NO_ADDRESS;
+    }
+    pool->count = first;
+
+    frames_module_v1::state_t* cur_state = get_region(client_state->module_state, start);
+    if (cur_state->ramtab)
+    {
+        for (size_t i = 0; i < n_frames; ++i)
+            cur_state->ramtab->put(phys_frame_number(start) + i, client_state->owner, FRAME_WIDTH, ramtab_v1::state_unused);
+    }
+
+    credit_frames(pool->system, n_frames);
+    charge_frames(client_state, n_frames);
+
+    if (!add_range(client_state, start, n_frames, FRAME_WIDTH))
+    {
+        PANIC("Something's wrong.");
+    }
+
+    logger::debug() << __FUNCTION__ << ": allocated " << n_frames << " zeroed frames at " << start;
+    return start;
+}
+
+/**
+ * Give @a count oldest frames from the per-vcpu cache back to the buddy allocators,
+ * recently freed ones are more likely to still be in the CPU caches.
+ */
+static void drain_frame_cache(frame_allocator_v1::state_t* client_state, frame_cache_t::cpu_t& local, size_t count)
+{
+    count = std::min(count, local.count);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        frames_module_v1::state_t* cur_state = get_region(client_state->module_state, local.frames[i]);
+        cur_state->free_frames.free_range((local.frames[i] - cur_state->start) >> cur_state->frame_width, 1);
+    }
+
+    local.count -= count;
+    for (size_t i = 0; i < local.count; ++i)
+        local.frames[i] = local.frames[i + count];
+}
+
+/**
+ * Take BATCH frames for the per-vcpu cache. A contiguous block costs a single buddy operation,
+ * single frames are taken only when memory is too fragmented for that.
+ */
+static void refill_frame_cache(frame_allocator_v1::state_t* client_state, frame_cache_t::cpu_t& local)
+{
+    address_t first_frame;
+    size_t n_frames;
+    frames_module_v1::state_t* cur_state = alloc_any(&client_state->closure, frame_cache_t::BATCH, FRAME_WIDTH, &first_frame, &n_frames);
+
+    if (cur_state)
+    {
+        // Lowest frame ends up on top.
+        for (size_t i = n_frames; i > 0; --i)
+            local.frames[local.count++] = frame_address(cur_state, first_frame + i - 1);
+        return;
+    }
+
+    while (local.count < frame_cache_t::BATCH)
+    {
+        cur_state = alloc_any(&client_state->closure, 1, FRAME_WIDTH, &first_frame, &n_frames);
+        if (!cur_state)
+            break;
+        local.frames[local.count++] = frame_address(cur_state, first_frame);
+    }
+}
+
+/**
+ * Return all frames cached by this vcpu to the buddy allocators, so that contiguous or placed allocations can see them.
+ */
+static void flush_frame_cache(frame_allocator_v1::state_t* client_state)
+{
+    per_cpu_section_t guard;
+    frame_cache_t::cpu_t& local = client_state->frame_cache->cpu[this_cpu()];
+    drain_frame_cache(client_state, local, local.count);
+}
+
+/**
+ * Hand a frame from the per-vcpu cache over to the client.
+ * @return address of the frame or NO_ADDRESS if there is no free memory.
+ */
+static address_t take_cached_frame(frame_allocator_v1::state_t* client_state)
+{
+    address_t frame;
+    {
+        per_cpu_section_t guard;
+        frame_cache_t::cpu_t& local = client_state->frame_cache->cpu[this_cpu()];
+
+        if (local.count == 0)
+            refill_frame_cache(client_state, local);
+        if (local.count == 0)
+            return NO_ADDRESS;
+
+        frame = local.frames[--local.count];
+    }
+
+    frames_module_v1::state_t* cur_state = get_region(client_state->module_state, frame);
+    if (cur_state->ramtab)
+        cur_state->ramtab->put(phys_frame_number(frame), client_state->owner, FRAME_WIDTH, ramtab_v1::state_unused);
+
+    charge_frames(client_state, 1);
+
+    if (!add_range(client_state, frame, 1, FRAME_WIDTH))
+    {
+        PANIC("Something's wrong.");
+    }
+
+    logger::debug() << __FUNCTION__ << ": allocated " << frame;
+    return frame;
+}
+
+/**
+ * Put a freed frame on the per-vcpu cache, spilling a batch to the buddy allocators if it is full.
+ */
+static void cache_frame(frame_allocator_v1::state_t* client_state, address_t frame)
+{
+    per_cpu_section_t guard;
+    frame_cache_t::cpu_t& local = client_state->frame_cache->cpu[this_cpu()];
+
+    if (local.count == frame_cache_t::CAPACITY)
+        drain_frame_cache(client_state, local, frame_cache_t::BATCH);
+
+    local.frames[local.count++] = frame;
+}
+
+/**
+ * Find the end of identity mapped memory starting from address 0, frames_mod can access frames below it directly.
+ */
+static address_t direct_mapping_limit(bootinfo_t* bi)
+{
+    address_t limit = 0;
+    bool extended = true;
+
+    while (extended)
+    {
+        extended = false;
+        std::for_each(bi->vmap_begin(), bi->vmap_end(), [&limit, &extended](const memory_v1::mapping* m)
+        {
+            address_t end = m->virt + (m->nframes << m->frame_width);
+            if ((m->virt == m->phys) && (m->virt <= limit) && (end > limit))
+            {
+                limit = end;
+                extended = true;
+            }
+        });
+    }
+
+    return limit;
+}
+
 //======================================================================================================================
 // system_frame_allocator_v1 implementation
 //======================================================================================================================
@@ -336,15 +695,42 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
     frame_width = std::max(frame_width, FRAME_WIDTH);
     size_t n_phys_frames = align_to_frame_width(bytes, frame_width) >> FRAME_WIDTH;
 
-    if (client_state->n_allocated_phys_frames + n_phys_frames > client_state->guaranteed_frames)
+    if (!admit_frames(client_state, n_phys_frames))
     {
-        logger::warning() << __FUNCTION__ << ": client exceeded quota!";
         return NO_ADDRESS;
     }
 
+    // Zeroed frames must be directly accessible so we can clear them here if the pool cannot help.
+    bool zeroed = (attr == memory_v1::attrs_zeroed);
+    address_t limit = zeroed ? client_state->zero_pool->direct_limit : NO_ADDRESS;
+
+    if (zeroed && (n_phys_frames <= zero_pool_t::RUN) && (frame_width == FRAME_WIDTH) && unaligned(start))
+    {
+        start = take_zeroed_frames(client_state, n_phys_frames);
+        if (start != NO_ADDRESS)
+            return start;
+    }
+
+    if (!zeroed && (n_phys_frames == 1) && (frame_width == FRAME_WIDTH) && unaligned(start))
+    {
+        return take_cached_frame(client_state);
+    }
+
     if (unaligned(start))
     {
-        cur_state = alloc_any(self, n_phys_frames, frame_width, &first_frame, &n_frames);
+        cur_state = alloc_any(self, n_phys_frames, frame_width, &first_frame, &n_frames, limit);
+        if (!cur_state)
+        {
+            // Cached frames might be just what is missing to form a block.
+            flush_frame_cache(client_state);
+            cur_state = alloc_any(self, n_phys_frames, frame_width, &first_frame, &n_frames, limit);
+        }
+        if (!cur_state && (!has_quota(client_state) || unused_guarantee(client_state))
+            && revoke_optimistic_frames(client_state->accounts, client_state, n_phys_frames))
+        {
+            flush_frame_cache(client_state);
+            cur_state = alloc_any(self, n_phys_frames, frame_width, &first_frame, &n_frames, limit);
+        }
         if (!cur_state)
         {
             logger::warning() << __FUNCTION__ << ": failed to allocate " << bytes << " bytes.";
@@ -359,6 +745,12 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
             logger::warning() << __FUNCTION__ << ": start " << start << " not aligned to width " << frame_width;
             return NO_ADDRESS;
         }
+        if (!fits_below(start, n_phys_frames << FRAME_WIDTH, limit))
+        {
+            logger::warning() << __FUNCTION__ << ": zeroed frames at " << start << " are not directly accessible";
+            return NO_ADDRESS;
+        }
+        flush_frame_cache(client_state); // requested frames may be cached
         cur_state = alloc_range(self, n_phys_frames, start, &first_frame, &n_frames);
         if (!cur_state)
         {
@@ -381,10 +773,9 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
 
     start = frame_address(cur_state, first_frame);
 
-    alloc_update_free_predecessors(cur_state, first_frame);
-    mark_frames_used(client_state, cur_state, first_frame, n_frames);
+    mark_frames_used(client_state, cur_state, first_frame, n_frames, frame_width);
 
-    client_state->n_allocated_phys_frames += n_phys_frames;
+    charge_frames(client_state, n_phys_frames);
 
     // Add the info about this newly allocated region to our list.
     if(!add_range(client_state, start, n_phys_frames, frame_width))
@@ -392,6 +783,11 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
         PANIC("Something's wrong.");
     }
 
+    // Pool could not serve the request, caller is going to use the memory right away so clear it through the cache.
+    // This runs in the caller's context and may be preempted, so it must not touch the FPU state.
+    if (zeroed)
+        memutils::clear_memory(reinterpret_cast<void*>(start), n_frames << cur_state->frame_width);
+
     logger::debug() << __FUNCTION__ << ": allocated " << start;
     return start;
 }
@@ -496,30 +892,11 @@ static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self,
         PANIC("Frame allocator misuse.");
     }
 
-    /*
-     * First sort out the frames we're freeing.
-     * We do this from the back so can keep "free" counts consistent.
-     */
-    address_t i;
-    size_t end_free = (end_log_frame == cur_state->n_logical_frames) ? 0 : cur_state->frames[end_log_frame].free;
-
-    for (i = end_log_frame; i >= start_log_frame; --i)
-    {
-        cur_state->frames[i].free = ++end_free;
-        logger::trace() << "1. Log frame " << i << " free set to " << cur_state->frames[i].free;
-    }
-
-    /*
-     * Now need to update all empty frames immediately before the first
-     * frame we've freed; hopefully this will not be too many since we
-     * alloc first fit.
-     * [Note: i points to frame before start_log_frame already]
-     */
-    for (; /*wrap protect:*/(i < start_log_frame) && (cur_state->frames[i].free != 0); --i)
-    {
-        cur_state->frames[i].free = ++end_free;
-        logger::trace() << "2. Log frame " << i << " free set to " << cur_state->frames[i].free;
-    }
+    /* First give the frames back, single RAM frames go to the per-vcpu cache, others to the buddy allocator */
+    if (cur_state->ramtab && (n_phys_frames == 1) && (region_frame_width == FRAME_WIDTH) && (allocation_frame_width == FRAME_WIDTH))
+        cache_frame(client_state, addr);
+    else
+        cur_state->free_frames.free_range(start_log_frame, end_log_frame - start_log_frame);
 
     /* Now update the ramtab (if appropriate) */
     if(cur_state->ramtab)
@@ -534,14 +911,8 @@ static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self,
         }
     }
 
-    /* Finally, update number of allocated frames (protect from wrapping), and our linked list of regions */
-    size_t new_phys_frames = client_state->n_allocated_phys_frames - n_phys_frames;
-    if (new_phys_frames > client_state->n_allocated_phys_frames)
-    {
-        logger::warning() << __FUNCTION__ << ": freeing more frames than I own (ignored)";
-        new_phys_frames = 0;
-    }
-    client_state->n_allocated_phys_frames = new_phys_frames;
+    /* Finally, update number of allocated frames, and our linked list of regions */
+    credit_frames(client_state, n_phys_frames);
 
 /*  if(!del_range(cst, base, npf, alfw)) {
         eprintf("Frames$Free: something's wrong.\n");
@@ -554,6 +925,21 @@ static void system_frame_allocator_v1_destroy(frame_allocator_v1::closure_t* sel
     PANIC("frames_mod: destroy is not implemented!");
 }
 
+static memory_v1::size system_frame_allocator_v1_query_quota(frame_allocator_v1::closure_t* self, memory_v1::size* guaranteed, memory_v1::size* optimistic)
+{
+    frame_allocator_v1::state_t* client_state = reinterpret_cast<frame_allocator_v1::state_t*>(self->d_state);
+
+    *guaranteed = client_state->guaranteed_frames;
+    *optimistic = client_state->extra_frames;
+    return client_state->n_allocated_phys_frames;
+}
+
+static void system_frame_allocator_v1_set_revoker(frame_allocator_v1::closure_t* self, stretch_driver_v1::closure_t* driver)
+{
+    frame_allocator_v1::state_t* client_state = reinterpret_cast<frame_allocator_v1::state_t*>(self->d_state);
+    client_state->revoker = driver;
+}
+
 static frame_allocator_v1::closure_t* system_frame_allocator_v1_create_client(system_frame_allocator_v1::closure_t* self, memory_v1::address owner_dcb_virt, memory_v1::address owner_dcb_phys, uint32_t granted_frames, uint32_t extra_frames, uint32_t init_alloc_frames)
 {
     frame_allocator_v1::state_t* client_state = reinterpret_cast<frame_allocator_v1::state_t*>(self->d_state);
@@ -571,6 +957,16 @@ static frame_allocator_v1::closure_t* system_frame_allocator_v1_create_client(sy
         extra_frames = granted_frames;
 
     // Invariant: extra_frames >= granted_frames >= init_alloc_frames
+
+    // Admission control: all guarantees together must fit into free memory.
+    frame_accounts_t* accounts = client_state->accounts;
+    size_t available = (free_frames(accounts) > accounts->reserved_frames) ? free_frames(accounts) - accounts->reserved_frames : 0;
+    if (granted_frames > available)
+    {
+        logger::warning() << __FUNCTION__ << ": cannot guarantee " << granted_frames << " frames, only " << available << " available.";
+        return NULL;
+    }
+
     logger::debug() << __FUNCTION__ << ": allocating new client state";
 
     frame_allocator_v1::state_t* new_client_state = reinterpret_cast<frame_allocator_v1::state_t*>(client_state->heap->allocate(sizeof(*new_client_state)));
@@ -592,44 +988,57 @@ static frame_allocator_v1::closure_t* system_frame_allocator_v1_create_client(sy
     logger::debug() << __FUNCTION__ << ": initialising new client record";
     new_client_state->domain = domain;
     new_client_state->region_list = &domain->memory_region_list;
-    new_client_state->n_allocated_phys_frames = init_alloc_frames;
+    new_client_state->n_allocated_phys_frames = 0;
     new_client_state->owner = owner_dcb_virt; // use owner_dcb_phys instead?
     new_client_state->guaranteed_frames = granted_frames;
     new_client_state->extra_frames = extra_frames;
+    new_client_state->revoker = NULL;
+    new_client_state->accounts = accounts;
     new_client_state->heap = client_state->heap;
     new_client_state->module_state = client_state->module_state;
+    new_client_state->zero_pool = client_state->zero_pool;
+    new_client_state->frame_cache = client_state->frame_cache;
 
-    // Allocate init_alloc_frames.
-    address_t first_frame;
-    size_t n_frames;
-    frames_module_v1::state_t* cur_state;
-
-    logger::debug() << __FUNCTION__ << ": allocating " << init_alloc_frames << " init frames";
+    // Reserve the whole guarantee, init frames are charged against it below.
+    accounts->reserved_frames += granted_frames;
+    new_client_state->next_client = accounts->clients;
+    accounts->clients = new_client_state;
 
-    cur_state = alloc_any(self, init_alloc_frames, FRAME_WIDTH, &first_frame, &n_frames);
-    if (cur_state == NULL)
+    // Allocate init_alloc_frames, the buddy allocator has nothing to give for an empty request.
+    if (init_alloc_frames > 0)
     {
-        logger::fatal() << __FUNCTION__ << ": Out of physical memory, failed to allocate " << init_alloc_frames << " frames.";
-        PANIC("Out of physical memory.");
-    }
-    if (n_frames != init_alloc_frames)
-    {
-        PANIC("Region with non-standard frame width! Unsupported.");
-    }
+        address_t first_frame;
+        size_t n_frames;
+        frames_module_v1::state_t* cur_state;
 
-    address_t start = frame_address(cur_state, first_frame);
-    logger::debug() << __FUNCTION__ << ": allocated " << init_alloc_frames << " physical frames at " << start;
+        logger::debug() << __FUNCTION__ << ": allocating " << init_alloc_frames << " init frames";
 
-    alloc_update_free_predecessors(cur_state, first_frame);
-    mark_frames_used(new_client_state, cur_state, first_frame, n_frames);
+        cur_state = alloc_any(self, init_alloc_frames, FRAME_WIDTH, &first_frame, &n_frames);
+        if (cur_state == NULL)
+        {
+            logger::fatal() << __FUNCTION__ << ": Out of physical memory, failed to allocate " << init_alloc_frames << " frames.";
+            PANIC("Out of physical memory.");
+        }
 
-    /* Update the number of frames we've allocated on this interface */
-    client_state->n_allocated_phys_frames += init_alloc_frames;
+        // A region with a wider logical frame width hands out whole logical frames, which may cover
+        // more physical frames than asked for. The client is charged for all of them, the excess over
+        // the guarantee counts as optimistic.
+        size_t frame_width = cur_state->frame_width;
+        size_t n_phys_frames = n_frames << (frame_width - FRAME_WIDTH);
 
-    // Add the info about this newly allocated region to our list.
-    if(!add_range(new_client_state, start, init_alloc_frames, FRAME_WIDTH))
-    {
-        PANIC("Something's wrong.");
+        address_t start = frame_address(cur_state, first_frame);
+        logger::debug() << __FUNCTION__ << ": allocated " << n_phys_frames << " physical frames at " << start;
+
+        mark_frames_used(new_client_state, cur_state, first_frame, n_frames, frame_width);
+
+        /* Update the number of frames the new client has allocated */
+        charge_frames(new_client_state, n_phys_frames);
+
+        // Add the info about this newly allocated region to our list.
+        if(!add_range(new_client_state, start, n_phys_frames, frame_width))
+        {
+            PANIC("Something's wrong.");
+        }
     }
 
     // And that is it.
@@ -644,6 +1053,41 @@ static bool system_frame_allocator_v1_add_frames(system_frame_allocator_v1::clos
     return false;
 }
 
+/**
+ * Frames are zeroed with non-temporal stores, nobody is going to touch them soon and they should not push
+ * useful data out of the caches. The pool is filled a run at a time, single frames are only pooled when
+ * no contiguous run is left.
+ */
+static uint32_t system_frame_allocator_v1_zero_frames(system_frame_allocator_v1::closure_t* self, uint32_t max_frames)
+{
+    frame_allocator_v1::state_t* client_state = reinterpret_cast<frame_allocator_v1::state_t*>(self->d_state);
+    zero_pool_t* pool = client_state->zero_pool;
+    uint32_t n_zeroed = 0;
+
+    while ((n_zeroed < max_frames) && (pool->count < zero_pool_t::CAPACITY))
+    {
+        address_t first_frame;
+        size_t n_frames = std::min<size_t>(std::min<size_t>(zero_pool_t::RUN, zero_pool_t::CAPACITY - pool->count), max_frames - n_zeroed);
+        frames_module_v1::state_t* cur_state = alloc_any(self, n_frames, FRAME_WIDTH, &first_frame, &n_frames, pool->direct_limit);
+        if (!cur_state)
+            cur_state = alloc_any(self, 1, FRAME_WIDTH, &first_frame, &n_frames, pool->direct_limit);
+        if (!cur_state)
+            break;
+
+        mark_frames_used(client_state, cur_state, first_frame, n_frames);
+        charge_frames(client_state, n_frames);
+
+        address_t start = frame_address(cur_state, first_frame);
+        memutils::stream_clear_memory(reinterpret_cast<void*>(start), n_frames << FRAME_WIDTH);
+        for (size_t i = 0; i < n_frames; ++i)
+            pool->frames[pool->count++] = start + (i << FRAME_WIDTH);
+        n_zeroed += n_frames;
+    }
+
+    logger::debug() << __FUNCTION__ << ": zeroed " << n_zeroed << " frames, " << pool->count << " in the pool";
+    return n_zeroed;
+}
+
 static const system_frame_allocator_v1::ops_t system_frame_allocator_v1_methods =
 {
     system_frame_allocator_v1_allocate,
@@ -651,8 +1095,11 @@ static const system_frame_allocator_v1::ops_t system_frame_allocator_v1_methods
     system_frame_allocator_v1_query,
     system_frame_allocator_v1_free,
     system_frame_allocator_v1_destroy,
+    system_frame_allocator_v1_query_quota,
+    system_frame_allocator_v1_set_revoker,
     system_frame_allocator_v1_create_client,
     system_frame_allocator_v1_add_frames,
+    system_frame_allocator_v1_zero_frames,
 };
 
 //======================================================================================================================
@@ -662,20 +1109,20 @@ static const system_frame_allocator_v1::ops_t system_frame_allocator_v1_methods
 static memory_v1::size frames_module_v1_required_size(frames_module_v1::closure_t* self)
 {
     UNUSED(self);
-    size_t n_regions = 0, n_frames = 0, res = 0;
+    size_t n_regions = 0, n_bitmap_bytes = 0, res = 0;
     bootinfo_t* bi = new(bootinfo_t::ADDRESS) bootinfo_t; // simplify memory map operations
 
-    // Scan through the set of mem desc and count the number of logical frames they contain in total.
-    std::for_each(bi->mmap_begin(), bi->mmap_end(), [&n_regions, &n_frames](const multiboot_t::mmap_entry_t* e)
+    // Scan through the set of mem desc and count the size of free frame bitmaps they need in total.
+    std::for_each(bi->mmap_begin(), bi->mmap_end(), [&n_regions, &n_bitmap_bytes](const multiboot_t::mmap_entry_t* e)
     {
         if (e->type() == multiboot_t::mmap_entry_t::non_free)
             return;
 
-        n_frames += e->size() >> FRAME_WIDTH;
+        n_bitmap_bytes += buddy_bitmap_t::required_size(phys_frame_number(e->address()), phys_frame_number(e->size()));
         ++n_regions;
     });
 
-    res = sizeof(frame_allocator_v1::closure_t) + sizeof(frame_allocator_v1::state_t) + n_regions * sizeof(frames_module_v1::state_t) + n_frames * sizeof(frame_st);
+    res = sizeof(frame_allocator_v1::closure_t) + sizeof(frame_allocator_v1::state_t) + sizeof(zero_pool_t) + sizeof(frame_cache_t) + sizeof(frame_accounts_t) + n_regions * sizeof(frames_module_v1::state_t) + n_bitmap_bytes;
     res = page_align_up(res);
 
     logger::debug() << "frames_mod: required_size counted " << int(n_regions) << " memory regions";
@@ -694,21 +1141,43 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
     system_frame_allocator_v1::closure_t* ret = reinterpret_cast<system_frame_allocator_v1::closure_t*>(&client_state->closure);
     closure_init(ret, &system_frame_allocator_v1_methods, reinterpret_cast<system_frame_allocator_v1::state_t*>(client_state));
 
-    frames_module_v1::state_t* frames_state = reinterpret_cast<frames_module_v1::state_t*>(where_to_start + sizeof(frame_allocator_v1::state_t));
+    zero_pool_t* zero_pool = reinterpret_cast<zero_pool_t*>(where_to_start + sizeof(frame_allocator_v1::state_t));
+    frame_cache_t* frame_cache = reinterpret_cast<frame_cache_t*>(zero_pool + 1);
+    frame_accounts_t* accounts = reinterpret_cast<frame_accounts_t*>(frame_cache + 1);
+    frames_module_v1::state_t* frames_state = reinterpret_cast<frames_module_v1::state_t*>(accounts + 1);
 
     client_state->owner = OWNER_SYSTEM;
     client_state->n_allocated_phys_frames = 0;
-    client_state->guaranteed_frames = -1;
-    client_state->extra_frames = -1;
+    client_state->guaranteed_frames = UNLIMITED_FRAMES;
+    client_state->extra_frames = UNLIMITED_FRAMES;
+    client_state->revoker = NULL;
+    client_state->next_client = NULL;
     client_state->heap = 0;
     client_state->module_state = frames_state;
+    client_state->zero_pool = zero_pool;
+    client_state->frame_cache = frame_cache;
+    client_state->accounts = accounts;
 
     frames_module_v1::state_t* running_state = frames_state;
     frames_module_v1::state_t* last_state = running_state;
     size_t n_regions = 0;
 
     bootinfo_t* bi = new(bootinfo_t::ADDRESS) bootinfo_t;
-    std::for_each(bi->mmap_begin(), bi->mmap_end(), [&running_state, &last_state, &n_regions, rtab](const multiboot_t::mmap_entry_t* e)
+
+    zero_pool->direct_limit = direct_mapping_limit(bi);
+    zero_pool->system = client_state;
+    zero_pool->count = 0;
+    for (size_t i = 0; i < MAX_CPUS; ++i)
+        frame_cache->cpu[i].count = 0;
+
+    // The system client is not accounted in the list, it has no quota.
+    accounts->total_frames = 0;
+    accounts->committed_frames = 0;
+    accounts->reserved_frames = 0;
+    accounts->clients = NULL;
+    logger::debug() << "frames_mod: zeroed frames pool uses memory below " << zero_pool->direct_limit;
+
+    std::for_each(bi->mmap_begin(), bi->mmap_end(), [&running_state, &last_state, &n_regions, rtab, accounts](const multiboot_t::mmap_entry_t* e)
     {
         if (e->type() == multiboot_t::mmap_entry_t::non_free)
             return;
@@ -720,6 +1189,7 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
         {
             running_state->attrs = memory_v1::attrs_regular;
             running_state->ramtab = rtab;
+            accounts->total_frames += phys_frame_number(e->size());
             logger::debug() << "Adding RAM at " << e->address() << " is " << e->size() << " bytes of type " << e->type();
         }
         else
@@ -728,12 +1198,13 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
             running_state->ramtab = 0;
             logger::debug() << "Adding non-RAM at " << e->address() << " is " << e->size() << " bytes of type " << e->type();
         }
-        running_state->frames = reinterpret_cast<frame_st*>(running_state + 1);
-
-        for(size_t j = 0; j < running_state->n_logical_frames; ++j)
-            running_state->frames[j].free = running_state->n_logical_frames - j;
+        address_t first_frame = phys_frame_number(running_state->start);
+        uint32_t* bitmap = reinterpret_cast<uint32_t*>(running_state + 1);
+        running_state->free_frames.init(bitmap, first_frame, running_state->n_logical_frames);
+        running_state->free_frames.free_range(0, running_state->n_logical_frames);
 
-        running_state->next = reinterpret_cast<frames_module_v1::state_t*>(&running_state->frames[running_state->n_logical_frames]);
+        running_state->next = reinterpret_cast<frames_module_v1::state_t*>(reinterpret_cast<address_t>(bitmap)
+            + buddy_bitmap_t::required_size(first_frame, running_state->n_logical_frames));
         last_state = running_state;
         running_state = running_state->next;
         ++n_regions;
@@ -741,7 +1212,7 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
     last_state->next = 0;
 
     logger::debug() << "frames_mod: counted " << int(n_regions) << " memory regions again";
-    logger::debug() << "frames_mod: and finished at address " << page_align_up(reinterpret_cast<address_t>(&last_state->frames[last_state->n_logical_frames]));
+    logger::debug() << "frames_mod: and finished at address " << page_align_up(reinterpret_cast<address_t>(running_state));
 
     /*
      * Mark already used frames allocated.
@@ -759,10 +1230,9 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
         if (n_frames == 0)
             PANIC("Already allocated range deemed unavailable!");
 
-        alloc_update_free_predecessors(running_state, first_frame);
         mark_frames_used(client_state, running_state, first_frame, n_frames);
         
-        client_state->n_allocated_phys_frames += n_frames;
+        charge_frames(client_state, n_frames);
     });
 
     return ret;
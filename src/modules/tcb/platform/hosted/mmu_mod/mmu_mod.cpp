@@ -11,6 +11,9 @@
  * it only needs to create some bookkeeping structures and maintain them in already
  * allocated memory.
  * The memory map abstraction is supported by the bootinfo page.
+ *
+ * Ranges entered through mmu_v1 are also kept as a map of simulated page tables, which tlb_model_v1 translates
+ * through a simulated TLB for benchmarking memory layouts.
  */
 #include "algorithm"
 #include "default_console.h"
@@ -22,6 +25,8 @@
 #include "mmu_v1_impl.h"
 #include "ramtab_v1_interface.h"
 #include "ramtab_v1_impl.h"
+#include "tlb_model_v1_interface.h"
+#include "tlb_model_v1_impl.h"
 #include "system_frame_allocator_v1_interface.h"
 #include "heap_v1_interface.h"
 #include "stretch_allocator_v1_interface.h"
@@ -30,6 +35,7 @@
 #include "domain.h"
 #include "stretch_v1_state.h"
 #include "logger.h"
+#include "tlb_model.h"
 
 //======================================================================================================================
 // mmu_v1 state
@@ -72,6 +78,22 @@ typedef uint8_t     l2_info;    /* free or used info for 1K L2 page tables */
 #define PDIDX(_pdid)   ((_pdid) & 0xffff)
 #define PDIDX_MAX       0x80   /* Allow up to 128 protection domains */
 
+#define N_SIM_RANGES    1024   /* Ranges in the simulated page tables */
+#define TLB_PAGES_MAX   32     /* Longer ranges flush the whole simulated TLB, like the pc99 MMU does */
+
+/**
+ * Pages of one size mapped for a stretch in the simulated page tables.
+ */
+struct sim_range_t
+{
+    address_t start;
+    address_t end;
+    sid_t     sid;
+    uint8_t   page_width;
+    bool      mapped;      /* Unmapped pages fault instead of being translated */
+    bool      global;
+};
+
 struct mmu_v1::state_t
 {
     shadow_t              l1_shadows[N_L1_TABLES]; /**< Level 1 shadows (4Mb pages) */
@@ -84,6 +106,16 @@ struct mmu_v1::state_t
     pdom_st               pdominfo[PDIDX_MAX]; /* Map pdom idx to pdom_st's */
 
     bool                  use_global_pages;    /* Set iff we can use PGE    */
+    bool                  use_large_pages;     /* Set iff we can use PSE    */
+
+    tlb_model_t           tlb;                 /* Simulated TLB                          */
+    uint32_t              tlb_pdidx;           /* Domain the TLB translates for          */
+    uint64_t              tlb_faults;          /* Accesses outside mapped ranges         */
+    mmu_v1::tlb_stats     tlb_reasons;         /* Invalidations by reason                */
+    tlb_model_v1::counters* sid_counts;        /* SID_MAX counters from the heap, or NULL */
+    tlb_model_v1::counters pdom_counts[PDIDX_MAX];
+    uint32_t              n_ranges;
+    sim_range_t           ranges[N_SIM_RANGES]; /* Simulated page tables, sorted by start */
 
     /*system_*/frame_allocator_v1::closure_t*  system_frame_allocator;
     heap_v1::closure_t*                        heap;
@@ -131,6 +163,200 @@ inline uint16_t alloc_pdidx(mmu_v1::state_t* state)
     return 0xdead;
 }
 
+//======================================================================================================================
+// simulated page tables
+//======================================================================================================================
+
+inline bool global_pages(mmu_v1::state_t* state, stretch_v1::rights rights)
+{
+    return state->use_global_pages && rights.has(stretch_v1::right_global);
+}
+
+/**
+ * Index of the first range ending above @a va, n_ranges if there is none.
+ */
+static size_t find_range(mmu_v1::state_t* state, address_t va)
+{
+    size_t lo = 0, hi = state->n_ranges;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (state->ranges[mid].end <= va)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void insert_range(mmu_v1::state_t* state, size_t idx, const sim_range_t& r)
+{
+    if (state->n_ranges == N_SIM_RANGES)
+    {
+        logger::warning() << __FUNCTION__ << ": out of simulated ranges, [" << r.start << ".." << r.end << ") is not modelled";
+        return;
+    }
+
+    for (size_t i = state->n_ranges; i > idx; --i)
+        state->ranges[i] = state->ranges[i - 1];
+    state->ranges[idx] = r;
+    ++state->n_ranges;
+}
+
+static void erase_range(mmu_v1::state_t* state, size_t idx)
+{
+    for (size_t i = idx + 1; i < state->n_ranges; ++i)
+        state->ranges[i - 1] = state->ranges[i];
+    --state->n_ranges;
+}
+
+/**
+ * Take [@a start, @a end) out of the simulated page tables, trimming or splitting ranges which overlap it.
+ */
+static void remove_ranges(mmu_v1::state_t* state, address_t start, address_t end)
+{
+    size_t i = find_range(state, start);
+
+    while ((i < state->n_ranges) && (state->ranges[i].start < end))
+    {
+        sim_range_t& r = state->ranges[i];
+
+        if ((r.start < start) && (r.end > end))
+        {
+            sim_range_t tail = r;
+            tail.start = end;
+            r.end = start;
+            insert_range(state, i + 1, tail);
+            return;
+        }
+
+        if (r.start < start)
+        {
+            r.end = start;
+            ++i;
+        }
+        else if (r.end > end)
+        {
+            r.start = end;
+            return;
+        }
+        else
+            erase_range(state, i);
+    }
+}
+
+/**
+ * Split the range which spans @a va into two ranges meeting at @a va.
+ */
+static void split_range(mmu_v1::state_t* state, address_t va)
+{
+    size_t i = find_range(state, va);
+
+    if ((i < state->n_ranges) && (state->ranges[i].start < va))
+    {
+        sim_range_t tail = state->ranges[i];
+        tail.start = va;
+        size_t n_ranges = state->n_ranges;
+        insert_range(state, i + 1, tail);
+        if (state->n_ranges > n_ranges) // Not inserted if out of simulated ranges.
+            state->ranges[i].end = va;
+    }
+}
+
+static void enter_range(mmu_v1::state_t* state, sid_t sid, address_t start, address_t end, size_t page_width, bool mapped, bool global)
+{
+    remove_ranges(state, start, end);
+
+    sim_range_t r;
+    r.start = start;
+    r.end = end;
+    r.sid = sid;
+    r.page_width = page_width;
+    r.mapped = mapped;
+    r.global = global;
+    insert_range(state, find_range(state, start), r);
+}
+
+/**
+ * Enter @a size bytes at @a virt mapped onto @a phys. Like the pc99 MMU, 4K pages are promoted to 4M pages over
+ * every whole 4M where both addresses are 4M aligned.
+ */
+static void enter_mapped_range(mmu_v1::state_t* state, sid_t sid, address_t virt, address_t phys, size_t size, size_t page_width, bool global)
+{
+    const address_t large = 1UL << tlb_model_t::WIDTH_4M;
+    address_t end = virt + size;
+
+    if ((page_width == tlb_model_t::WIDTH_4K) && state->use_large_pages && (((virt ^ phys) & (large - 1)) == 0))
+    {
+        address_t body = (virt + large - 1) & ~(large - 1);
+        address_t tail = end & ~(large - 1);
+
+        if (body < tail)
+        {
+            if (virt < body)
+                enter_range(state, sid, virt, body, tlb_model_t::WIDTH_4K, true, global);
+            enter_range(state, sid, body, tail, tlb_model_t::WIDTH_4M, true, global);
+            if (tail < end)
+                enter_range(state, sid, tail, end, tlb_model_t::WIDTH_4K, true, global);
+            return;
+        }
+    }
+
+    enter_range(state, sid, virt, end, page_width, true, global);
+}
+
+/**
+ * Drop translations of [@a start, @a end) from the simulated TLB, a page at a time or by a whole TLB flush
+ * for long ranges. @a stale counts the pages whose translations went stale.
+ */
+static void invalidate_ranges(mmu_v1::state_t* state, address_t start, address_t end, uint64_t& stale)
+{
+    size_t first = find_range(state, start);
+    size_t n_pages = 0;
+    bool global = false;
+    size_t i;
+
+    for (i = first; (i < state->n_ranges) && (state->ranges[i].start < end); ++i)
+    {
+        const sim_range_t& r = state->ranges[i];
+        if (!r.mapped)
+            continue;
+        address_t lo = std::max(start, r.start) >> r.page_width;
+        address_t hi = (std::min(end, r.end) + (1UL << r.page_width) - 1) >> r.page_width;
+        n_pages += hi - lo;
+        global = global || r.global;
+    }
+
+    stale += n_pages;
+
+    if (n_pages > TLB_PAGES_MAX)
+    {
+        state->tlb.flush(global);
+        return;
+    }
+
+    for (i = first; (i < state->n_ranges) && (state->ranges[i].start < end); ++i)
+    {
+        const sim_range_t& r = state->ranges[i];
+        if (!r.mapped)
+            continue;
+        address_t va = (std::max(start, r.start) >> r.page_width) << r.page_width;
+        for (; va < std::min(end, r.end); va += 1UL << r.page_width)
+            state->tlb.flush_page(va);
+    }
+}
+
+inline void count_access(tlb_model_v1::counters& c, size_t walk_steps)
+{
+    if (walk_steps)
+    {
+        ++c.misses;
+        c.walk_steps += walk_steps;
+    }
+    else
+        ++c.hits;
+}
+
 //======================================================================================================================
 // mmu_v1 methods
 //======================================================================================================================
@@ -143,10 +369,48 @@ static void mmu_v1_start(mmu_v1::closure_t* self, protection_domain_v1::id root_
 
 static void mmu_v1_add_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, stretch_v1::rights global_rights)
 {
+    auto state = self->d_state;
+    address_t end = mem_range.start_addr + (mem_range.n_pages << mem_range.page_width);
+    enter_range(state, str->d_state->sid, mem_range.start_addr, end, mem_range.page_width, /*mapped:*/false, global_pages(state, global_rights));
 }
 
 static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, memory_v1::physmem_desc pmem, stretch_v1::rights global_rights)
 {
+    auto state = self->d_state;
+    size_t page_width = std::max(mem_range.page_width, pmem.frame_width);
+    enter_mapped_range(state, str->d_state->sid, mem_range.start_addr, pmem.start_addr, mem_range.n_pages << mem_range.page_width, page_width, global_pages(state, global_rights));
+}
+
+static void mmu_v1_add_mapped_ranges(mmu_v1::closure_t* self, mmu_v1::stretch_seq strs, memory_v1::virtmem_desc mem_range, memory_v1::physmem_desc pmem, stretch_v1::rights global_rights)
+{
+    auto state = self->d_state;
+    size_t page_width = std::max(mem_range.page_width, pmem.frame_width);
+    address_t virt = mem_range.start_addr;
+    address_t phys = pmem.start_addr;
+
+    for (auto str : strs)
+    {
+        stretch_v1::state_t* s = str->d_state;
+        enter_mapped_range(state, s->sid, virt, phys, s->size, page_width, global_pages(state, global_rights));
+        virt += s->size;
+        phys += s->size;
+    }
+}
+
+static void mmu_v1_add_cow_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, memory_v1::physmem_desc pmem, stretch_v1::rights global_rights)
+{
+    auto state = self->d_state;
+    address_t end = mem_range.start_addr + (mem_range.n_pages << mem_range.page_width);
+
+    invalidate_ranges(state, mem_range.start_addr, end, state->tlb_reasons.remap_pages);
+    enter_range(state, str->d_state->sid, mem_range.start_addr, end, tlb_model_t::WIDTH_4K, /*mapped:*/true, global_pages(state, global_rights));
+}
+
+static void mmu_v1_remap_page(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::address virt, memory_v1::address phys, stretch_v1::rights global_rights)
+{
+    auto state = self->d_state;
+    ++state->tlb_reasons.remap_pages;
+    state->tlb.flush_page(virt);
 }
 
 /**
@@ -154,11 +418,29 @@ static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure
  */
 static void mmu_v1_update_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, stretch_v1::rights global_rights)
 {
+    auto state = self->d_state;
+    address_t end = mem_range.start_addr + (mem_range.n_pages << mem_range.page_width);
+
+    invalidate_ranges(state, mem_range.start_addr, end, state->tlb_reasons.protect_pages);
+
+    // Pages of the ranges outside [start, end) keep their state.
+    split_range(state, mem_range.start_addr);
+    split_range(state, end);
+
+    for (size_t i = find_range(state, mem_range.start_addr); (i < state->n_ranges) && (state->ranges[i].start < end); ++i)
+    {
+        state->ranges[i].mapped = true;
+        state->ranges[i].global = global_pages(state, global_rights);
+    }
 }
 
 static void mmu_v1_free_range(mmu_v1::closure_t* self, memory_v1::virtmem_desc mem_range)
 {
+    auto state = self->d_state;
+    address_t end = mem_range.start_addr + (mem_range.n_pages << mem_range.page_width);
 
+    invalidate_ranges(state, mem_range.start_addr, end, state->tlb_reasons.unmap_pages);
+    remove_ranges(state, mem_range.start_addr, end);
 }
 
 static protection_domain_v1::id mmu_v1_create_domain(mmu_v1::closure_t* self)
@@ -269,11 +551,48 @@ static void mmu_v1_clone_rights(mmu_v1::closure_t* self, stretch_v1::closure_t*
 
 }
 
+/**
+ * The simulated TLB translates for the new domain from now on, an untagged one is flushed.
+ */
+static void mmu_v1_switch_domain(mmu_v1::closure_t* self, protection_domain_v1::id dom_id)
+{
+    auto state = self->d_state;
+    uint16_t idx = PDIDX(dom_id);
+
+    if (idx >= PDIDX_MAX)
+    {
+        kconsole << __FUNCTION__ << ": bogus pdom id " << dom_id << endl;
+        nucleus::debug_stop();
+        return;
+    }
+
+    state->tlb_pdidx = idx;
+    state->tlb.switch_asn(idx);
+}
+
+/**
+ * Flush counters come from the simulated TLB.
+ */
+static mmu_v1::tlb_stats mmu_v1_get_tlb_stats(mmu_v1::closure_t* self)
+{
+    auto state = self->d_state;
+    const tlb_model_t::stats_t& t = state->tlb.stats();
+    mmu_v1::tlb_stats s = state->tlb_reasons;
+
+    s.invalidated_pages = t.page_flushes;
+    s.full_flushes = t.flushes;
+    s.global_flushes = t.global_flushes;
+    return s;
+}
+
 static const mmu_v1::ops_t mmu_v1_methods =
 {
     mmu_v1_start,
     mmu_v1_add_range,
     mmu_v1_add_mapped_range,
+    mmu_v1_add_mapped_ranges,
+    mmu_v1_add_cow_range,
+    mmu_v1_remap_page,
     mmu_v1_update_range,
     mmu_v1_free_range,
     mmu_v1_create_domain,
@@ -283,7 +602,9 @@ static const mmu_v1::ops_t mmu_v1_methods =
     mmu_v1_query_rights,
     mmu_v1_query_asn,
     mmu_v1_query_global_rights,
-    mmu_v1_clone_rights
+    mmu_v1_clone_rights,
+    mmu_v1_switch_domain,
+    mmu_v1_get_tlb_stats
 };
 
 //======================================================================================================================
@@ -344,6 +665,113 @@ static const ramtab_v1::ops_t ramtab_v1_methods =
     ramtab_v1_get
 };
 
+//======================================================================================================================
+// tlb_model_v1 methods
+//======================================================================================================================
+
+/**
+ * Per stretch counters are allocated from the heap the first time the model is configured after finish_init.
+ */
+static bool tlb_model_v1_configure(tlb_model_v1::closure_t* self, uint32_t entries, uint32_t ways, bool tagged)
+{
+    mmu_v1::state_t* state = reinterpret_cast<mmu_v1::state_t*>(self->d_state);
+
+    bool ok = state->tlb.configure(entries, ways, tagged);
+
+    if (!state->sid_counts && state->heap)
+        state->sid_counts = reinterpret_cast<tlb_model_v1::counters*>(state->heap->allocate(SID_MAX * sizeof(tlb_model_v1::counters)));
+    if (state->sid_counts)
+        memutils::clear_memory(state->sid_counts, SID_MAX * sizeof(tlb_model_v1::counters));
+
+    memutils::clear_memory(state->pdom_counts, sizeof(state->pdom_counts));
+    memutils::clear_memory(&state->tlb_reasons, sizeof(state->tlb_reasons));
+    state->tlb_faults = 0;
+
+    logger::debug() << __FUNCTION__ << ": " << entries << " entries, " << ways << " ways" << (tagged ? ", tagged" : "") << (ok ? "" : " not supported");
+    return ok;
+}
+
+/**
+ * Translations are counted for the stretch and the current domain.
+ */
+static bool tlb_model_v1_access(tlb_model_v1::closure_t* self, memory_v1::address addr)
+{
+    mmu_v1::state_t* state = reinterpret_cast<mmu_v1::state_t*>(self->d_state);
+
+    if (!state->tlb.enabled())
+        return false;
+
+    size_t i = find_range(state, addr);
+    if ((i == state->n_ranges) || (state->ranges[i].start > addr) || !state->ranges[i].mapped)
+    {
+        ++state->tlb_faults;
+        return false;
+    }
+
+    const sim_range_t& r = state->ranges[i];
+    size_t walk_steps = state->tlb.access(addr, r.page_width, r.global);
+
+    count_access(state->pdom_counts[state->tlb_pdidx], walk_steps);
+    if (state->sid_counts && (r.sid < SID_MAX))
+        count_access(state->sid_counts[r.sid], walk_steps);
+
+    return walk_steps == 0;
+}
+
+static tlb_model_v1::counters tlb_model_v1_stretch_counters(tlb_model_v1::closure_t* self, stretch_v1::closure_t* str)
+{
+    mmu_v1::state_t* state = reinterpret_cast<mmu_v1::state_t*>(self->d_state);
+    sid_t sid = str->d_state->sid;
+    tlb_model_v1::counters c;
+
+    memutils::clear_memory(&c, sizeof(c));
+    if (state->sid_counts && (sid < SID_MAX))
+        c = state->sid_counts[sid];
+    return c;
+}
+
+static tlb_model_v1::counters tlb_model_v1_domain_counters(tlb_model_v1::closure_t* self, protection_domain_v1::id dom_id)
+{
+    mmu_v1::state_t* state = reinterpret_cast<mmu_v1::state_t*>(self->d_state);
+    uint16_t idx = PDIDX(dom_id);
+    tlb_model_v1::counters c;
+
+    memutils::clear_memory(&c, sizeof(c));
+    if (idx < PDIDX_MAX)
+        c = state->pdom_counts[idx];
+    return c;
+}
+
+static tlb_model_v1::stats tlb_model_v1_get_stats(tlb_model_v1::closure_t* self)
+{
+    mmu_v1::state_t* state = reinterpret_cast<mmu_v1::state_t*>(self->d_state);
+    const tlb_model_t::stats_t& t = state->tlb.stats();
+    tlb_model_v1::stats s;
+
+    s.hits = t.hits;
+    s.misses = t.misses;
+    s.walk_steps = t.walk_steps;
+    s.flushes = t.flushes;
+    s.global_flushes = t.global_flushes;
+    s.page_flushes = t.page_flushes;
+    s.flushed_entries = t.flushed_entries;
+    s.evictions = t.evictions;
+    s.faults = state->tlb_faults;
+    return s;
+}
+
+static const tlb_model_v1::ops_t tlb_model_v1_methods =
+{
+    tlb_model_v1_configure,
+    tlb_model_v1_access,
+    tlb_model_v1_stretch_counters,
+    tlb_model_v1_domain_counters,
+    tlb_model_v1_get_stats
+};
+
+// Bound to the MMU state by mmu_module_v1_create(), root domain picks it up as a module export.
+static tlb_model_v1::closure_t tlb_model_clos;
+
 //======================================================================================================================
 // mmu_module_v1 methods
 //======================================================================================================================
@@ -524,6 +952,18 @@ static mmu_v1::closure_t* mmu_module_v1_create(mmu_module_v1::closure_t* self, u
     INFO_PAGE.protection_domains = &(state->pdom_tbl);
 
     state->use_global_pages = (INFO_PAGE.cpu_features & X86_32_FEAT_PGE) != 0;
+    state->use_large_pages = (INFO_PAGE.cpu_features & X86_32_FEAT_PSE) != 0;
+
+    // The simulated TLB stays off until configured.
+    new(&state->tlb) tlb_model_t;
+    state->tlb_pdidx = 0;
+    state->tlb_faults = 0;
+    memutils::clear_memory(&state->tlb_reasons, sizeof(state->tlb_reasons));
+    memutils::clear_memory(state->pdom_counts, sizeof(state->pdom_counts));
+    state->sid_counts = NULL;
+    state->n_ranges = 0;
+
+    closure_init(&tlb_model_clos, &tlb_model_v1_methods, reinterpret_cast<tlb_model_v1::state_t*>(first_range));
 
     // Intialise our closures, etc to NULL for now  // will be fixed by $Done later
     state->system_frame_allocator = NULL;
@@ -580,3 +1020,4 @@ static const mmu_module_v1::closure_t clos =
 };
 
 EXPORT_CLOSURE_TO_ROOTDOM(mmu_module, v1, clos);
+EXPORT_CLOSURE_TO_ROOTDOM(tlb_model, v1, tlb_model_clos);
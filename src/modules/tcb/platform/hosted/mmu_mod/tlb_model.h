@@ -0,0 +1,203 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+
+/**
+ * Set associative TLB with least recently used replacement, simulated for the hosted MMU.
+ *
+ * Entries cache translations of 4K or 4M pages of a two level page table, so a miss costs two or one memory
+ * references to walk. Entries are tagged with the address space they were loaded in, which only matters for
+ * a tagged TLB: an untagged one drops all but global entries when switching address spaces.
+ */
+class tlb_model_t
+{
+public:
+    static const size_t MAX_ENTRIES = 1024;
+    static const size_t WIDTH_4K = 12;
+    static const size_t WIDTH_4M = 22;
+
+    struct stats_t
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t walk_steps;
+        uint64_t flushes;
+        uint64_t global_flushes;
+        uint64_t page_flushes;
+        uint64_t flushed_entries;
+        uint64_t evictions;
+    };
+
+    tlb_model_t() : n_sets(0), n_ways(0), tagged(false), current(0), clock(0) { reset_stats(); }
+
+    /**
+     * Set up an empty TLB of @a entries entries in sets of @a ways, 0 @a entries turns it off.
+     * @return false if the geometry is not supported, the TLB is off then.
+     */
+    bool configure(size_t entries, size_t ways, bool tag_entries)
+    {
+        n_sets = 0;
+        reset_stats();
+
+        if (entries == 0)
+            return true;
+        if ((ways == 0) || (entries > MAX_ENTRIES) || (entries % ways != 0))
+            return false;
+
+        n_ways = ways;
+        n_sets = entries / ways;
+        tagged = tag_entries;
+        clock = 0;
+        for (size_t i = 0; i < entries; ++i)
+            slots[i].valid = false;
+        return true;
+    }
+
+    bool enabled() const { return n_sets > 0; }
+
+    /**
+     * Translate @a va in a page of @a page_width bits, loading the translation on a miss.
+     * @return number of page table references taken, 0 on a hit.
+     */
+    size_t access(address_t va, size_t page_width, bool global)
+    {
+        if (!enabled())
+            return 0;
+
+        size_t vpn = va >> page_width;
+        entry_t* set = set_of(vpn);
+        entry_t* victim = &set[0];
+
+        for (size_t i = 0; i < n_ways; ++i)
+        {
+            entry_t& e = set[i];
+            if (e.valid && (e.width == page_width) && (e.vpn == vpn) && (e.global || (e.asn == current)))
+            {
+                e.used = ++clock;
+                ++counters.hits;
+                return 0;
+            }
+            if (!e.valid)
+                victim = &e;
+            else if (victim->valid && (e.used < victim->used))
+                victim = &e;
+        }
+
+        size_t steps = (page_width >= WIDTH_4M) ? 1 : 2;
+        ++counters.misses;
+        counters.walk_steps += steps;
+
+        if (victim->valid)
+            ++counters.evictions;
+        victim->valid = true;
+        victim->global = global;
+        victim->width = page_width;
+        victim->vpn = vpn;
+        victim->asn = current;
+        victim->used = ++clock;
+        return steps;
+    }
+
+    /**
+     * Drop all entries but global ones, or all of them if @a global.
+     */
+    void flush(bool global)
+    {
+        if (!enabled())
+            return;
+
+        if (global)
+            ++counters.global_flushes;
+        else
+            ++counters.flushes;
+
+        for (size_t i = 0; i < n_sets * n_ways; ++i)
+        {
+            if (slots[i].valid && (global || !slots[i].global))
+                drop(slots[i]);
+        }
+    }
+
+    /**
+     * Drop entries of the page holding @a va in every address space, global ones included.
+     * Both page sizes are looked up, like invlpg does.
+     */
+    void flush_page(address_t va)
+    {
+        if (!enabled())
+            return;
+
+        ++counters.page_flushes;
+        drop_page(va >> WIDTH_4K, WIDTH_4K);
+        drop_page(va >> WIDTH_4M, WIDTH_4M);
+    }
+
+    /**
+     * Make @a asn the current address space.
+     */
+    void switch_asn(uint32_t asn)
+    {
+        if (asn == current)
+            return;
+        current = asn;
+        if (enabled() && !tagged)
+            flush(false);
+    }
+
+    const stats_t& stats() const { return counters; }
+
+private:
+    struct entry_t
+    {
+        size_t   vpn;    //!< Page number at the entry's page width.
+        uint64_t used;   //!< Clock of the last hit, for replacement.
+        uint32_t asn;
+        uint8_t  width;
+        bool     global;
+        bool     valid;
+    };
+
+    entry_t* set_of(size_t vpn)
+    {
+        return &slots[(vpn % n_sets) * n_ways];
+    }
+
+    void drop(entry_t& e)
+    {
+        e.valid = false;
+        ++counters.flushed_entries;
+    }
+
+    void drop_page(size_t vpn, size_t width)
+    {
+        entry_t* set = set_of(vpn);
+        for (size_t i = 0; i < n_ways; ++i)
+        {
+            if (set[i].valid && (set[i].width == width) && (set[i].vpn == vpn))
+                drop(set[i]);
+        }
+    }
+
+    void reset_stats()
+    {
+        counters.hits = counters.misses = counters.walk_steps = 0;
+        counters.flushes = counters.global_flushes = counters.page_flushes = 0;
+        counters.flushed_entries = counters.evictions = 0;
+    }
+
+    size_t   n_sets;
+    size_t   n_ways;
+    bool     tagged;
+    uint32_t current;
+    uint64_t clock;
+    stats_t  counters;
+    entry_t  slots[MAX_ENTRIES];
+};
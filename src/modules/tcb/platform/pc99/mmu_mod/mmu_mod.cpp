@@ -17,13 +17,17 @@
 #include "ramtab_v1_interface.h"
 #include "ramtab_v1_impl.h"
 #include "page_directory.h"
+#include "pdom_rights.h"
 #include "system_frame_allocator_v1_interface.h"
 #include "heap_v1_interface.h"
 #include "stretch_allocator_v1_interface.h"
+#include "slab_factory_v1_interface.h"
+#include "slab_cache_v1_interface.h"
 #include "nucleus.h"
 #include "cpu.h"
 #include "domain.h"
 #include "stretch_v1_state.h"
+#include "per_cpu.h"
 
 //======================================================================================================================
 // mmu_v1 state
@@ -39,16 +43,25 @@ struct ramtab_entry_t
     uint16_t state;         /* Misc bits, e.g. is_mapped, is_nailed, etc */
 } PACKED;
 
-struct pdom_st
+/**
+ * Rights leaves of protection domains come from a slab cache.
+ */
+struct slab_leaves_t
 {
-    uint16_t               refcnt;  /* Reference count on this pdom    */
-    uint16_t               gen;     /* Current generation of this pdom */
-    stretch_v1::closure_t* stretch; /* Handle on stretch (for destroy) */
+    slab_cache_v1::closure_t* cache;
+
+    uint8_t* new_leaf() { return reinterpret_cast<uint8_t*>(cache->allocate()); }
+    void delete_leaf(uint8_t* leaf) { cache->free(reinterpret_cast<memory_v1::address>(leaf)); }
 };
 
-struct pdom_t
+typedef pdom_rights_t<slab_leaves_t, SID_MAX> pdom_t;
+
+struct pdom_st
 {
-    uint8_t rights[SID_MAX/2];
+    pdom_t*                pdom;      /* Rights of this pdom, NULL if the slot is free */
+    uint16_t               refcnt;    /* Reference count on this pdom    */
+    uint16_t               gen;       /* Current generation of this pdom */
+    uint32_t               next_free; /* Next slot on the free list      */
 };
 
 struct shadow_t
@@ -59,12 +72,33 @@ struct shadow_t
 
 #define SHADOW(_va)  reinterpret_cast<shadow_t*>(reinterpret_cast<char*>(_va) + 4*KiB)
 
-typedef uint8_t     l2_info;    /* free or used info for 1K L2 page tables */
-#define L2FREE      (l2_info)0x12
-#define L2USED      (l2_info)0x99
+/**
+ * Free L2 tables are all zero except for this header, which links them into the free list.
+ */
+struct l2_free_t
+{
+    address_t next;  /* Virtual address of the next free table, 0 at the end */
+    address_t phys;  /* Physical address of this table                       */
+};
 
 #define PDIDX(_pdid)   ((_pdid) & 0xffff)
-#define PDIDX_MAX       0x80   /* Allow up to 128 protection domains */
+#define PDIDX_MAX       0x10000     /* All 16 bit pdom indices are usable */
+#define PDIDX_NONE      0xffffffff
+#define PDOM_CHUNK      256         /* Slots added to the pdom table at a time */
+
+#define TLB_PENDING_MAX 32          /* Stale pages invalidated one at a time, more flush the whole TLB */
+
+/**
+ * Translations which went stale on one cpu and were not invalidated yet, with the cpu's counters.
+ */
+struct tlb_cpu_t
+{
+    address_t         pages[TLB_PENDING_MAX]; /* Pages to invalidate one at a time          */
+    uint32_t          n_pages;
+    bool              full;                   /* Too many pages, flush the whole TLB        */
+    bool              global;                 /* Some stale translation is of a global page */
+    mmu_v1::tlb_stats stats;
+};
 
 struct mmu_v1::state_t
 {
@@ -75,11 +109,14 @@ struct mmu_v1::state_t
     mmu_v1::closure_t     mmu_closure;
     ramtab_v1::closure_t  ramtab_closure;
 
-    uint32_t              next_pdidx;          /* Next free pdom idx (hint) */
-    pdom_t*               pdom_tbl[PDIDX_MAX]; /* Map pdom idx to pdom_t's  */
-    pdom_st               pdominfo[PDIDX_MAX]; /* Map pdom idx to pdom_st's */
+    uint32_t              pdom_free;                        /* First free pdom slot           */
+    uint32_t              pdom_n_chunks;                    /* Chunks of slots allocated      */
+    pdom_st*              pdom_tbl[PDIDX_MAX / PDOM_CHUNK]; /* Map pdom idx to pdom_st chunks */
+    slab_cache_v1::closure_t* pdom_cache;                   /* Allocator of pdom_t's          */
+    slab_leaves_t         pdom_leaves;                      /* Allocator of rights leaves     */
 
     bool                  use_global_pages;    /* Set iff we can use PGE    */
+    bool                  use_large_pages;     /* Set iff we can use PSE    */
 
     /*system_*/frame_allocator_v1::closure_t*  system_frame_allocator;
     heap_v1::closure_t*                        heap;
@@ -90,87 +127,318 @@ struct mmu_v1::state_t
     address_t             l1_mapping_virt; /* Virtual  address of l1 page table */
     address_t             l1_mapping_phys; /* Physical address of l1 page table */
 
-    address_t             l2_virt;         /* Virtual  address of l2 array base */
-    address_t             l2_phys;         /* Physical address of l2 array base */
-
     address_t             l1_virt_virt;    /* Virtual address of l2 PtoV table  */
 
     ramtab_entry_t*       ramtab;          /* Base of ram table                 */
     size_t                ramtab_size;     /* Size of ram table                 */
 
-    uint32_t              l2_max;          /* Index of the last available chunk   */
-    uint32_t              l2_next;         /* Index of first potential free chunk */
-    l2_info               info[0];         /* Free/used L2 info; actually l2_max entries */
+    address_t             l2_free;         /* Virtual address of the first free L2 table */
+    uint32_t              l2_n_free;       /* Number of tables on the free list          */
+    uint32_t              l2_total;        /* Number of tables in the pool               */
+    bool                  l2_growing;      /* Set while a pool chunk is being mapped     */
+    uint16_t              l2_used[N_L1_TABLES]; /* Non-empty entries of each L2 table    */
+
+    tlb_cpu_t             tlb[MAX_CPUS];   /* Stale translations of each cpu             */
 };
 
+//======================================================================================================================
+// TLB invalidation
+//======================================================================================================================
+
+enum tlb_reason_t { tlb_unmap, tlb_protect, tlb_remap, tlb_split };
+
+/**
+ * Note that the translation made from entry @a old for the page at @a va, of either size, went stale.
+ * Non-present entries are never cached in the TLB, so there is nothing to invalidate for them.
+ */
+static void tlb_stale(mmu_v1::state_t* state, address_t va, page_t old, tlb_reason_t reason)
+{
+    if (!old.is_present())
+        return;
+
+    per_cpu_section_t guard;
+    tlb_cpu_t& tlb = state->tlb[this_cpu()];
+
+    switch (reason)
+    {
+        case tlb_unmap:   ++tlb.stats.unmap_pages;   break;
+        case tlb_protect: ++tlb.stats.protect_pages; break;
+        case tlb_remap:   ++tlb.stats.remap_pages;   break;
+        case tlb_split:   ++tlb.stats.split_pages;   break;
+    }
+
+    if (old.is_global())
+        tlb.global = true;
+
+    if (tlb.full)
+        return;
+
+    if (tlb.n_pages == TLB_PENDING_MAX)
+        tlb.full = true;
+    else
+        tlb.pages[tlb.n_pages++] = va;
+}
+
+/**
+ * Invalidate stale translations of this cpu: a page at a time, or by flushing the whole TLB if there are too many.
+ * Global pages survive a whole TLB flush unless some of them went stale.
+ */
+static void tlb_sync(mmu_v1::state_t* state)
+{
+    per_cpu_section_t guard;
+    tlb_cpu_t& tlb = state->tlb[this_cpu()];
+
+    if (tlb.full)
+    {
+        nucleus::flush_tlb(tlb.global);
+        if (tlb.global)
+            ++tlb.stats.global_flushes;
+        else
+            ++tlb.stats.full_flushes;
+    }
+    else if (tlb.n_pages > 0)
+    {
+        nucleus::flush_tlb_pages(tlb.pages, tlb.n_pages);
+        tlb.stats.invalidated_pages += tlb.n_pages;
+    }
+
+    tlb.n_pages = 0;
+    tlb.full = false;
+    tlb.global = false;
+}
+
 //======================================================================================================================
 // helper methods
 //======================================================================================================================
 
 #define L2SIZE          (8*KiB)                // 4K for L2 pagetable + 4K for shadow(?)
+#define L2_LOW_WATER    8                      // Grow the pool when this few free tables remain
+#define L2_GROW_TABLES  32                     // Tables added to the pool at a time
 
-inline bool alloc_l2table(mmu_v1::state_t* state, address_t *l2va, address_t *l2pa)
+/**
+ * Put a zeroed L2 table on the free list.
+ */
+inline void free_l2table(mmu_v1::state_t* state, address_t l2va, address_t l2pa)
 {
-    size_t i;
-
-    for (i = state->l2_next; i < state->l2_max; i++)
-        if (state->info[i] == L2FREE)
-            break;
+    l2_free_t* head = reinterpret_cast<l2_free_t*>(l2va);
+    head->next = state->l2_free;
+    head->phys = l2pa;
+    state->l2_free = l2va;
+    ++state->l2_n_free;
+}
 
-    if (i == state->l2_max)
+inline bool alloc_l2table(mmu_v1::state_t* state, address_t *l2va, address_t *l2pa)
+{
+    if (!state->l2_free)
     {
-        // XXX go get some more mem from frames/salloc
         logger::warning() << "alloc_l2table: out of memory for tables!";
         return false;
     }
 
-    state->info[i] = L2USED;
-    state->l2_next = i+1;
-
-    *l2va = state->l2_virt + (L2SIZE * i);
-    memutils::clear_memory(reinterpret_cast<void*>(*l2va), L2SIZE);
-    *l2pa = state->l2_phys + (L2SIZE * i);
+    l2_free_t* head = reinterpret_cast<l2_free_t*>(state->l2_free);
+    *l2va = state->l2_free;
+    *l2pa = head->phys;
+    state->l2_free = head->next;
+    --state->l2_n_free;
 
-    logger::debug() << "alloc_l2table: new L2 table at va=" << *l2va << ", pa=" << *l2pa << ", shadow va=" << SHADOW(*l2va);
+    // The rest of a free table is already clear.
+    head->next = 0;
+    head->phys = 0;
     return true;
 }
 
-static bool add4k_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t sid)
+/**
+ * Translate a virtual address mapped in our page tables.
+ */
+static address_t virt_to_phys(mmu_v1::state_t* state, address_t va)
+{
+    size_t l1idx = pde_entry(va);
+    page_t& pde = state->l1_mapping[l1idx];
+
+    if (pde.is_4mb())
+        return pde.frame() + (va & ((1UL << page_t::width_4mib) - 1));
+
+    page_t* ptes = reinterpret_cast<page_t*>(state->l1_virt[l1idx].frame());
+    return ptes[pte_entry(va)].frame() + (va & ((1UL << page_t::width_4kib) - 1));
+}
+
+/**
+ * Add L2_GROW_TABLES tables to the pool from a stretch of the nailed stretch allocator, once it is available.
+ * Mapping that stretch may need L2 tables itself, they come from the L2_LOW_WATER reserve.
+ * Tables must start out empty, the frames come from the zeroed pool when it has enough of them.
+ */
+static void grow_l2_pool(mmu_v1::state_t* state)
+{
+    if (state->l2_growing || !state->stretch_allocator)
+        return;
+
+    state->l2_growing = true;
+
+    memory_v1::physmem_desc null_pmem; // Not used by the nailed allocator.
+    stretch_v1::closure_t* str = state->stretch_allocator->create_at(L2_GROW_TABLES * L2SIZE, stretch_v1::right_none, ANY_ADDRESS, memory_v1::attrs_zeroed, null_pmem);
+    if (str)
+    {
+        memory_v1::size size;
+        address_t va = str->info(&size);
+
+        for (size_t i = 0; i < size / L2SIZE; ++i, va += L2SIZE)
+        {
+            free_l2table(state, va, virt_to_phys(state, va));
+            ++state->l2_total;
+        }
+
+        logger::debug() << __FUNCTION__ << ": " << state->l2_total << " L2 tables, " << state->l2_n_free << " free";
+    }
+    else
+        logger::warning() << __FUNCTION__ << ": cannot allocate more L2 tables";
+
+    state->l2_growing = false;
+}
+
+/**
+ * Called before taking a table, so a pool chunk is never mapped halfway through updating an entry.
+ */
+inline void reserve_l2tables(mmu_v1::state_t* state)
+{
+    if (state->l2_n_free <= L2_LOW_WATER)
+        grow_l2_pool(state);
+}
+
+/**
+ * Return the L2 table of directory entry @a l1idx to the pool once its last entry is gone.
+ */
+static void release_l2table(mmu_v1::state_t* state, size_t l1idx)
+{
+    address_t l2va = state->l1_virt[l1idx].frame();
+    address_t l2pa = state->l1_mapping[l1idx].frame();
+
+    // The table may be reused elsewhere, the cpu must not keep walking it for this directory entry.
+    tlb_stale(state, l1idx << page_t::width_4mib, state->l1_mapping[l1idx], tlb_unmap);
+
+    memutils::clear_memory(SHADOW(l2va), N_L2_ENTRIES * sizeof(shadow_t));
+    state->l1_mapping[l1idx] = 0;
+    state->l1_virt[l1idx] = 0;
+
+    free_l2table(state, l2va, l2pa);
+}
+
+static const size_t L2_SPAN = 1UL << page_t::width_4mib; // Address space covered by one L2 table
+
+inline bool large_aligned(address_t addr)
+{
+    return (addr & (L2_SPAN - 1)) == 0;
+}
+
+/**
+ * Replace a 4MB page by an L2 table with 1024 4K pages mapping the same frames with the same sid and rights.
+ * Translations stay the same, so invalidating the old large page may wait until the next TLB sync.
+ * @return virtual address of the new L2 table, 0 on failure.
+ */
+static address_t split4m_page(mmu_v1::state_t* state, size_t l1idx)
+{
+    address_t l2va, l2pa;
+
+    if (!alloc_l2table(state, &l2va, &l2pa))
+        return 0;
+
+    page_t& pde = state->l1_mapping[l1idx];
+    shadow_t& l1_shadow = state->l1_shadows[l1idx];
+    page_t* ptes = reinterpret_cast<page_t*>(l2va);
+    page_t pte;
+
+    pte = 0;
+    pte.set_flags(l1_shadow.flags);
+
+    for (size_t i = 0; i < N_L2_ENTRIES; ++i)
+    {
+        pte.set_frame(pde.frame() + (i << page_t::width_4kib));
+        ptes[i] = pte;
+        SHADOW(l2va)[i].sid = l1_shadow.sid;
+        SHADOW(l2va)[i].flags = l1_shadow.flags;
+    }
+
+    tlb_stale(state, l1idx << page_t::width_4mib, pde, tlb_split);
+
+    pde = 0;
+    pde.set_frame(l2pa);
+    pde.set_flags(page_t::writable|page_t::write_through);
+    state->l1_virt[l1idx].set_frame(l2va);
+    state->l2_used[l1idx] = N_L2_ENTRIES;
+    l1_shadow.sid = SID_NULL;
+    l1_shadow.flags = 0;
+
+    logger::debug() << __FUNCTION__ << ": split 4MB page at " << (l1idx << page_t::width_4mib) << " for sid " << SHADOW(l2va)[0].sid;
+    return l2va;
+}
+
+/**
+ * Find the L2 table holding 4K pages at @a va for stretch @a sid, allocating it if the directory entry is empty.
+ * A 4MB page of the same stretch is split, 4MB pages of other stretches are left alone.
+ * @return virtual address of the L2 table, 0 on failure.
+ */
+static address_t l2_table_for(mmu_v1::state_t* state, address_t va, sid_t sid)
 {
-    int l1idx, l2idx;
-    address_t  l2va, l2pa;
+    reserve_l2tables(state);
 
-    l1idx  = pde_entry(va);
+    size_t l1idx = pde_entry(va);
+    page_t& pde = state->l1_mapping[l1idx];
 
-    if (!state->l1_mapping[l1idx].is_present())
+    // Non-present 4MB pages still occupy the whole directory entry.
+    if (pde.is_4mb())
     {
-        logger::debug() << "mapping va=" << va << " requires new L2 table";
-        if (!alloc_l2table(state, &l2va, &l2pa)) {
-            logger::warning() << "!!! intel_mmu:add4k_page - cannot alloc l2 table.";
-            return false;
+        if (state->l1_shadows[l1idx].sid != sid)
+        {
+            logger::warning() << __FUNCTION__ << ": va=" << va << " is covered by a 4MB page of sid " << state->l1_shadows[l1idx].sid;
+            return 0;
         }
-        state->l1_mapping[l1idx].set_frame(l2pa);
-        state->l1_mapping[l1idx].set_flags(page_t::writable|page_t::write_through);
+        return split4m_page(state, l1idx);
+    }
+
+    if (!pde.is_present())
+    {
+        address_t l2va, l2pa;
+
+        if (!alloc_l2table(state, &l2va, &l2pa))
+            return 0;
+
+        pde = 0;
+        pde.set_frame(l2pa);
+        pde.set_flags(page_t::writable|page_t::write_through);
         state->l1_virt[l1idx].set_frame(l2va);
+        state->l2_used[l1idx] = 0;
+        return l2va;
     }
 
+    return state->l1_virt[l1idx].frame();
+}
+
+static bool add4k_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t sid)
+{
+    size_t l1idx = pde_entry(va);
+
+    // Non-present 4MB pages still occupy the whole directory entry.
     if (state->l1_mapping[l1idx].is_4mb())
     {
         logger::warning() << "URK! mapping va=" << va << " would use a 4MB page!";
         return false;
     }
 
-    l2pa = state->l1_mapping[l1idx].frame();
-    l2va = state->l2_virt + (l2pa - state->l2_phys);
-    // XXX PARANOIA
-    if (l2va != state->l1_virt[l1idx].frame())
-        logger::warning() << "Virtual addresses out of sync: l2va=" << l2va << ", not " << state->l1_virt[l1idx].frame();
+    address_t l2va = l2_table_for(state, va, sid);
+    if (!l2va)
+    {
+        logger::warning() << "!!! intel_mmu:add4k_page - cannot alloc l2 table.";
+        return false;
+    }
 
     // Ok, once here, we have a pointer to our l2 table in "l2va"
-    l2idx = pte_entry(va);
+    size_t l2idx = pte_entry(va);
+    page_t& entry = reinterpret_cast<page_t*>(l2va)[l2idx];
+
+    if (entry == 0)
+        ++state->l2_used[l1idx];
 
     // Set pte into real ptab
-    reinterpret_cast<page_t*>(l2va)[l2idx] = pte;
+    entry = pte;
 
     // Setup shadow pte (holds sid + original global rights)
     SHADOW(l2va)[l2idx].sid = sid;  // store sid in shadow
@@ -178,115 +446,267 @@ static bool add4k_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t s
     return true;
 }
 
-/*
-** update4k_pages is used to modify the information in the
-** page table about a particular contiguous range of pages.
-** It returns the number of pages (from 1 upto npages)
-** successfully updated, or zero on failure.
-*/
-static size_t update4k_pages(mmu_v1::state_t* state, address_t va, size_t n_pages, page_t pte, sid_t sid)
+/**
+ * Map a 4MB page directly in the page directory, no L2 table is needed.
+ * The L1 shadow keeps the sid and original rights, like L2 shadows do for 4K pages.
+ */
+static bool add4m_page(mmu_v1::state_t* state, address_t va, page_t pde, sid_t sid)
 {
-    int l1idx, l2idx;
-    address_t  l2va, l2pa;
-
-    l1idx  = pde_entry(va);
-
-    if (!state->l1_mapping[l1idx].is_present())
-    {
-        logger::warning() << __FUNCTION__ << ": page at " << va << " not present, cannot update";
-        return 0;
-    }
+    int l1idx = pde_entry(va);
 
-    if (state->l1_mapping[l1idx].is_4mb())
+    if (state->l1_mapping[l1idx].is_present() && !state->l1_mapping[l1idx].is_4mb())
     {
-        logger::warning() << __FUNCTION__ << ": address " << va << " is mapped using a 4MB page!";
-        return 0;
+        logger::warning() << __FUNCTION__ << ": va=" << va << " is already covered by an L2 table!";
+        return false;
     }
 
-    l2pa = state->l1_mapping[l1idx].frame();
-    l2va = state->l2_virt + (l2pa - state->l2_phys);
+    tlb_stale(state, va, state->l1_mapping[l1idx], tlb_remap);
 
-    // XXX PARANOIA
-    if (l2va != state->l1_virt[l1idx].frame())
-        logger::warning() << "virtual addresses out of sync: l2va=" << l2va << ", not " << state->l1_virt[l1idx].frame();
+    flags_t flags = pde.flags();
+    pde.set_4mb(true);
+    state->l1_mapping[l1idx] = pde;
 
-    // Ok, once here, we have a pointer to our l2 table in "l2va"
-    l2idx = pte_entry(va);
+    state->l1_shadows[l1idx].sid = sid;
+    state->l1_shadows[l1idx].flags = flags;
+    return true;
+}
 
-    // Update only flags and sid.
-    flags_t flags = pte.flags();
+/*
+** update4m_pages changes flags and sid of consecutive 4MB pages,
+** keeping their frames. Returns the number of pages updated.
+*/
+static size_t update4m_pages(mmu_v1::state_t* state, address_t va, size_t n_pages, page_t pde, sid_t sid)
+{
+    flags_t flags = pde.flags();
+    size_t l1idx = pde_entry(va);
     size_t i;
 
-    for (i = 0; (i < n_pages) && ((i + l2idx) < N_L2_ENTRIES); ++i)
+    for (i = 0; (i < n_pages) && ((l1idx + i) < N_L1_TABLES); ++i)
     {
-        reinterpret_cast<page_t*>(l2va)[l2idx + i].set_flags(flags);
+        page_t& entry = state->l1_mapping[l1idx + i];
+        if (!entry.is_4mb())
+        {
+            logger::warning() << __FUNCTION__ << ": address " << va + (i << page_t::width_4mib) << " is not mapped using a 4MB page!";
+            break;
+        }
+
+        page_t old = entry;
+        entry.set_flags(flags);
+        entry.set_4mb(true); // set_flags() drops the page size bit
+        if (entry.flags() != old.flags())
+            tlb_stale(state, va + (i << page_t::width_4mib), old, tlb_protect);
 
-        // Setup shadow pte (holds sid + original global rights)
-        SHADOW(l2va)[l2idx + i].sid = sid;  // store sid in shadow
-        SHADOW(l2va)[l2idx + i].flags = flags; //??
+        state->l1_shadows[l1idx + i].sid = sid;
+        state->l1_shadows[l1idx + i].flags = flags;
     }
 
     return i;
 }
 
 /**
- * Add a page mapping.
- * va describes the corresponding virtual address.
- * pte contains appropriate physical address (if any) and flags.
- * FIXME: page_width is redundant and should be derived from pte!
+ * Enter @a n_pages pages of @a page_width bits at @a virt for stretch @a sid, a page directory entry at a time.
+ * If @a mapped, pages map the frames at @a phys linearly, otherwise they get no frame.
+ *
+ * 4K pages are written into each L2 table in one pass. With @a promote, every whole 4MB of a mapped range whose
+ * virtual and physical addresses are both 4MB aligned gets a single 4MB page instead of an L2 table.
+ *
+ * Present entries replaced (when sharing copy-on-write over a mapped range) are noted stale, caller syncs the TLB.
+ * @return false if an L2 table is not available or a 4MB page is in the way.
  */
-static bool add_page(mmu_v1::state_t* state, size_t page_width, address_t va, page_t pte, sid_t sid)
+static bool enter_pages(mmu_v1::state_t* state, sid_t sid, address_t virt, address_t phys, bool mapped, size_t n_pages, size_t page_width, flags_t flags, bool promote)
 {
-    bool result = false;
-    switch (page_width)
+    page_t pte;
+    pte = 0;
+    pte.set_flags(flags);
+
+    if (page_width == page_t::width_4mib)
     {
-        case page_t::width_4kib:
-            result = add4k_page(state, va, pte, sid);
-            break;
-        case page_t::width_4mib:
-            // result = add4m_page(state, va, pte, sid);
-            break;
-        default:
-            logger::warning() << __FUNCTION__ << ": unsupported page width " << page_width;
+        for (; n_pages > 0; --n_pages, virt += L2_SPAN, phys += L2_SPAN)
+        {
+            pte.set_frame(mapped ? phys : 0);
+            if (!add4m_page(state, virt, pte, sid))
+                return false;
+        }
+        return true;
     }
-    return result;
+
+    promote = promote && mapped && state->use_large_pages;
+
+    while (n_pages > 0)
+    {
+        size_t l1idx = pde_entry(virt);
+        size_t count;
+
+        if (promote && large_aligned(virt) && large_aligned(phys) && (n_pages >= N_L2_ENTRIES)
+            && (state->l1_mapping[l1idx] == 0))
+        {
+            pte.set_frame(phys);
+            if (!add4m_page(state, virt, pte, sid))
+                return false;
+            count = N_L2_ENTRIES;
+        }
+        else
+        {
+            address_t l2va = l2_table_for(state, virt, sid);
+            if (!l2va)
+                return false;
+
+            size_t l2idx = pte_entry(virt);
+            count = std::min(n_pages, N_L2_ENTRIES - l2idx);
+
+            page_t* ptes = reinterpret_cast<page_t*>(l2va) + l2idx;
+            shadow_t* shadows = SHADOW(l2va) + l2idx;
+
+            size_t added = 0;
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (ptes[i] == 0)
+                    ++added;
+                tlb_stale(state, virt + (i << page_t::width_4kib), ptes[i], tlb_remap);
+                pte.set_frame(mapped ? phys + (i << page_t::width_4kib) : 0);
+                ptes[i] = pte;
+                shadows[i].sid = sid;
+                shadows[i].flags = flags;
+            }
+
+            state->l2_used[l1idx] += added;
+        }
+
+        virt += count << page_t::width_4kib;
+        phys += count << page_t::width_4kib;
+        n_pages -= count;
+    }
+
+    return true;
 }
 
-static size_t update_pages(mmu_v1::state_t* state, size_t page_width, address_t va, size_t n_pages, page_t pte, sid_t sid)
+/**
+ * Change flags and sid of @a n_pages present pages of @a page_width bits at @a virt, keeping their frames.
+ * A range of 4K pages updates 4MB pages it covers completely in place and splits those it covers partially.
+ * Entries which changed are noted stale, caller syncs the TLB once afterwards.
+ * @return false if some page in the range is not present.
+ */
+static bool update_entries(mmu_v1::state_t* state, sid_t sid, address_t virt, size_t n_pages, size_t page_width, flags_t flags)
 {
-    size_t result = 0;
-    switch (page_width)
+    page_t pde;
+    pde = 0;
+    pde.set_flags(flags);
+
+    if (page_width == page_t::width_4mib)
+        return update4m_pages(state, virt, n_pages, pde, sid) == n_pages;
+
+    while (n_pages > 0)
     {
-        case page_t::width_4kib:
-            result = update4k_pages(state, va, n_pages, pte, sid);
-            break;
-        case page_t::width_4mib:
-            // result = update4m_pages(state, va, n_pages, pte, sid);
-            break;
-        default:
-            logger::warning() << __FUNCTION__ << ": unsupported page width " << page_width;
+        size_t l1idx = pde_entry(virt);
+        page_t& entry = state->l1_mapping[l1idx];
+        size_t count;
+
+        if (entry.is_4mb() && large_aligned(virt) && (n_pages >= N_L2_ENTRIES))
+        {
+            if (update4m_pages(state, virt, 1, pde, sid) != 1)
+                return false;
+            count = N_L2_ENTRIES;
+        }
+        else
+        {
+            if (!entry.is_present() && !entry.is_4mb())
+            {
+                logger::warning() << __FUNCTION__ << ": page at " << virt << " not present, cannot update";
+                return false;
+            }
+
+            if (entry.is_4mb())
+                reserve_l2tables(state);
+
+            address_t l2va = entry.is_4mb() ? split4m_page(state, l1idx) : state->l1_virt[l1idx].frame();
+            if (!l2va)
+                return false;
+
+            size_t l2idx = pte_entry(virt);
+            count = std::min(n_pages, N_L2_ENTRIES - l2idx);
+
+            page_t* ptes = reinterpret_cast<page_t*>(l2va) + l2idx;
+            shadow_t* shadows = SHADOW(l2va) + l2idx;
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                page_t old = ptes[i];
+                ptes[i].set_flags(flags);
+                if (ptes[i].flags() != old.flags())
+                    tlb_stale(state, virt + (i << page_t::width_4kib), old, tlb_protect);
+                shadows[i].sid = sid;
+                shadows[i].flags = flags;
+            }
+        }
+
+        virt += count << page_t::width_4kib;
+        n_pages -= count;
     }
-    return result;
+
+    return true;
 }
 
-inline uint16_t alloc_pdidx(mmu_v1::state_t* state)
+inline pdom_st* pdom_slot(mmu_v1::state_t* state, uint32_t idx)
 {
-    uint32_t i = state->next_pdidx;
-    logger::trace() << __FUNCTION__ << ": next_pdidx " << i;
-    do {
-        if (state->pdom_tbl[i] == NULL)
+    return &state->pdom_tbl[idx / PDOM_CHUNK][idx % PDOM_CHUNK];
+}
+
+/**
+ * Take a slot off the free list, adding a chunk of slots when it is empty.
+ */
+static uint32_t alloc_pdidx(mmu_v1::state_t* state)
+{
+    if (state->pdom_free == PDIDX_NONE)
+    {
+        uint32_t chunk = state->pdom_n_chunks;
+        pdom_st* slots = NULL;
+
+        if (chunk < PDIDX_MAX / PDOM_CHUNK)
+            slots = reinterpret_cast<pdom_st*>(state->heap->allocate(PDOM_CHUNK * sizeof(pdom_st)));
+
+        if (!slots)
         {
-            state->next_pdidx = (i + 1) % PDIDX_MAX;
-            logger::trace() << __FUNCTION__ << ": allocate next_pdidx " << i;
-            return i;
+            logger::warning() << __FUNCTION__ << ": out of identifiers!" << endl;
+            nucleus::debug_stop();
+            return PDIDX_NONE;
+        }
+
+        // Push in reverse so lower indices are handed out first.
+        for (size_t i = PDOM_CHUNK; i > 0; --i)
+        {
+            slots[i - 1].pdom = NULL;
+            slots[i - 1].refcnt = 0;
+            slots[i - 1].gen = 0;
+            slots[i - 1].next_free = state->pdom_free;
+            state->pdom_free = chunk * PDOM_CHUNK + i - 1;
         }
-        i = (i + 1) % PDIDX_MAX;
-        logger::trace() << __FUNCTION__ << ": next_pdidx " << i;
-    } while(i != state->next_pdidx);
 
-    logger::warning() << __FUNCTION__ << ": out of identifiers!" << endl;
-    nucleus::debug_stop();
-    return 0xdead;
+        state->pdom_tbl[chunk] = slots;
+        state->pdom_n_chunks++;
+        logger::trace() << __FUNCTION__ << ": added pdom slots " << chunk * PDOM_CHUNK << ".." << (chunk + 1) * PDOM_CHUNK;
+    }
+
+    uint32_t idx = state->pdom_free;
+    state->pdom_free = pdom_slot(state, idx)->next_free;
+    return idx;
+}
+
+/**
+ * Find the slot of a live pdom, the generation in @a dom_id must be current.
+ */
+static pdom_st* find_pdom(mmu_v1::state_t* state, protection_domain_v1::id dom_id)
+{
+    uint32_t idx = PDIDX(dom_id);
+
+    if (idx / PDOM_CHUNK >= state->pdom_n_chunks)
+        return NULL;
+
+    pdom_st* slot = pdom_slot(state, idx);
+    if (!slot->pdom || (slot->gen != (dom_id >> 16)))
+        return NULL;
+
+    return slot;
 }
 
 static flags_t control_bits(mmu_v1::state_t* state, stretch_v1::rights rights, memory_v1::attr_flags attr, bool valid)
@@ -326,9 +746,9 @@ static flags_t control_bits(mmu_v1::state_t* state, stretch_v1::rights rights, m
     return flags;
 }
 
-inline bool valid_width(uint32_t width)
+inline bool valid_width(mmu_v1::state_t* state, uint32_t width)
 {
-    return width == page_t::width_4kib || width == page_t::width_4mib;
+    return width == page_t::width_4kib || (width == page_t::width_4mib && state->use_large_pages);
 }
 
 //======================================================================================================================
@@ -343,50 +763,44 @@ static void mmu_v1_start(mmu_v1::closure_t* self, protection_domain_v1::id root_
 
 static void mmu_v1_add_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, stretch_v1::rights global_rights)
 {
-    page_t pte;
     flags_t flags = control_bits(self->d_state, global_rights, 0, /*valid:*/false);
-    pte.set_flags(flags);
-
     size_t page_width = mem_range.page_width;
 
-    if (!valid_width(page_width))
+    if (!valid_width(self->d_state, page_width))
     {
         logger::warning() << __FUNCTION__ << ": unsupported page width " << page_width;
         return;
     }
 
-    address_t virt = mem_range.start_addr;
-    size_t page_size = 1UL << page_width;
-
-    for (size_t n_pages = 0; n_pages < mem_range.n_pages; ++n_pages)
+    if (!enter_pages(self->d_state, str->d_state->sid, mem_range.start_addr, 0, /*mapped:*/false, mem_range.n_pages, page_width, flags, /*promote:*/false))
     {
-        if (!add_page(self->d_state, page_width, virt, pte, str->d_state->sid))
-        {
-            logger::warning() << __FUNCTION__ << ": failed to add page at " << virt;
-            return;
-        }
-        virt += page_size;
+        logger::warning() << __FUNCTION__ << ": failed to add range at " << mem_range.start_addr;
+        return;
     }
 
     logger::debug() << __FUNCTION__ << ": added range [" << mem_range.start_addr << ".." << mem_range.start_addr + (mem_range.n_pages << page_width) << "), sid=" << str->d_state->sid;
 }
 
-static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, memory_v1::physmem_desc pmem, stretch_v1::rights global_rights)
+/**
+ * Work out the common page width of a virtual and a physical range and check they are the same size.
+ * @return false if either width is not supported or sizes differ.
+ */
+static bool homogenise_widths(mmu_v1::state_t* state, const memory_v1::virtmem_desc& mem_range, const memory_v1::physmem_desc& pmem, size_t* width, size_t* count)
 {
     size_t page_width = mem_range.page_width;
 
-    if (!valid_width(page_width))
+    if (!valid_width(state, page_width))
     {
         logger::warning() << __FUNCTION__ << ": unsupported page width " << page_width;
-        return;
+        return false;
     }
 
     size_t frame_width = pmem.frame_width;
 
-    if (!valid_width(frame_width))
+    if (!valid_width(state, frame_width))
     {
         logger::warning() << __FUNCTION__ << ": unsupported frame width " << frame_width;
-        return;
+        return false;
     }
 
     // If page width differs from frame width, need to homogenise.
@@ -416,60 +830,182 @@ static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure
     {
         logger::warning() << __FUNCTION__ << ": number of pages " << n_pages << " and frames " << n_frames << " do not match!";
         nucleus::debug_stop();
-        return;
+        return false;
     }
 
-    address_t phys = pmem.start_addr;
-    address_t virt = mem_range.start_addr;
-    flags_t flags = control_bits(self->d_state, global_rights, pmem.attr, /*valid:*/true);
+    *width = page_width;
+    *count = n_pages;
+    return true;
+}
 
-    size_t page_size = 1UL << page_width;
-    page_t pte;
-    pte.set_flags(flags);
+/**
+ * Check that the frames at @a phys belong to someone and are not nailed, then mark them mapped in the ramtab.
+ */
+static void mark_mapped(mmu_v1::state_t* state, address_t phys, size_t size)
+{
+    size_t frame = phys >> FRAME_WIDTH;
+    size_t end = std::min(frame + (size >> FRAME_WIDTH), state->ramtab_size);
 
-    while (n_pages--)
+    for (; frame < end; ++frame)
     {
-        size_t frame = phys >> FRAME_WIDTH;
-        pte.set_frame(phys);
+        ramtab_entry_t& entry = state->ramtab[frame];
 
-        uint32_t owner = OWNER_NONE;
+        if (entry.owner == OWNER_NONE)
+        {
+            logger::warning() << __FUNCTION__ << ": physical address " << (frame << FRAME_WIDTH) << " not owned!";
+            nucleus::debug_stop();
+        }
 
-        // Sanity check the ramtab
-        if (frame < self->d_state->ramtab_size)
+        if (entry.state == ramtab_v1::state_nailed)
         {
-            ramtab_v1::state state;
+            logger::warning() << __FUNCTION__ << ": physical address " << (frame << FRAME_WIDTH) << " is nailed!";
+            nucleus::debug_stop();
+        }
 
-            owner = self->d_state->ramtab_closure.get(frame, &frame_width, &state);
-            if (owner == OWNER_NONE)
-            {
-                logger::warning() << __FUNCTION__ << ": physical address " << phys << " not owned!";
-                nucleus::debug_stop();
-            }
+        entry.state = ramtab_v1::state_mapped;
+    }
+}
 
-            if (state == ramtab_v1::state_nailed)
-            {
-                logger::warning() << __FUNCTION__ << ": physical address " << phys << " is nailed!";
-                nucleus::debug_stop();
-            }
-        }
+/**
+ * Map @a n_pages pages of @a page_width bits at @a virt linearly onto the frames at @a phys for stretch @a sid,
+ * marking the frames mapped in the ramtab. See enter_pages() for @a promote.
+ */
+static bool map_pages(mmu_v1::state_t* state, sid_t sid, address_t virt, address_t phys, size_t n_pages, size_t page_width, flags_t flags, bool promote)
+{
+    if (!enter_pages(state, sid, virt, phys, /*mapped:*/true, n_pages, page_width, flags, promote))
+    {
+        logger::warning() << __FUNCTION__ << ": failed to map pages at " << virt;
+        return false;
+    }
+
+    mark_mapped(state, phys, n_pages << page_width);
+    return true;
+}
+
+static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, memory_v1::physmem_desc pmem, stretch_v1::rights global_rights)
+{
+    size_t page_width, n_pages;
+
+    if (!homogenise_widths(self->d_state, mem_range, pmem, &page_width, &n_pages))
+        return;
+
+    flags_t flags = control_bits(self->d_state, global_rights, pmem.attr, /*valid:*/true);
+
+    if (!map_pages(self->d_state, str->d_state->sid, mem_range.start_addr, pmem.start_addr, n_pages, page_width, flags, /*promote:*/true))
+        return;
+
+    logger::debug() << __FUNCTION__ << ": added mapped range [" << mem_range.start_addr << ".." << mem_range.start_addr + (mem_range.n_pages << mem_range.page_width) << ")=>[" << pmem.start_addr << ".." << pmem.start_addr + (pmem.n_frames << pmem.frame_width) << "), sid=" << str->d_state->sid;
+}
+
+/**
+ * Stretches of a batch must tile the range exactly, each one gets its own sid in the shadows.
+ * New entries were not present before, so no TLB flush is needed.
+ */
+static void mmu_v1_add_mapped_ranges(mmu_v1::closure_t* self, mmu_v1::stretch_seq strs, memory_v1::virtmem_desc mem_range, memory_v1::physmem_desc pmem, stretch_v1::rights global_rights)
+{
+    size_t page_width, n_pages;
+
+    if (!homogenise_widths(self->d_state, mem_range, pmem, &page_width, &n_pages))
+        return;
 
-        if (!add_page(self->d_state, page_width, virt, pte, str->d_state->sid))
+    flags_t flags = control_bits(self->d_state, global_rights, pmem.attr, /*valid:*/true);
+    address_t virt = mem_range.start_addr;
+    address_t phys = pmem.start_addr;
+
+    for (auto str : strs)
+    {
+        stretch_v1::state_t* s = str->d_state;
+        size_t count = s->size >> page_width;
+
+        if ((s->base != virt) || ((count << page_width) != s->size) || (count > n_pages))
         {
-            logger::warning() << __FUNCTION__ << ": failed to add page at " << virt;
+            logger::warning() << __FUNCTION__ << ": stretch [" << s->base << ".." << s->base + s->size << ") does not fit at " << virt;
+            nucleus::debug_stop();
             return;
         }
 
-        // Update the ramtab
-        if (frame < self->d_state->ramtab_size)
-        {
-            self->d_state->ramtab_closure.put(frame, owner, frame_width, ramtab_v1::state_mapped);
-        }
+        if (!map_pages(self->d_state, s->sid, virt, phys, count, page_width, flags, /*promote:*/true))
+            return;
 
-        virt += page_size;
-        phys += page_size;
+        virt += s->size;
+        phys += s->size;
+        n_pages -= count;
     }
 
-    logger::debug() << __FUNCTION__ << ": added mapped range [" << mem_range.start_addr << ".." << mem_range.start_addr + (mem_range.n_pages << mem_range.page_width) << ")=>[" << pmem.start_addr << ".." << pmem.start_addr + (pmem.n_frames << pmem.frame_width) << "), sid=" << str->d_state->sid;
+    logger::debug() << __FUNCTION__ << ": added " << strs.size() << " mapped ranges [" << mem_range.start_addr << ".." << virt << ")=>[" << pmem.start_addr << ".." << phys << ")";
+}
+
+/**
+ * Copy-on-write pages are 4K only, a 4MB page cannot be copied one 4K page at a time.
+ * 4MB pages the stretch already has in the range are split.
+ */
+static void mmu_v1_add_cow_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, memory_v1::physmem_desc pmem, stretch_v1::rights global_rights)
+{
+    size_t page_width, n_pages;
+
+    if (!homogenise_widths(self->d_state, mem_range, pmem, &page_width, &n_pages))
+        return;
+
+    if (page_width != page_t::width_4kib)
+    {
+        logger::warning() << __FUNCTION__ << ": cannot share pages of width " << page_width << " copy-on-write";
+        nucleus::debug_stop();
+        return;
+    }
+
+    flags_t flags = control_bits(self->d_state, global_rights, pmem.attr, /*valid:*/true);
+    flags = (flags & ~page_t::writable) | page_t::copy_on_write;
+
+    bool mapped = map_pages(self->d_state, str->d_state->sid, mem_range.start_addr, pmem.start_addr, n_pages, page_width, flags, /*promote:*/false);
+
+    // Pages may have been writable before.
+    tlb_sync(self->d_state);
+
+    if (!mapped)
+        return;
+
+    logger::debug() << __FUNCTION__ << ": shared range [" << mem_range.start_addr << ".." << mem_range.start_addr + (n_pages << page_width) << ")=>[" << pmem.start_addr << ".." << pmem.start_addr + (n_pages << page_width) << "), sid=" << str->d_state->sid;
+}
+
+static void mmu_v1_remap_page(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::address virt, memory_v1::address phys, stretch_v1::rights global_rights)
+{
+    auto state = self->d_state;
+    page_t& pde = state->l1_mapping[pde_entry(virt)];
+
+    if (!pde.is_present() && !pde.is_4mb())
+    {
+        logger::warning() << __FUNCTION__ << ": page at " << virt << " is not mapped";
+        nucleus::debug_stop();
+        return;
+    }
+
+    address_t l2va = l2_table_for(state, virt, str->d_state->sid);
+    size_t l2idx = pte_entry(virt);
+
+    if (!l2va || (SHADOW(l2va)[l2idx].sid != str->d_state->sid))
+    {
+        logger::warning() << __FUNCTION__ << ": page at " << virt << " does not belong to sid " << str->d_state->sid;
+        nucleus::debug_stop();
+        return;
+    }
+
+    flags_t flags = control_bits(state, global_rights, 0, /*valid:*/true);
+    page_t& pte = reinterpret_cast<page_t*>(l2va)[l2idx];
+    tlb_stale(state, virt, pte, tlb_remap);
+    pte.set_flags(flags);
+    pte.set_frame(phys);
+    SHADOW(l2va)[l2idx].flags = flags;
+
+    size_t frame = phys >> FRAME_WIDTH;
+    if (frame < state->ramtab_size)
+    {
+        uint32_t frame_width;
+        ramtab_v1::state rstate;
+        uint32_t owner = state->ramtab_closure.get(frame, &frame_width, &rstate);
+        state->ramtab_closure.put(frame, owner, frame_width, ramtab_v1::state_mapped);
+    }
+
+    tlb_sync(state);
 }
 
 /**
@@ -477,124 +1013,200 @@ static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure
  */
 static void mmu_v1_update_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, stretch_v1::rights global_rights)
 {
-    page_t pte;
     flags_t flags = control_bits(self->d_state, global_rights, 0, /*valid:*/true);
-    pte.set_flags(flags);
-
     size_t page_width = mem_range.page_width;
 
-    if (!valid_width(page_width))
+    if (!valid_width(self->d_state, page_width))
     {
         logger::warning() << __FUNCTION__ << ": unsupported page width " << page_width;
         return;
     }
 
-    size_t page_size = 1UL << page_width;
-    address_t virt = mem_range.start_addr;
-    size_t n_pages = mem_range.n_pages;
+    if (!update_entries(self->d_state, str->d_state->sid, mem_range.start_addr, mem_range.n_pages, page_width, flags))
+    {
+        logger::warning() << __FUNCTION__ << ": failed to update range at " << mem_range.start_addr;
+        nucleus::debug_stop();
+    }
 
-    while (n_pages > 0)
+    // Rights may have been taken away, and a stale entry with fewer rights would fault.
+    tlb_sync(self->d_state);
+
+    logger::debug() << __FUNCTION__ << ": updated range [" << mem_range.start_addr << ".." << mem_range.start_addr + (mem_range.n_pages << page_width) << "), sid=" << str->d_state->sid;
+}
+
+/**
+ * Mapped frames go back to unused in the ramtab, so their owner may free them.
+ */
+static void unmap_frames(mmu_v1::state_t* state, address_t phys, size_t size)
+{
+    size_t frame = phys >> FRAME_WIDTH;
+    for (size_t i = 0; (i < (size >> FRAME_WIDTH)) && (frame + i < state->ramtab_size); ++i)
     {
-        size_t updated = update_pages(self->d_state, page_width, virt, n_pages, pte, str->d_state->sid);
-        if (updated == 0)
+        ramtab_entry_t& entry = state->ramtab[frame + i];
+        if (entry.state == ramtab_v1::state_mapped)
+            entry.state = ramtab_v1::state_unused;
+    }
+}
+
+/**
+ * Remove the mapping of a single 4MB page, or of 4K pages up to @a size bytes or the end of their L2 table.
+ * @return number of bytes of address space unmapped.
+ */
+static size_t free_pages(mmu_v1::state_t* state, address_t va, size_t size)
+{
+    size_t l1idx = pde_entry(va);
+    page_t& pde = state->l1_mapping[l1idx];
+
+    if (pde.is_4mb())
+    {
+        if (pde.is_present())
+            unmap_frames(state, pde.frame(), 1UL << page_t::width_4mib);
+        tlb_stale(state, va, pde, tlb_unmap);
+        pde = 0;
+        state->l1_shadows[l1idx].sid = SID_NULL;
+        state->l1_shadows[l1idx].flags = 0;
+        return (1UL << page_t::width_4mib) - (va & ((1UL << page_t::width_4mib) - 1));
+    }
+
+    size_t l2idx = pte_entry(va);
+    size_t n_pages = std::min(N_L2_ENTRIES - l2idx, (size + (1UL << page_t::width_4kib) - 1) >> page_t::width_4kib);
+
+    if (pde.is_present())
+    {
+        address_t l2va = state->l1_virt[l1idx].frame();
+        page_t* ptes = reinterpret_cast<page_t*>(l2va);
+
+        for (size_t i = l2idx; i < l2idx + n_pages; ++i)
         {
-            logger::warning() << __FUNCTION__ << ": failed to update pages at " << virt;
-            nucleus::debug_stop();
-            return;
+            if (ptes[i] == 0)
+                continue;
+            // Copy-on-write frames stay mapped by other stretches, the stretch allocator releases them.
+            if (ptes[i].is_present() && !(ptes[i].flags() & page_t::copy_on_write))
+                unmap_frames(state, ptes[i].frame(), 1UL << page_t::width_4kib);
+            tlb_stale(state, (va & ~(L2_SPAN - 1)) + (i << page_t::width_4kib), ptes[i], tlb_unmap);
+            ptes[i] = 0;
+            SHADOW(l2va)[i].sid = SID_NULL;
+            SHADOW(l2va)[i].flags = 0;
+            --state->l2_used[l1idx];
         }
-        virt += updated * page_size;
-        n_pages -= updated;
+
+        if (state->l2_used[l1idx] == 0)
+            release_l2table(state, l1idx);
     }
 
-    logger::debug() << __FUNCTION__ << ": updated range [" << mem_range.start_addr << ".." << mem_range.start_addr + (mem_range.n_pages << page_width) << "), sid=" << str->d_state->sid;
+    return n_pages << page_t::width_4kib;
 }
 
 static void mmu_v1_free_range(mmu_v1::closure_t* self, memory_v1::virtmem_desc mem_range)
 {
+    address_t va = mem_range.start_addr;
+    size_t size = mem_range.n_pages << mem_range.page_width;
+
+    while (size > 0)
+    {
+        size_t freed = std::min(free_pages(self->d_state, va, size), size);
+        va += freed;
+        size -= freed;
+    }
 
+    // Caller frees the frames next, no stale translation may outlive this call.
+    tlb_sync(self->d_state);
+
+    logger::debug() << __FUNCTION__ << ": freed range [" << mem_range.start_addr << ".." << va << ")";
 }
 
 static protection_domain_v1::id mmu_v1_create_domain(mmu_v1::closure_t* self)
 {
     auto state = self->d_state;
 
-    uint16_t idx = alloc_pdidx(state);
-
-    state->pdominfo[idx].refcnt = 0;
-    state->pdominfo[idx].stretch = state->stretch_allocator->create(sizeof(pdom_t), stretch_v1::right_none);
-    state->pdominfo[idx].gen++;
+    uint32_t idx = alloc_pdidx(state);
+    if (idx == PDIDX_NONE)
+        return 0; // Not a valid pdid, generations start at 1.
 
-    memory_v1::size sz;
-    pdom_t* base = reinterpret_cast<pdom_t*>(state->pdominfo[idx].stretch->info(&sz));
-    memutils::clear_memory(base, sz);
+    pdom_st* slot = pdom_slot(state, idx);
+    pdom_t* pdom = reinterpret_cast<pdom_t*>(state->pdom_cache->allocate());
+    if (!pdom)
+    {
+        logger::warning() << __FUNCTION__ << ": out of memory for pdom " << idx;
+        slot->next_free = state->pdom_free;
+        state->pdom_free = idx;
+        nucleus::debug_stop();
+        return 0;
+    }
 
-    state->pdom_tbl[idx] = base;
+    pdom->init();
+    slot->pdom = pdom;
+    slot->refcnt = 0;
+    if (++slot->gen == 0)
+        slot->gen = 1;
 
     // Construct the pdid from the generation and the index.
-    protection_domain_v1::id pdid = (uint32_t(state->pdominfo[idx].gen) << 16) | idx;
+    protection_domain_v1::id pdid = (uint32_t(slot->gen) << 16) | idx;
     logger::debug() << __FUNCTION__ << ": generated new pdid " << pdid;
     return pdid;
 }
 
 static void mmu_v1_retain_domain(mmu_v1::closure_t* self, protection_domain_v1::id dom_id)
 {
-    auto state = self->d_state;
-    uint16_t idx = PDIDX(dom_id);
+    pdom_st* slot = find_pdom(self->d_state, dom_id);
 
-    if ((idx >= PDIDX_MAX) || (state->pdom_tbl[idx] == NULL))
+    if (!slot)
     {
         logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id;
         nucleus::debug_stop();
         return;
     }
 
-    state->pdominfo[idx].refcnt++;
+    slot->refcnt++;
 }
 
 static void mmu_v1_release_domain(mmu_v1::closure_t* self, protection_domain_v1::id dom_id)
 {
     auto state = self->d_state;
-    uint16_t idx = PDIDX(dom_id);
+    pdom_st* slot = find_pdom(state, dom_id);
 
-    if ((idx >= PDIDX_MAX) || (state->pdom_tbl[idx] == NULL))
+    if (!slot)
     {
         logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id;
         nucleus::debug_stop();
         return;
     }
 
-    if (state->pdominfo[idx].refcnt)
-        state->pdominfo[idx].refcnt--;
+    if (slot->refcnt)
+        slot->refcnt--;
 
-    if (state->pdominfo[idx].refcnt == 0)
+    if (slot->refcnt == 0)
     {
-        state->stretch_allocator->destroy_stretch(state->pdominfo[idx].stretch);
-        state->pdom_tbl[idx] = NULL;
+        slot->pdom->clear(state->pdom_leaves);
+        state->pdom_cache->free(reinterpret_cast<memory_v1::address>(slot->pdom));
+        slot->pdom = NULL;
+        slot->next_free = state->pdom_free;
+        state->pdom_free = PDIDX(dom_id);
     }
 }
 
 static void mmu_v1_set_rights(mmu_v1::closure_t* self, protection_domain_v1::id dom_id, stretch_v1::closure_t* str, stretch_v1::rights rights)
 {
     auto state = self->d_state;
-    uint16_t idx = PDIDX(dom_id);
+    pdom_st* slot = find_pdom(state, dom_id);
 
-    if ((idx >= PDIDX_MAX) || (state->pdom_tbl[idx] == NULL))
+    if (!slot)
     {
         logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id;
         nucleus::debug_stop();
         return;
     }
 
-    pdom_t* pdom = state->pdom_tbl[idx];
+    pdom_t* pdom = slot->pdom;
     sid_t sid = str->d_state->sid;
 
-    logger::warning() << __FUNCTION__ << ": pdom " << pdom << ", sid " << sid << " " << rights;
+    logger::trace() << __FUNCTION__ << ": pdom " << pdom << ", sid " << sid << " " << rights;
 
-    uint8_t mask = sid & 1 ? 0xf0 : 0x0f;
-    uint32_t val = rights;
-    if (sid & 1) val <<= 4;
-    pdom->rights[sid>>1] &= ~mask;
-    pdom->rights[sid>>1] |= val;
+    if (!pdom->set(state->pdom_leaves, sid, uint32_t(rights)))
+    {
+        logger::warning() << __FUNCTION__ << ": out of memory for rights of sid " << sid;
+        nucleus::debug_stop();
+    }
 
     // Want to invalidate all non-global TB entries, but we can't
     // do that on Intel so just blow away the whole thing.
@@ -603,7 +1215,15 @@ static void mmu_v1_set_rights(mmu_v1::closure_t* self, protection_domain_v1::id
 
 static stretch_v1::rights mmu_v1_query_rights(mmu_v1::closure_t* self, protection_domain_v1::id dom_id, stretch_v1::closure_t* str)
 {
-    return stretch_v1::rights();
+    pdom_st* slot = find_pdom(self->d_state, dom_id);
+
+    if (!slot)
+    {
+        logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id;
+        return stretch_v1::rights();
+    }
+
+    return stretch_v1::rights(slot->pdom->get(str->d_state->sid));
 }
 
 // No ASN supported on x86.
@@ -617,9 +1237,64 @@ static stretch_v1::rights mmu_v1_query_global_rights(mmu_v1::closure_t* self, st
     return stretch_v1::rights();
 }
 
+/**
+ * Walks all live pdoms, a pdom only gets a new rights leaf if it has rights on @a tmpl.
+ */
 static void mmu_v1_clone_rights(mmu_v1::closure_t* self, stretch_v1::closure_t* tmpl, stretch_v1::closure_t* str)
 {
+    auto state = self->d_state;
+    sid_t from = tmpl->d_state->sid;
+    sid_t to = str->d_state->sid;
 
+    for (uint32_t chunk = 0; chunk < state->pdom_n_chunks; ++chunk)
+    {
+        for (size_t i = 0; i < PDOM_CHUNK; ++i)
+        {
+            pdom_t* pdom = state->pdom_tbl[chunk][i].pdom;
+            if (pdom && !pdom->set(state->pdom_leaves, to, pdom->get(from)))
+                logger::warning() << __FUNCTION__ << ": out of memory for rights of sid " << to;
+        }
+    }
+}
+
+/**
+ * All domains share one page table and x86 has no ASNs, so there is no TLB state to switch, only translations
+ * left stale by earlier operations (such as 4MB page splits) to invalidate.
+ */
+static void mmu_v1_switch_domain(mmu_v1::closure_t* self, protection_domain_v1::id dom_id)
+{
+    auto state = self->d_state;
+    per_cpu_section_t guard;
+    tlb_cpu_t& tlb = state->tlb[this_cpu()];
+
+    if (tlb.full || (tlb.n_pages > 0))
+    {
+        ++tlb.stats.switch_syncs;
+        tlb_sync(state);
+    }
+}
+
+static mmu_v1::tlb_stats mmu_v1_get_tlb_stats(mmu_v1::closure_t* self)
+{
+    auto state = self->d_state;
+    mmu_v1::tlb_stats s;
+
+    memutils::clear_memory(&s, sizeof(s));
+
+    for (size_t i = 0; i < MAX_CPUS; ++i)
+    {
+        const mmu_v1::tlb_stats& c = state->tlb[i].stats;
+        s.unmap_pages += c.unmap_pages;
+        s.protect_pages += c.protect_pages;
+        s.remap_pages += c.remap_pages;
+        s.split_pages += c.split_pages;
+        s.invalidated_pages += c.invalidated_pages;
+        s.full_flushes += c.full_flushes;
+        s.global_flushes += c.global_flushes;
+        s.switch_syncs += c.switch_syncs;
+    }
+
+    return s;
 }
 
 static const mmu_v1::ops_t mmu_v1_methods =
@@ -627,6 +1302,9 @@ static const mmu_v1::ops_t mmu_v1_methods =
     mmu_v1_start,
     mmu_v1_add_range,
     mmu_v1_add_mapped_range,
+    mmu_v1_add_mapped_ranges,
+    mmu_v1_add_cow_range,
+    mmu_v1_remap_page,
     mmu_v1_update_range,
     mmu_v1_free_range,
     mmu_v1_create_domain,
@@ -636,7 +1314,9 @@ static const mmu_v1::ops_t mmu_v1_methods =
     mmu_v1_query_rights,
     mmu_v1_query_asn,
     mmu_v1_query_global_rights,
-    mmu_v1_clone_rights
+    mmu_v1_clone_rights,
+    mmu_v1_switch_domain,
+    mmu_v1_get_tlb_stats
 };
 
 //======================================================================================================================
@@ -752,9 +1432,6 @@ static size_t memory_required(bootinfo_t* bi, size_t& n_l2_tables)
 
     size_t res = sizeof(mmu_v1::state_t);   /* state includes the level 1 page table */
 
-    // Account for L2 infos
-    res += n_l2_tables * sizeof(l2_info);
-
     logger::debug() << "Got " << int(nptabs) << " nptabs";
 
     return res;
@@ -808,8 +1485,9 @@ static void enter_mappings(mmu_v1::state_t* state)
                 }
             });
 
-            /* We lock the L1 page table into the TLB */
-            if(state->use_global_pages && (virt == reinterpret_cast<address_t>(&(state->l1_mapping))))
+            /* Boot mappings (nucleus, kernel, boot modules and our own state) are the same in every
+               protection domain, so they are global and survive TLB flushes. */
+            if (state->use_global_pages)
                 flags |= page_t::global;
 
             page_t pte;
@@ -827,7 +1505,7 @@ static void enter_mappings(mmu_v1::state_t* state)
         }
     });
 
-    logger::debug() << "mmu_module_v1: enter_mappings required total of " << int(state->l2_next) << " new L2 tables.";
+    logger::debug() << "mmu_module_v1: enter_mappings required total of " << int(state->l2_total - state->l2_n_free) << " new L2 tables.";
 }
 
 static mmu_v1::closure_t*
@@ -895,6 +1573,7 @@ mmu_module_v1_create(mmu_module_v1::closure_t* self, uint32_t initial_reservatio
         state->l1_virt[i] = 0;
         state->l1_shadows[i].sid = SID_NULL;
         state->l1_shadows[i].flags = 0;
+        state->l2_used[i] = 0;
     }
 
     // Initialise the ram table; it follows the state record immediately.
@@ -907,35 +1586,40 @@ mmu_module_v1_create(mmu_module_v1::closure_t* self, uint32_t initial_reservatio
 
     logger::debug() << "mmu_module_v1: ramtab at " << state->ramtab << " with " << int(state->ramtab_size) << " entries.";
 
-    // Initialise the protection domain tables
-    state->next_pdidx = 0;
-    for(i = 0; i < PDIDX_MAX; i++) //--
-    {
+    // Initialise the protection domain tables, slots and rights are allocated once finish_init provides a heap.
+    state->pdom_free = PDIDX_NONE;
+    state->pdom_n_chunks = 0;
+    for(i = 0; i < PDIDX_MAX / PDOM_CHUNK; i++)
         state->pdom_tbl[i] = NULL;
-        state->pdominfo[i].refcnt  = 0;
-        state->pdominfo[i].gen     = 0;
-        state->pdominfo[i].stretch = NULL;
-    }
+    state->pdom_cache = NULL;
+    state->pdom_leaves.cache = NULL;
 
     // And store a pointer to the pdom_tbl in the info page.
     INFO_PAGE.protection_domains = &(state->pdom_tbl);
 
+    memutils::clear_memory(state->tlb, sizeof(state->tlb));
+
     state->use_global_pages = (INFO_PAGE.cpu_features & X86_32_FEAT_PGE) != 0;
+    state->use_large_pages = (INFO_PAGE.cpu_features & X86_32_FEAT_PSE) != 0; // launcher enables CR4.PSE then
 
     // Intialise our closures, etc to NULL for now  // will be fixed by $Done later
     state->system_frame_allocator = NULL;
     state->heap = NULL;
     state->stretch_allocator = NULL;
 
-    state->l2_virt  = page_align_up(first_range + l2_tables_offset);
-    state->l2_phys  = page_align_up(state->l1_mapping_phys + l2_tables_offset);
-    state->l2_max  = n_l2_tables;
+    // The initial pool is identity mapped like the rest of the state, more tables are added on demand after finish_init.
+    address_t l2_virt = page_align_up(first_range + l2_tables_offset);
+    address_t l2_phys = page_align_up(state->l1_mapping_phys + l2_tables_offset);
 
-    logger::debug() << "mmu_module_v1: " << int(state->l2_max) << " L2 tables at va=" << state->l2_virt << ", pa=" << state->l2_phys;
+    logger::debug() << "mmu_module_v1: " << int(n_l2_tables) << " L2 tables at va=" << l2_virt << ", pa=" << l2_phys;
 
-    state->l2_next = 0;
-    for(i = 0; i < state->l2_max; i++) //--
-        state->info[i] = L2FREE;
+    state->l2_free = 0;
+    state->l2_n_free = 0;
+    state->l2_total = n_l2_tables;
+    state->l2_growing = false;
+    memutils::clear_memory(reinterpret_cast<void*>(l2_virt), n_l2_tables * L2SIZE); //--
+    for(i = n_l2_tables; i > 0; i--)
+        free_l2table(state, l2_virt + (i - 1) * L2SIZE, l2_phys + (i - 1) * L2SIZE);
 
     // Enter mappings for all the existing translations.
     // This call uses mappings in bootinfo_page,
@@ -965,6 +1649,9 @@ static void mmu_module_v1_finish_init(mmu_module_v1::closure_t* self, mmu_v1::cl
     mmu->d_state->system_frame_allocator = frames;
     mmu->d_state->heap = heap;
     mmu->d_state->stretch_allocator = sysalloc;
+
+    mmu->d_state->pdom_cache = PVS(slab_factory)->create(sizeof(pdom_t), sizeof(void*), heap, NULL);
+    mmu->d_state->pdom_leaves.cache = PVS(slab_factory)->create(pdom_t::LEAF_SIZE, sizeof(void*), heap, NULL);
 }
 
 static const mmu_module_v1::ops_t mmu_module_v1_methods =
@@ -57,9 +57,7 @@ flags_t page_t::flags()
 void page_t::set_flags(flags_t flags)
 {
     uint32_t value = 0;
-    if (flags & kernel_mode)
-        value |= IA32_PAGE_GLOBAL;
-    else
+    if (!(flags & kernel_mode))
         value |= IA32_PAGE_USER;
     if (flags & writable)
         value |= IA32_PAGE_WRITABLE;
@@ -76,6 +76,7 @@ public:
     bool is_writable() { return (raw & IA32_PAGE_WRITABLE) != 0; }
     bool is_user()     { return (raw & IA32_PAGE_USER) != 0; }
     bool is_kernel()   { return (raw & IA32_PAGE_USER) == 0; }
+    bool is_global()   { return (raw & IA32_PAGE_GLOBAL) != 0; }
     bool is_4mb()      { return (raw & IA32_PAGE_4MB) != 0; } // only valid in PDE
 
     // Retrieval
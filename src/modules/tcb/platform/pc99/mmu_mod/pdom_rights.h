@@ -0,0 +1,94 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+
+/**
+ * Rights of one protection domain over up to @a N_SIDS stretches, 4 bits per stretch id.
+ *
+ * Sids are grouped into leaves of SIDS_PER_LEAF. The first leaf is kept inline as a dense fast path for the low
+ * sids handed out first to system stretches; other leaves come from @a Allocator, which provides new_leaf() and
+ * delete_leaf(), when the domain is first given rights in their range. A domain with no rights beyond the first
+ * leaf takes a few hundred bytes instead of N_SIDS/2, and a lookup is at most two loads.
+ */
+template <class Allocator, size_t N_SIDS>
+class pdom_rights_t
+{
+public:
+    static const size_t SIDS_PER_LEAF = 256;
+    static const size_t LEAF_SIZE = SIDS_PER_LEAF / 2; //!< Bytes in a leaf.
+    static const size_t N_LEAVES = (N_SIDS + SIDS_PER_LEAF - 1) / SIDS_PER_LEAF;
+
+    void init()
+    {
+        for (size_t i = 0; i < LEAF_SIZE; ++i)
+            first[i] = 0;
+        leaves[0] = first;
+        for (size_t i = 1; i < N_LEAVES; ++i)
+            leaves[i] = 0;
+    }
+
+    /**
+     * Give leaves back to @a allocator, the domain has no rights afterwards.
+     */
+    void clear(Allocator& allocator)
+    {
+        for (size_t i = 1; i < N_LEAVES; ++i)
+        {
+            if (leaves[i])
+                allocator.delete_leaf(leaves[i]);
+        }
+        init();
+    }
+
+    uint8_t get(size_t sid) const
+    {
+        const uint8_t* leaf = leaves[sid / SIDS_PER_LEAF];
+        if (!leaf)
+            return 0;
+        return nibble(leaf, sid % SIDS_PER_LEAF);
+    }
+
+    /**
+     * Set 4 bits of @a rights for @a sid.
+     * @return false if a leaf was needed and could not be allocated.
+     */
+    bool set(Allocator& allocator, size_t sid, uint8_t rights)
+    {
+        uint8_t*& leaf = leaves[sid / SIDS_PER_LEAF];
+        rights &= 0xf;
+
+        if (!leaf)
+        {
+            if (!rights)
+                return true;
+            leaf = allocator.new_leaf();
+            if (!leaf)
+                return false;
+            for (size_t i = 0; i < LEAF_SIZE; ++i)
+                leaf[i] = 0;
+        }
+
+        size_t index = sid % SIDS_PER_LEAF;
+        uint8_t mask = (index & 1) ? 0xf0 : 0x0f;
+        uint8_t val = (index & 1) ? (rights << 4) : rights;
+        leaf[index >> 1] = (leaf[index >> 1] & ~mask) | val;
+        return true;
+    }
+
+private:
+    static uint8_t nibble(const uint8_t* leaf, size_t index)
+    {
+        return (index & 1) ? (leaf[index >> 1] >> 4) : (leaf[index >> 1] & 0xf);
+    }
+
+    uint8_t* leaves[N_LEAVES];
+    uint8_t  first[LEAF_SIZE];
+};
@@ -22,8 +22,10 @@
 #include "mmu_v1_interface.h"
 #include "mmu_module_v1_interface.h"
 #include "mmu_module_v1_impl.h" // for debug
+#include "tlb_model_v1_interface.h"
 #include "heap_v1_interface.h"
 #include "heap_factory_v1_interface.h"
+#include "slab_factory_v1_interface.h"
 #include "pervasives_v1_interface.h"
 #include "system_frame_allocator_v1_interface.h"
 #include "stretch_driver_module_v1_interface.h"
@@ -81,6 +83,8 @@ static void* load_module(bootimage_t& bootimg, const char* module_name, const ch
     bootinfo_t* bi = new(bootinfo_t::ADDRESS) bootinfo_t;
     elf_parser_t loader(addr.start);
     void** closure_ptr = reinterpret_cast<void**>(bi->modules().load_module(module_name, loader, clos));
+    if (!closure_ptr)
+        return 0;
     return *closure_ptr; // @todo little discrepancy due to root_domain using the same load_module() to find its own entry point.
     /** todo Skip dependencies for now. */
 }
@@ -234,14 +238,15 @@ create_address_space(system_frame_allocator_v1::closure_t* frames, mmu_v1::closu
  * maps a stretch over the existing heap.
  * This allows us to map it read/write for us, and read-only to everyone else.
  */
-static void map_initial_heap(heap_factory_v1::closure_t* heap_factory, heap_v1::closure_t* heap, size_t initial_heap_size, protection_domain_v1::id root_domain_pdid)
+static void map_initial_heap(heap_factory_v1::closure_t* heap_factory, heap_v1::closure_t* heap, size_t initial_heap_size, stretch_allocator_v1::closure_t* sysalloc, protection_domain_v1::id root_domain_pdid)
 {
     logger::debug() << "Mapping stretch over heap: " << int(initial_heap_size) << " bytes at " << heap;
     memory_v1::physmem_desc null_pmem; /// @todo We pass pmems by value in the interface atm... it's not even used!
 
     auto str = PVS(stretch_allocator)->create_over(initial_heap_size, stretch_v1::rights(stretch_v1::right_read), memory_v1::address(heap), memory_v1::attrs_regular, PAGE_WIDTH, null_pmem);
 
-    auto real_heap = heap_factory->realize(heap, str);
+    // Heap grows with nailed stretches from now on.
+    auto real_heap = heap_factory->realize(heap, str, sysalloc, root_domain_pdid);
 
     if (real_heap != heap)
     {
@@ -274,6 +279,9 @@ init(bootimage_t& bootimg)
     auto heap_factory = load_module<heap_factory_v1::closure_t>(bootimg, "heap_factory", "exported_heap_factory_rootdom");
     ASSERT(heap_factory);
 
+    auto slab_factory = load_module<slab_factory_v1::closure_t>(bootimg, "slab_factory", "exported_slab_factory_rootdom");
+    ASSERT(slab_factory);
+
     auto stretch_allocator_factory = load_module<stretch_allocator_module_v1::closure_t>(bootimg, "stretch_allocator_factory", "exported_stretch_allocator_module_rootdom");
     ASSERT(stretch_allocator_factory);
 
@@ -321,6 +329,7 @@ init(bootimage_t& bootimg)
 
     auto heap = heap_factory->create_raw(next_free + required, initial_heap_size);
     PVS(heap) = heap;
+    PVS(slab_factory) = slab_factory;
 
     frames_factory->finish_init(frames, heap);
 
@@ -374,7 +383,7 @@ init(bootimage_t& bootimg)
              << "====================================" << endl;
 
     auto root_domain_pdid = create_address_space(frames, mmu);
-    map_initial_heap(heap_factory, heap, initial_heap_size, root_domain_pdid);
+    map_initial_heap(heap_factory, heap, initial_heap_size, sysalloc, root_domain_pdid);
 
     /* Get an Exception System */
     kconsole << "============================" << endl
@@ -534,6 +543,10 @@ init(bootimage_t& bootimg)
         sys->add("TypeSystem", closure_to_any(PVS(types), type_system_v1::type_code));
         sys->add("FramesAllocator", closure_to_any(frames, frame_allocator_v1::type_code));
         sys->add("StretchTable", closure_to_any(strtab, stretch_table_v1::type_code));
+        // Only the hosted MMU simulates a TLB.
+        auto tlb_model = load_module<tlb_model_v1::closure_t>(bootimg, "mmu_factory", "exported_tlb_model_rootdom");
+        if (tlb_model)
+            sys->add("TLBModel", closure_to_any(tlb_model, tlb_model_v1::type_code));
     }
 
     /* IDC stub context */
@@ -742,6 +755,9 @@ init(bootimage_t& bootimg)
     }*/
     kconsole << endl;
     print_context_tree(root, 0);
+
+    // Nothing else runs yet, so use the time to fill the pool of zeroed frames.
+    frames->zero_frames(~0U);
 }
 
 #define CONTEXT_FIND(name, type) \
@@ -14,6 +14,8 @@
 #include "exceptions.h"
 #include "time_macros.h"
 #include "heap_new.h"
+#include "slab_new.h"
+#include "slab_factory_v1_interface.h"
 
 /* 
  * Eventcount and Sequencer stuff
@@ -101,6 +103,8 @@ struct instance_state_t
     threads_manager_v1::closure_t* thread_manager;   /// Handle to (un)block threads.
     thread_hooks_v1::closure_t thread_hooks;         /// To setup the per-thread state.
     heap_v1::closure_t*  heap;                       /// Our heap (NB: not locked).
+    slab_cache_v1::closure_t* counts_cache;          /// Event counts, null until first use.
+    slab_cache_v1::closure_t* sequencers_cache;      /// Sequencers, null until first use.
     event_count_t        all_counts;                 /// All event counts in a list.
     dl_link_t<qlink_t>   time_queue;                 /// Things waiting for timeouts.
     events_v1::state_t*  exit_st;                    /// Events structure used for exit.
@@ -261,15 +265,23 @@ unblock_event(instance_state_t* istate, event_count_t* event_count, bool alerted
 // Events.
 //=====================================================================================================================
 
+static slab_cache_v1::closure_t*
+object_cache(instance_state_t* istate, slab_cache_v1::closure_t** cache, memory_v1::size size)
+{
+    if (!*cache && PVS(slab_factory))
+        *cache = PVS(slab_factory)->create(size, sizeof(uint64_t), istate->heap, NULL);
+    if (!*cache)
+        OS_RAISE((exception_support_v1::id)"events_v1.no_resources", 0);
+    return *cache;
+}
+
 static event_v1::count
 events_create(events_v1::closure_t* self)
 {
     instance_state_t* istate  = self->d_state->inst_state;
     vcpu_lock_t lock(istate->vcpu);
 
-    event_count_t* res = new(istate->heap) event_count_t(istate);
-    if (!res)
-        OS_RAISE((exception_support_v1::id)"events_v1.no_resources", 0);
+    event_count_t* res = new(object_cache(istate, &istate->counts_cache, sizeof(event_count_t))) event_count_t(istate);
 
     istate->all_counts.ec_queue.add_to_tail(res->ec_queue);
 
@@ -313,7 +325,7 @@ events_destroy(events_v1::closure_t* self, event_v1::count ec)
 
     // Finally, we can free the event count.
     lock.lock();
-    istate->heap->free(reinterpret_cast<memory_v1::address>(event_count)); // oh, man.
+    slab_delete(istate->counts_cache, event_count);
 }
 
 /**
@@ -547,9 +559,7 @@ events_create_sequencer(events_v1::closure_t* self)
     instance_state_t* istate  = self->d_state->inst_state;
     vcpu_lock_t lock(istate->vcpu);
 
-    sequencer_t* res = new(istate->heap) sequencer_t(0);
-    if (!res)
-        OS_RAISE((exception_support_v1::id)"events_v1.no_resources", 0);
+    sequencer_t* res = new(object_cache(istate, &istate->sequencers_cache, sizeof(sequencer_t))) sequencer_t(0);
 
     return res;
 }
@@ -559,7 +569,7 @@ events_destroy_sequencer(events_v1::closure_t* self, event_v1::sequencer seq)
 {
     instance_state_t* istate  = self->d_state->inst_state;
     vcpu_lock_t lock(istate->vcpu);
-    istate->heap->free(reinterpret_cast<memory_v1::address>(seq)); // oh, man.
+    slab_delete(istate->sequencers_cache, reinterpret_cast<sequencer_t*>(seq));
 }
 
 static event_v1::value
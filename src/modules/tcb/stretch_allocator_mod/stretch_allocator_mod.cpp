@@ -13,6 +13,8 @@
 #include "stretch_allocator_v1_interface.h"
 #include "stretch_allocator_v1_impl.h"
 #include "frame_allocator_v1_interface.h"
+#include "fault_handler_v1_interface.h"
+#include "fault_handler_v1_impl.h"
 #include "stretch_v1_interface.h"
 #include "stretch_v1_state.h"
 #include "stretch_v1_impl.h"
@@ -20,6 +22,8 @@
 #include "mmu_v1_interface.h"
 #include "default_console.h"
 #include "heap_new.h"
+#include "slab_new.h"
+#include "slab_factory_v1_interface.h"
 #include "bootinfo.h"
 #include "macros.h"
 #include "domain.h"
@@ -27,6 +31,10 @@
 #include "debugger.h"
 #include "nucleus.h"
 #include "infopage.h"
+#include "cpu_flags.h"
+#include "va_tree.h"
+#include "lockable.h"
+#include "logger.h"
 
 //======================================================================================================================
 // state structures
@@ -35,37 +43,90 @@
 // How many uint32_t's are needed to cover all SIDs
 #define SID_ARRAY_SZ (SID_MAX/32)
 
-struct virtual_address_space_region : public dl_link_t<virtual_address_space_region>
+/**
+ * Extent records come from a slab cache, they are churned by every stretch allocation.
+ */
+struct slab_extents_t
+{
+    slab_cache_v1::closure_t* cache;
+
+    va_extent_t* new_extent() { return new(cache) va_extent_t; }
+    void delete_extent(va_extent_t* e) { slab_delete<va_extent_t>(cache, e); }
+};
+
+typedef va_space_t<slab_extents_t> virtual_address_space_t;
+
+/**
+ * Frames of a template stretch, shared copy-on-write with its clones.
+ */
+struct cow_image_t
 {
-    memory_v1::virtmem_desc desc;
+    memory_v1::address phys;    //!< Original frames of the template, contiguous.
+    size_t             n_pages;
+    size_t             users;   //!< Stretches mapping some of the original frames.
+    uint16_t*          refs;    //!< Per page, number of stretches still mapping the original frame.
+};
+
+/**
+ * A stretch sharing frames of an image, pages become private as they are written to.
+ */
+struct cow_stretch_t : public dl_link_t<cow_stretch_t>
+{
+    stretch_v1::closure_t* stretch;
+    cow_image_t*           image;
+    size_t                 n_pages;
+    memory_v1::address*    frames;  //!< Per page, the frame mapped now.
 
     // This doubly-linked list is very messy...
-    virtual_address_space_region() : dl_link_t<virtual_address_space_region>() {
+    cow_stretch_t() : dl_link_t<cow_stretch_t>() {
         init(this);
     }
+
+    bool is_shared(size_t page) const
+    {
+        return (page < n_pages) && (page < image->n_pages) && (frames[page] == image->phys + (page << PAGE_WIDTH));
+    }
+};
+
+struct server_state_t;
+
+struct fault_handler_v1::state_t
+{
+    server_state_t* shared_state;
 };
 
 //! Shared state.
 struct server_state_t
 {
-    virtual_address_space_region*                    regions;
+    virtual_address_space_t                          free_space;   //!< Unallocated virtual address space.
 
     frame_allocator_v1::closure_t*                   frames;       //!< Only in nailed sallocs.
     heap_v1::closure_t*                              heap;
     mmu_v1::closure_t*                               mmu;
+    slab_cache_v1::closure_t*                        regions_cache; //!< Free extent records of free_space.
+    slab_cache_v1::closure_t*                        links_cache;   //!< Per-client stretch list links.
 
     uint32_t*                                        sids;         //!< Pointer to table of SIDs in use.
     stretch_v1::closure_t**                          stretch_tab;  //!< SID -> Stretch_clp mapping.
     dl_link_t<system_stretch_allocator_v1::state_t>  clients;      //!< list of all client states.
+
+    dl_link_t<cow_stretch_t>                         cow_stretches; //!< Stretches sharing frames copy-on-write.
+    fault_handler_v1::state_t                        cow_state;
+    fault_handler_v1::closure_t                      cow_closure;   //!< Resolves write faults on them.
+    uint8_t*                                         cow_buffer;    //!< Page being copied, allocated on first use.
+    lockable_t                                       cow_lock;      //!< Serialises write faults, they share cow_buffer and refs.
 };
 
 // HMMM
 struct stretch_list_t : public dl_link_t<stretch_list_t>
 {
     stretch_v1::closure_t* stretch;
+    memory_v1::address     phys;        //!< Backing frames of a nailed stretch.
+    size_t                 page_width;  //!< Width of the pages it is mapped with.
+    cow_stretch_t*         cow;         //!< Set while it shares frames copy-on-write.
 
     // This doubly-linked list is very messy...
-    stretch_list_t() : dl_link_t<stretch_list_t>() {
+    stretch_list_t() : dl_link_t<stretch_list_t>(), phys(NO_ADDRESS), page_width(PAGE_WIDTH), cow(NULL) {
         init(this);
     }
 };
@@ -105,7 +166,7 @@ static sid_t alloc_sid(server_state_t* state)
             size_t k;
             for (k = 0; (k < 32) && (sid & (1 << k)); ++k) {}
             state->sids[i] = sid | (1 << k);
-            kconsole << __FUNCTION__ << ": allocated sid " << i * 32 + k << endl;
+            logger::trace() << __FUNCTION__ << ": allocated sid " << i * 32 + k;
             return i * 32 + k;
         }
     }
@@ -118,140 +179,89 @@ static void register_sid(server_state_t* state, sid_t sid, stretch_v1::closure_t
     state->stretch_tab[sid] = stretch;
 }
 
-// static void free_sid(server_state_t* state, sid_t sid)
-// {
-    // kconsole << __FUNCTION__ << ": deallocated sid " << sid << endl;
-    // state->sids[sid / 32] &= ~(1 << (sid % 32));
-// }
+static void free_sid(server_state_t* state, sid_t sid)
+{
+    logger::trace() << __FUNCTION__ << ": deallocated sid " << sid;
+    state->stretch_tab[sid] = NULL;
+    state->sids[sid / 32] &= ~(1 << (sid % 32));
+}
 
 #define SYSALLOC_VA_BASE ANY_ADDRESS
 // #define SYSALLOC_VA_BASE (256*MiB)
 #define SYSALLOC_VA_SIZE (256*MiB)
 
-inline console_t& operator << (console_t& con, virtual_address_space_region* region)
+static void create_caches(server_state_t* state)
 {
-    con << "region:" << endl
-        << "  START: " << region->desc.start_addr << "; start page: " << (region->desc.start_addr >> PAGE_WIDTH) << endl
-        << "  bytes: " << (region->desc.n_pages << region->desc.page_width) << "; PAGES: " << region->desc.n_pages << endl
-        << "  width bits: " << int(region->desc.page_width) << endl
-        << "  attrs: " << region->desc.attr << endl;
-    return con;
+    state->regions_cache = PVS(slab_factory)->create(sizeof(va_extent_t), sizeof(void*), state->heap, NULL);
+    state->links_cache = PVS(slab_factory)->create(sizeof(stretch_list_t), sizeof(void*), state->heap, NULL);
+    if (!state->regions_cache || !state->links_cache)
+    {
+        kconsole << __FUNCTION__ << ": cannot create object caches." << endl;
+        nucleus::debug_stop();
+    }
 }
 
-static bool vm_alloc(server_state_t* state, memory_v1::size size, memory_v1::address start, memory_v1::address* virt_addr, size_t* n_pages, size_t* page_width)
+/**
+ * Set up an empty address space for @a state, its extent records come from the regions cache.
+ */
+static void init_free_space(server_state_t* state)
 {
-    kconsole << __FUNCTION__ << " size " << size << ", start " << start << endl;
+    slab_extents_t extents;
+    extents.cache = state->regions_cache;
+    state->free_space.init(extents);
+}
 
-    size_t npages = (size + PAGE_SIZE - 1) >> PAGE_WIDTH;
-    dl_link_t<virtual_address_space_region>* region;
+/**
+ * Allocate virtual memory for pages of @a width bits. Address and size are aligned to the page size,
+ * so large pages can be mapped without splitting. With no @a start address the best fitting free extent is used.
+ * @return start address, number and width of allocated pages.
+ */
+static bool vm_alloc(server_state_t* state, memory_v1::size size, memory_v1::address start, size_t width, memory_v1::address* virt_addr, size_t* n_pages, size_t* page_width)
+{
+    size_t npages = align_to_frame_width(size, width) >> PAGE_WIDTH;
+    size_t start_page;
 
     if (unaligned(start))
     {
-        // no start address requested, allocate at start of any suitable region.
-        for (region = state->regions->next(); region != state->regions; region = region->next())
+        if (!state->free_space.allocate(npages, 1UL << (width - PAGE_WIDTH), &start_page))
         {
-            kconsole << *region;
-
-            if (npages <= (*region)->desc.n_pages)
-                break;
-        }
-
-        kconsole << "found " << *region << endl;
-
-        if (region == state->regions)
-        {
-            kconsole << __FUNCTION__ << ": no appropriate region found!" << endl;
+            kconsole << __FUNCTION__ << ": no free region of " << npages << " pages!" << endl;
             return false;
         }
-
-        *virt_addr  = (*region)->desc.start_addr;
-        *n_pages    = npages;
-        *page_width = (*region)->desc.page_width;
-
-        if ((*region)->desc.n_pages > npages)
-        {
-            (*region)->desc.start_addr += align_to_frame_width(size, (*region)->desc.page_width);
-            (*region)->desc.n_pages -= npages;
-        }
-        else
-        {
-            region->remove();
-            delete *region;
-        }
     }
     else // aligned(start)
     {
-        // have a requested start address; compute start page
-        size_t start_page = (start + PAGE_SIZE - 1) >> PAGE_WIDTH;
-        size_t region_start_page{0}, region_last_page{0}, region_page_offset{0};
-
-        for (region = state->regions->next(); region != state->regions; region = region->next())
+        if (!is_aligned_to_frame_width(start, width))
         {
-            // get the region start and end pages
-            region_start_page = ((*region)->desc.start_addr + PAGE_SIZE - 1) >> PAGE_WIDTH;
-            region_last_page = region_start_page + (*region)->desc.n_pages;
-
-            // check if we're within one region
-            if (start_page >= region_start_page && (start_page + npages) <= region_last_page)
-                break;
-        }
-
-        if (region == state->regions)
-        {
-            kconsole << __FUNCTION__ << ": no appropriate region found!" << endl;
+            kconsole << __FUNCTION__ << ": requested address " << start << " not aligned to page width " << width << endl;
             return false;
         }
 
-        if ((start & ((1UL << (*region)->desc.page_width) - 1)) != 0) // FIXME: check start_page alignment instead?
+        start_page = start >> PAGE_WIDTH;
+        if (!state->free_space.allocate_at(start_page, npages))
         {
-            kconsole << __FUNCTION__ << ": requested address " << start << " not aligned to region's page width " << (*region)->desc.page_width << endl;
-            nucleus::debug_stop();
+            kconsole << __FUNCTION__ << ": [" << start << ".." << start + (npages << PAGE_WIDTH) << ") is not free!" << endl;
+            return false;
         }
+    }
 
-        region_page_offset = start_page - region_start_page;
+    *virt_addr  = start_page << PAGE_WIDTH;
+    *n_pages    = npages >> (width - PAGE_WIDTH);
+    *page_width = width;
 
-        *virt_addr  = start_page << PAGE_WIDTH; // FIXME: use region page_width instead?
-        *n_pages    = npages;
-        *page_width = (*region)->desc.page_width;
+    logger::trace() << __FUNCTION__ << ": allocated [" << *virt_addr << ".." << *virt_addr + (npages << PAGE_WIDTH) << ")";
+    return true;
+}
 
-        // Now take out the allocated region.
-        if (region_page_offset == 0)
-        {
-            // allocating from the start of the region
-            if ((*region)->desc.n_pages > npages)
-            {
-                (*region)->desc.start_addr += align_to_frame_width(size, (*region)->desc.page_width);
-                (*region)->desc.n_pages -= npages;
-            }
-            else
-            {
-                region->remove();
-                delete *region; // FIXME: check that the right operator delete is called!
-            }
-        }
-        else
-        {
-            // allocating from the end of the region
-            if ((region_page_offset + npages) == (*region)->desc.n_pages)
-            {
-                (*region)->desc.n_pages -= npages;
-            }
-            else
-            {
-                // allocating from the middle of the region
-                auto new_region = new(state->heap) virtual_address_space_region;
-                new_region->desc.start_addr = *virt_addr + align_to_frame_width(size, (*region)->desc.page_width);
-                new_region->desc.n_pages = (*region)->desc.n_pages - (npages + region_page_offset);
-                new_region->desc.page_width = (*region)->desc.page_width;
-                new_region->desc.attr = (*region)->desc.attr;
-                (*region)->desc.n_pages = region_page_offset;
-                region->insert_after(*new_region);
-            }
-        }
+/**
+ * Return virtual memory of a stretch, it is merged with the free neighbours.
+ */
+static void vm_free(server_state_t* state, memory_v1::address start, memory_v1::size size)
+{
+    if (!state->free_space.free(start >> PAGE_WIDTH, size >> PAGE_WIDTH))
+    {
+        kconsole << WARNING << __FUNCTION__ << ": cannot free [" << start << ".." << start + size << "), leaking it" << endl;
     }
-
-    kconsole << __FUNCTION__ << ": allocated [" << *virt_addr << ".." << *virt_addr + (*n_pages << *page_width) << ")" << endl;
-    return true;
 }
 
 static void set_default_rights(system_stretch_allocator_v1::state_t* state, stretch_v1::closure_t* stretch)
@@ -273,14 +283,14 @@ static void set_default_rights(system_stretch_allocator_v1::state_t* state, stre
 
 static memory_v1::address stretch_v1_info(stretch_v1::closure_t* self, memory_v1::size* s)
 {
-    kconsole << __FUNCTION__ << endl;
+    logger::trace() << __FUNCTION__;
     *s = self->d_state->size;
     return self->d_state->base;
 }
 
 static void stretch_v1_set_rights(stretch_v1::closure_t* self, protection_domain_v1::id dom_id, stretch_v1::rights access)
 {
-    kconsole << __FUNCTION__ << ": pdom " << dom_id << ", sid " << self->d_state->sid << " " << access << endl;
+    logger::trace() << __FUNCTION__ << ": pdom " << dom_id << ", sid " << self->d_state->sid << " " << access;
     address_t start_page = self->d_state->base >> PAGE_WIDTH;
     size_t n_pages = self->d_state->size >> PAGE_WIDTH;
     if (nucleus::protect(dom_id, start_page, n_pages, access))
@@ -318,7 +328,7 @@ static const stretch_v1::ops_t stretch_v1_methods =
 // helper functions that depend on stretch_v1_ops
 //======================================================================================================================
 
-static stretch_v1::state_t* create_stretch(server_state_t* state, address_t base, size_t n_pages)
+static stretch_v1::state_t* create_stretch(server_state_t* state, address_t base, size_t n_pages, stretch_v1::rights global_rights)
 {
     auto stretch = new(state->heap) stretch_v1::state_t;
     if (!stretch)
@@ -330,6 +340,7 @@ static stretch_v1::state_t* create_stretch(server_state_t* state, address_t base
     closure_init(&stretch->closure, &stretch_v1_methods, stretch);
     stretch->base = base;
     stretch->size = n_pages << PAGE_WIDTH;
+    stretch->global_rights = global_rights;
     stretch->sid = alloc_sid(state);
     stretch->mmu = state->mmu;
 
@@ -338,6 +349,17 @@ static stretch_v1::state_t* create_stretch(server_state_t* state, address_t base
     return stretch;
 }
 
+/**
+ * Nailed stretches of whole large pages are backed by large frames and mapped with large pages,
+ * taking a single TLB entry per 4MiB.
+ */
+static size_t nailed_page_width(memory_v1::size size)
+{
+    if ((INFO_PAGE.cpu_features & X86_32_FEAT_PSE) && (size > 0) && is_aligned_to_frame_width(size, LARGE_PAGE_WIDTH))
+        return LARGE_PAGE_WIDTH;
+    return PAGE_WIDTH;
+}
+
 //======================================================================================================================
 // stretch_allocator_v1 methods
 //======================================================================================================================
@@ -346,25 +368,30 @@ static stretch_v1::state_t* create_stretch(server_state_t* state, address_t base
 // nailed version
 //======================================================================================================================
 
-static stretch_v1::closure_t* stretch_allocator_v1_nailed_create(stretch_allocator_v1::closure_t* self, memory_v1::size size, stretch_v1::rights global_rights)
+/**
+ * Nailed stretches are backed by contiguous frames allocated with @a attr,
+ * which lets callers ask frames_mod for zeroed memory.
+ */
+static stretch_v1::closure_t* nailed_create(stretch_allocator_v1::closure_t* self, memory_v1::size size, stretch_v1::rights global_rights, memory_v1::attrs attr)
 {
-    kconsole << __FUNCTION__ << ": size " << size << endl;
+    logger::debug() << __FUNCTION__ << ": size " << size;
     memory_v1::virtmem_desc virt;
     memory_v1::physmem_desc phys;
     auto state = reinterpret_cast<system_stretch_allocator_v1::state_t*>(self->d_state);
     server_state_t* ss = state->shared_state;
     
-    phys.start_addr = ss->frames->allocate(size, FRAME_WIDTH);
+    size_t width = nailed_page_width(size);
+    phys.start_addr = ss->frames->allocate_range(size, width, ANY_ADDRESS, attr);
     if (phys.start_addr == NO_ADDRESS)
     {
         kconsole << __FUNCTION__ << ": Failed to get physmem" << endl;
         //raise(memory_v1_falure);
         return NULL;
     }
-    phys.frame_width = FRAME_WIDTH;
-    phys.n_frames = size_in_whole_frames(size, FRAME_WIDTH);
+    phys.frame_width = width;
+    phys.n_frames = size_in_whole_frames(size, width);
     
-    if (!vm_alloc(ss, size, ANY_ADDRESS /*SYSALLOC_VA_BASE + phys.start_addr*/, &virt.start_addr, &virt.n_pages, &virt.page_width))
+    if (!vm_alloc(ss, size, ANY_ADDRESS /*SYSALLOC_VA_BASE + phys.start_addr*/, width, &virt.start_addr, &virt.n_pages, &virt.page_width))
     {
         kconsole << __FUNCTION__ << ": Failed to get virtmem" << endl;
         ss->frames->free(phys.start_addr, size);
@@ -372,11 +399,12 @@ static stretch_v1::closure_t* stretch_allocator_v1_nailed_create(stretch_allocat
         return NULL;
     }
     
-    auto s = create_stretch(ss, virt.start_addr, virt.n_pages);
+    auto s = create_stretch(ss, virt.start_addr, virt.n_pages << (virt.page_width - PAGE_WIDTH), global_rights);
     
     if (!s)
     {
         kconsole << __FUNCTION__ << ": Failed to create_stretch" << endl;
+        vm_free(ss, virt.start_addr, virt.n_pages << virt.page_width);
         ss->frames->free(phys.start_addr, size);
         //raise(memory_v1_falure);
         return NULL;
@@ -389,43 +417,488 @@ static stretch_v1::closure_t* stretch_allocator_v1_nailed_create(stretch_allocat
     
     //TODO: need locking here! at least lightweight
     //lock();
-    stretch_list_t* link = new(ss->heap) stretch_list_t;
+    stretch_list_t* link = new(ss->links_cache) stretch_list_t;
     link->stretch = &s->closure;
+    link->phys = phys.start_addr;
+    link->page_width = virt.page_width;
     state->stretches.add_to_tail(*link);
     //unlock();
 
-    kconsole << __FUNCTION__ << ": returning stretch at " << &s->closure << endl;
+    logger::debug() << __FUNCTION__ << ": returning stretch at " << &s->closure;
     return &s->closure;
 }
 
+static stretch_v1::closure_t* stretch_allocator_v1_nailed_create(stretch_allocator_v1::closure_t* self, memory_v1::size size, stretch_v1::rights global_rights)
+{
+    return nailed_create(self, size, global_rights, memory_v1::attrs_regular);
+}
+
+/**
+ * Stretches of a list are packed back to back in 4K pages: one virtual memory reservation, one frame allocation
+ * and one mmu update cover them all. If no contiguous frames are left, stretches are created one by one.
+ */
 static stretch_allocator_v1::stretch_seq stretch_allocator_v1_nailed_create_list(stretch_allocator_v1::closure_t* self, stretch_allocator_v1::size_seq sizes, stretch_v1::rights access)
 {
-    kconsole << __FUNCTION__ << endl;
-    return stretch_allocator_v1::stretch_seq();
+    logger::debug() << __FUNCTION__ << ": " << sizes.size() << " stretches";
+    auto state = reinterpret_cast<system_stretch_allocator_v1::state_t*>(self->d_state);
+    server_state_t* ss = state->shared_state;
+
+    stretch_allocator_v1::stretch_seq stretches(std::heap_allocator<stretch_v1::closure_t*>(ss->heap));
+    stretches.reserve(sizes.size());
+
+    size_t total_pages = 0;
+    for (auto size : sizes)
+        total_pages += size_in_whole_frames(size, PAGE_WIDTH);
+
+    if (total_pages == 0)
+        return stretches;
+
+    memory_v1::physmem_desc phys;
+    phys.start_addr = ss->frames->allocate(total_pages << PAGE_WIDTH, FRAME_WIDTH);
+    if (phys.start_addr == NO_ADDRESS)
+    {
+        kconsole << __FUNCTION__ << ": no contiguous physmem for the list, creating stretches one by one" << endl;
+        for (auto size : sizes)
+        {
+            stretch_v1::closure_t* stretch = stretch_allocator_v1_nailed_create(self, size, access);
+            if (!stretch)
+                break;
+            stretches.push_back(stretch);
+        }
+        return stretches;
+    }
+    phys.frame_width = FRAME_WIDTH;
+    phys.n_frames = total_pages;
+
+    memory_v1::virtmem_desc virt;
+    if (!vm_alloc(ss, total_pages << PAGE_WIDTH, ANY_ADDRESS, PAGE_WIDTH, &virt.start_addr, &virt.n_pages, &virt.page_width))
+    {
+        kconsole << __FUNCTION__ << ": Failed to get virtmem" << endl;
+        ss->frames->free(phys.start_addr, total_pages << PAGE_WIDTH);
+        return stretches;
+    }
+    virt.attr = memory_v1::attrs_regular;
+
+    address_t base = virt.start_addr;
+    for (auto size : sizes)
+    {
+        size_t n_pages = size_in_whole_frames(size, PAGE_WIDTH);
+        auto s = create_stretch(ss, base, n_pages, access);
+        if (!s)
+        {
+            // Out of memory, give back the part reserved for the stretches that were not created.
+            kconsole << __FUNCTION__ << ": Failed to create_stretch" << endl;
+            size_t tail = virt.start_addr + (total_pages << PAGE_WIDTH) - base;
+            vm_free(ss, base, tail);
+            ss->frames->free(phys.start_addr + (base - virt.start_addr), tail);
+            break;
+        }
+        s->allocator = self;
+        stretches.push_back(&s->closure);
+
+        //TODO: need locking here! at least lightweight
+        stretch_list_t* link = new(ss->links_cache) stretch_list_t;
+        link->stretch = &s->closure;
+        link->phys = phys.start_addr + (base - virt.start_addr);
+        state->stretches.add_to_tail(*link);
+
+        base += n_pages << PAGE_WIDTH;
+    }
+
+    if (stretches.empty())
+        return stretches;
+
+    virt.n_pages = (base - virt.start_addr) >> PAGE_WIDTH;
+    phys.n_frames = virt.n_pages;
+    ss->mmu->add_mapped_ranges(stretches, virt, phys, access);
+
+    for (auto stretch : stretches)
+        set_default_rights(state, stretch);
+
+    logger::debug() << __FUNCTION__ << ": created " << stretches.size() << " stretches over [" << virt.start_addr << ".." << base << ")";
+    return stretches;
 }
 
+/**
+ * Only the frame attributes are honoured, nailed stretches are always placed by the allocator.
+ */
 static stretch_v1::closure_t* stretch_allocator_v1_nailed_create_at(stretch_allocator_v1::closure_t* self, memory_v1::size size, stretch_v1::rights access, memory_v1::address start, memory_v1::attrs attr, memory_v1::physmem_desc region)
 {
-    kconsole << __FUNCTION__ << endl;
-    return 0;
+    if (start != ANY_ADDRESS)
+    {
+        kconsole << __FUNCTION__ << ": cannot place a nailed stretch at " << start << endl;
+        return NULL;
+    }
+    return nailed_create(self, size, access, attr);
 }
 
-static stretch_v1::closure_t* stretch_allocator_v1_nailed_clone(stretch_allocator_v1::closure_t* self, stretch_v1::closure_t* template_stretch, memory_v1::size size)
+static stretch_list_t* find_stretch_link(system_stretch_allocator_v1::state_t* state, stretch_v1::closure_t* stretch)
 {
-    kconsole << __FUNCTION__ << endl;
-    return 0;
+    for (dl_link_t<stretch_list_t>* link = state->stretches.next(); link != &state->stretches; link = link->next())
+    {
+        if ((*link)->stretch == stretch)
+            return *link;
+    }
+    return NULL;
+}
+
+static cow_stretch_t* create_cow_stretch(server_state_t* ss, stretch_v1::closure_t* stretch, cow_image_t* image, size_t n_pages)
+{
+    auto cow = new(ss->heap) cow_stretch_t;
+    if (!cow)
+        return NULL;
+
+    cow->frames = new(ss->heap) memory_v1::address [n_pages];
+    if (!cow->frames)
+    {
+        ss->heap->free(reinterpret_cast<memory_v1::address>(cow));
+        return NULL;
+    }
+
+    for (size_t page = 0; page < n_pages; ++page)
+        cow->frames[page] = NO_ADDRESS;
+
+    cow->stretch = stretch;
+    cow->image = image;
+    cow->n_pages = n_pages;
+    ss->cow_stretches.add_to_tail(*cow);
+    return cow;
+}
+
+/**
+ * Make the frames of a nailed stretch an image, with the stretch as its only user.
+ */
+static cow_stretch_t* share_template(server_state_t* ss, stretch_list_t* link)
+{
+    size_t n_pages = link->stretch->d_state->size >> PAGE_WIDTH;
+
+    auto image = new(ss->heap) cow_image_t;
+    if (!image)
+        return NULL;
+
+    image->refs = new(ss->heap) uint16_t [n_pages];
+    cow_stretch_t* cow = image->refs ? create_cow_stretch(ss, link->stretch, image, n_pages) : NULL;
+    if (!cow)
+    {
+        if (image->refs)
+            ss->heap->free(reinterpret_cast<memory_v1::address>(image->refs));
+        ss->heap->free(reinterpret_cast<memory_v1::address>(image));
+        return NULL;
+    }
+
+    image->phys = link->phys;
+    image->n_pages = n_pages;
+    image->users = 1;
+    for (size_t page = 0; page < n_pages; ++page)
+    {
+        image->refs[page] = 1;
+        cow->frames[page] = image->phys + (page << PAGE_WIDTH);
+    }
+
+    link->cow = cow;
+    return cow;
+}
+
+/**
+ * Give back the frames of a copy-on-write stretch: its private ones, and shared ones nobody else maps.
+ */
+static void release_cow_stretch(server_state_t* ss, cow_stretch_t* cow)
+{
+    cow_image_t* image = cow->image;
+
+    for (size_t page = 0; page < cow->n_pages; ++page)
+    {
+        if (cow->is_shared(page))
+        {
+            if (--image->refs[page] == 0)
+                ss->frames->free(cow->frames[page], PAGE_SIZE);
+        }
+        else if (cow->frames[page] != NO_ADDRESS)
+            ss->frames->free(cow->frames[page], PAGE_SIZE);
+    }
+
+    if (--image->users == 0)
+    {
+        ss->heap->free(reinterpret_cast<memory_v1::address>(image->refs));
+        ss->heap->free(reinterpret_cast<memory_v1::address>(image));
+    }
+
+    cow->remove();
+    ss->heap->free(reinterpret_cast<memory_v1::address>(cow->frames));
+    ss->heap->free(reinterpret_cast<memory_v1::address>(cow));
+}
+
+/**
+ * Write to a shared page: the last stretch mapping its frame may simply write, others get a private copy.
+ * The copy goes through a buffer, the new frame has no mapping until it replaces the shared one.
+ * Faults are serialised by cow_lock, which also keeps refs stable while sharers come and go.
+ */
+static bool cow_handle(fault_handler_v1::closure_t* self, stretch_v1::closure_t* stretch, memory_v1::address virt, memory_v1::fault reason)
+{
+    server_state_t* ss = self->d_state->shared_state;
+
+    if (reason != memory_v1::fault_on_write)
+        return false;
+
+    cow_stretch_t* cow = NULL;
+    for (dl_link_t<cow_stretch_t>* link = ss->cow_stretches.next(); link != &ss->cow_stretches; link = link->next())
+    {
+        if ((*link)->stretch == stretch)
+        {
+            cow = *link;
+            break;
+        }
+    }
+
+    stretch_v1::state_t* s = stretch->d_state;
+    if (!cow || (virt < s->base) || (virt - s->base >= s->size))
+        return false;
+
+    size_t page = (virt - s->base) >> PAGE_WIDTH;
+    memory_v1::address page_va = s->base + (page << PAGE_WIDTH);
+
+    lockable_scope_lock_t lock(ss->cow_lock);
+
+    if (!cow->is_shared(page) || (cow->image->refs[page] == 1))
+    {
+        ss->mmu->remap_page(stretch, page_va, cow->frames[page], s->global_rights);
+        return true;
+    }
+
+    if (!ss->cow_buffer)
+    {
+        ss->cow_buffer = new(ss->heap) uint8_t [PAGE_SIZE];
+        if (!ss->cow_buffer)
+            return false;
+    }
+
+    memory_v1::address frame = ss->frames->allocate(PAGE_SIZE, FRAME_WIDTH);
+    if (frame == NO_ADDRESS)
+    {
+        kconsole << __FUNCTION__ << ": no frame to copy " << page_va << " to" << endl;
+        return false;
+    }
+
+    memutils::copy_memory(ss->cow_buffer, reinterpret_cast<const void*>(page_va), PAGE_SIZE);
+    ss->mmu->remap_page(stretch, page_va, frame, s->global_rights);
+    memutils::copy_memory(reinterpret_cast<void*>(page_va), ss->cow_buffer, PAGE_SIZE);
+
+    --cow->image->refs[page];
+    cow->frames[page] = frame;
+    return true;
+}
+
+static const fault_handler_v1::ops_t cow_handler_methods =
+{
+    cow_handle
+};
+
+static void init_cow_handler(server_state_t* state)
+{
+    state->cow_stretches.init();
+    state->cow_state.shared_state = state;
+    state->cow_buffer = NULL;
+    closure_init(&state->cow_closure, &cow_handler_methods, &state->cow_state);
+}
+
+/**
+ * Unmapping leaves the frames of copy-on-write pages marked mapped, other stretches may still map them.
+ * Pages the stretch is the last user of are remapped as its own first, so unmapping them frees their frames.
+ */
+static void claim_last_shared_pages(server_state_t* ss, cow_stretch_t* cow)
+{
+    stretch_v1::state_t* s = cow->stretch->d_state;
+
+    for (size_t page = 0; page < cow->n_pages; ++page)
+    {
+        if (cow->is_shared(page) && (cow->image->refs[page] == 1))
+            ss->mmu->remap_page(cow->stretch, s->base + (page << PAGE_WIDTH), cow->frames[page], s->global_rights);
+    }
+}
+
+/**
+ * Unmap a nailed stretch and give back its frames, virtual memory and sid.
+ */
+static void destroy_nailed_stretch(server_state_t* ss, stretch_list_t* link)
+{
+    stretch_v1::state_t* s = link->stretch->d_state;
+
+    // A write fault in another sharer must not drop a page's refs between claiming and releasing it.
+    if (link->cow)
+    {
+        ss->cow_lock.lock();
+        claim_last_shared_pages(ss, link->cow);
+    }
+
+    memory_v1::virtmem_desc virt;
+    virt.start_addr = s->base;
+    virt.n_pages = s->size >> PAGE_WIDTH;
+    virt.page_width = PAGE_WIDTH;
+    virt.attr = memory_v1::attrs_regular;
+    ss->mmu->free_range(virt);
+
+    if (link->cow)
+    {
+        release_cow_stretch(ss, link->cow);
+        ss->cow_lock.unlock();
+    }
+    else
+        ss->frames->free(link->phys, s->size);
+    vm_free(ss, s->base, s->size);
+    free_sid(ss, s->sid);
+
+    link->remove();
+    slab_delete<stretch_list_t>(ss->links_cache, link);
+    s->~state_t();
+    ss->heap->free(reinterpret_cast<memory_v1::address>(s));
 }
 
 static void stretch_allocator_v1_nailed_destroy_stretch(stretch_allocator_v1::closure_t* self, stretch_v1::closure_t* stretch)
 {
-    kconsole << __FUNCTION__ << endl;
+    logger::debug() << __FUNCTION__ << ": stretch at " << stretch;
+    auto state = reinterpret_cast<system_stretch_allocator_v1::state_t*>(self->d_state);
 
+    //TODO: need locking here! at least lightweight
+    stretch_list_t* link = find_stretch_link(state, stretch);
+    if (!link)
+    {
+        kconsole << __FUNCTION__ << ": stretch " << stretch << " was not allocated here!" << endl;
+        return;
+    }
+
+    destroy_nailed_stretch(state->shared_state, link);
 }
 
 static void stretch_allocator_v1_nailed_destroy(stretch_allocator_v1::closure_t* self)
 {
     kconsole << __FUNCTION__ << endl;
+    auto state = reinterpret_cast<system_stretch_allocator_v1::state_t*>(self->d_state);
 
+    while (!state->stretches.is_empty())
+        destroy_nailed_stretch(state->shared_state, *state->stretches.next());
+}
+
+/**
+ * The clone shares frames of the template page by page. Pages the template still maps from its image are
+ * mapped read-only in both, pages the template already copied and pages past its end get private frames,
+ * filled from the template. Templates mapped with large pages cannot be shared by 4K pages and are copied.
+ */
+static stretch_v1::closure_t* stretch_allocator_v1_nailed_clone(stretch_allocator_v1::closure_t* self, stretch_v1::closure_t* template_stretch, memory_v1::size size)
+{
+    logger::debug() << __FUNCTION__ << ": template " << template_stretch << ", size " << size;
+    auto state = reinterpret_cast<system_stretch_allocator_v1::state_t*>(self->d_state);
+    server_state_t* ss = state->shared_state;
+
+    stretch_list_t* tlink = find_stretch_link(state, template_stretch);
+    if (!tlink || (!tlink->cow && (tlink->phys == NO_ADDRESS)))
+    {
+        kconsole << __FUNCTION__ << ": template is not a nailed stretch of this allocator" << endl;
+        return NULL;
+    }
+
+    stretch_v1::state_t* t = template_stretch->d_state;
+    size_t n_pages = size_in_whole_frames(size, PAGE_WIDTH);
+    size_t template_pages = t->size >> PAGE_WIDTH;
+
+    if (tlink->page_width != PAGE_WIDTH)
+    {
+        auto copy = stretch_allocator_v1_nailed_create(self, size, t->global_rights);
+        if (copy)
+            memutils::copy_memory(reinterpret_cast<void*>(copy->d_state->base), reinterpret_cast<const void*>(t->base), std::min(size, t->size));
+        return copy;
+    }
+
+    cow_stretch_t* tcow = tlink->cow ? tlink->cow : share_template(ss, tlink);
+    if (!tcow || (n_pages == 0))
+        return NULL;
+    cow_image_t* image = tcow->image;
+
+    memory_v1::virtmem_desc virt;
+    if (!vm_alloc(ss, n_pages << PAGE_WIDTH, ANY_ADDRESS, PAGE_WIDTH, &virt.start_addr, &virt.n_pages, &virt.page_width))
+    {
+        kconsole << __FUNCTION__ << ": Failed to get virtmem" << endl;
+        return NULL;
+    }
+
+    auto s = create_stretch(ss, virt.start_addr, n_pages, t->global_rights);
+    cow_stretch_t* cow = s ? create_cow_stretch(ss, &s->closure, image, n_pages) : NULL;
+    if (!cow)
+    {
+        kconsole << __FUNCTION__ << ": Failed to create_stretch" << endl;
+        vm_free(ss, virt.start_addr, n_pages << PAGE_WIDTH);
+        nucleus::debug_stop();
+        return NULL;
+    }
+    s->allocator = self;
+    ++image->users;
+
+    //TODO: need locking here! at least lightweight
+    stretch_list_t* link = new(ss->links_cache) stretch_list_t;
+    link->stretch = &s->closure;
+    link->cow = cow;
+    state->stretches.add_to_tail(*link);
+
+    set_default_rights(state, &s->closure);
+
+    memory_v1::virtmem_desc range;
+    range.page_width = PAGE_WIDTH;
+    range.attr = memory_v1::attrs_regular;
+    memory_v1::physmem_desc frames;
+    frames.frame_width = FRAME_WIDTH;
+
+    for (size_t page = 0; page < n_pages; )
+    {
+        size_t run = 0;
+        while ((page + run < n_pages) && tcow->is_shared(page + run) && (image->refs[page + run] < 0xffff))
+            ++run;
+
+        if (run > 0)
+        {
+            // The template may have been the last user of these pages and made them writable.
+            lockable_scope_lock_t lock(ss->cow_lock);
+            range.start_addr = t->base + (page << PAGE_WIDTH);
+            range.n_pages = run;
+            frames.start_addr = image->phys + (page << PAGE_WIDTH);
+            frames.n_frames = run;
+            ss->mmu->add_cow_range(template_stretch, range, frames, t->global_rights);
+            range.start_addr = s->base + (page << PAGE_WIDTH);
+            ss->mmu->add_cow_range(&s->closure, range, frames, t->global_rights);
+
+            for (size_t i = page; i < page + run; ++i)
+            {
+                ++image->refs[i];
+                cow->frames[i] = tcow->frames[i];
+            }
+            page += run;
+            continue;
+        }
+
+        frames.start_addr = ss->frames->allocate(PAGE_SIZE, FRAME_WIDTH);
+        if (frames.start_addr == NO_ADDRESS)
+        {
+            kconsole << __FUNCTION__ << ": Failed to get physmem" << endl;
+            destroy_nailed_stretch(ss, link);
+            return NULL;
+        }
+        frames.n_frames = 1;
+        range.start_addr = s->base + (page << PAGE_WIDTH);
+        range.n_pages = 1;
+        ss->mmu->add_mapped_range(&s->closure, range, frames, t->global_rights);
+        cow->frames[page] = frames.start_addr;
+
+        if (page < template_pages)
+            memutils::copy_memory(reinterpret_cast<void*>(range.start_addr), reinterpret_cast<const void*>(t->base + (page << PAGE_WIDTH)), PAGE_SIZE);
+        ++page;
+    }
+
+    logger::debug() << __FUNCTION__ << ": returning stretch at " << &s->closure;
+    return &s->closure;
+}
+
+static fault_handler_v1::closure_t* stretch_allocator_v1_nailed_cow_handler(stretch_allocator_v1::closure_t* self)
+{
+    auto state = reinterpret_cast<system_stretch_allocator_v1::state_t*>(self->d_state);
+    return &state->shared_state->cow_closure;
 }
 
 static const stretch_allocator_v1::ops_t stretch_allocator_v1_nailed_methods =
@@ -435,7 +908,8 @@ static const stretch_allocator_v1::ops_t stretch_allocator_v1_nailed_methods =
     stretch_allocator_v1_nailed_create_at,
     stretch_allocator_v1_nailed_clone,
     stretch_allocator_v1_nailed_destroy_stretch,
-    stretch_allocator_v1_nailed_destroy
+    stretch_allocator_v1_nailed_destroy,
+    stretch_allocator_v1_nailed_cow_handler
 };
 
 //======================================================================================================================
@@ -456,7 +930,7 @@ system_stretch_allocator_v1_create_nailed(system_stretch_allocator_v1::closure_t
     memory_v1::address virt;
     size_t n_pages, page_width;
 
-    if (!vm_alloc(orig_state, SYSALLOC_VA_SIZE, SYSALLOC_VA_BASE, &virt, &n_pages, &page_width))
+    if (!vm_alloc(orig_state, SYSALLOC_VA_SIZE, SYSALLOC_VA_BASE, PAGE_WIDTH, &virt, &n_pages, &page_width))
     {
         kconsole << __FUNCTION__ << ": couldn't allocate system virtual memory region." << endl;
         nucleus::debug_stop();
@@ -471,19 +945,13 @@ system_stretch_allocator_v1_create_nailed(system_stretch_allocator_v1::closure_t
     shared_state->mmu = orig_state->mmu;
     shared_state->sids = orig_state->sids;
     shared_state->stretch_tab = orig_state->stretch_tab;
+    create_caches(shared_state);
 
-    kconsole << __FUNCTION__ << ": creating regions" << endl;
-    shared_state->regions = new(heap) virtual_address_space_region;
-    shared_state->regions->init();
+    kconsole << __FUNCTION__ << ": creating free space" << endl;
+    init_free_space(shared_state);
+    shared_state->free_space.free(virt >> PAGE_WIDTH, n_pages);
     shared_state->clients.init();
-
-    kconsole << __FUNCTION__ << ": creating first region" << endl;
-    auto first = new(heap) virtual_address_space_region;
-    first->desc.start_addr = virt;
-    first->desc.n_pages = n_pages;
-    first->desc.page_width = page_width;
-    first->desc.attr = memory_v1::attrs_regular;
-    shared_state->regions->add_to_head(*first);
+    init_cow_handler(shared_state);
 
     kconsole << __FUNCTION__ << ": creating client state" << endl;
     auto client_state = new(heap) system_stretch_allocator_v1::state_t;
@@ -519,24 +987,25 @@ system_stretch_allocator_v1_create_over(system_stretch_allocator_v1::closure_t*
 
     kconsole << __FUNCTION__ << ": start " << start << ", size " << size << endl;
 
-    if (!vm_alloc(state, size, start, &virtmem.start_addr, &virtmem.n_pages, &virtmem.page_width))
+    if (!vm_alloc(state, size, start, page_width, &virtmem.start_addr, &virtmem.n_pages, &virtmem.page_width))
     {
         /*
          * If we fail, we assume that the entire region is already allocated and that we are performing
          * a "map stretch over" type function.
          */
         virtmem.start_addr = page_align_down(start);
-        virtmem.n_pages = size_in_whole_pages(size);
+        virtmem.n_pages = size_in_whole_frames(size, page_width);
         virtmem.page_width = page_width;
         update = true;
     }
 
-    auto s = create_stretch(state, virtmem.start_addr, virtmem.n_pages);
+    auto s = create_stretch(state, virtmem.start_addr, virtmem.n_pages << (virtmem.page_width - PAGE_WIDTH), global_rights);
 
     if (!s)
     {
         kconsole << __FUNCTION__ << ": create_stretch failed!" << endl;
-        // if (!update) vm_free();
+        if (!update)
+            vm_free(state, virtmem.start_addr, virtmem.n_pages << virtmem.page_width);
         nucleus::debug_stop();
         return 0;
     }
@@ -554,7 +1023,7 @@ system_stretch_allocator_v1_create_over(system_stretch_allocator_v1::closure_t*
 
     //TODO: need locking here! at least lightweight
     //lock();
-    stretch_list_t* link = new(state->heap) stretch_list_t;
+    stretch_list_t* link = new(state->links_cache) stretch_list_t;
     link->stretch = &s->closure;
     self->d_state->stretches.add_to_tail(*link);
     //unlock();
@@ -572,6 +1041,7 @@ static const system_stretch_allocator_v1::ops_t system_stretch_allocator_v1_meth
     NULL,
     NULL,
     NULL,
+    NULL,
     system_stretch_allocator_v1_create_nailed,
     system_stretch_allocator_v1_create_over
 };
@@ -591,14 +1061,10 @@ stretch_allocator_module_v1_create(stretch_allocator_module_v1::closure_t* self,
     shared_state->mmu = mmu;
     shared_state->frames = NULL;
     shared_state->clients.init();
-    shared_state->regions = new(heap) virtual_address_space_region;
-
-    auto region = new(heap) virtual_address_space_region;
-    region->desc.start_addr = 0;
-    region->desc.n_pages = 0x100000; // 4GiB address space.
-    region->desc.page_width = PAGE_WIDTH;
-    region->desc.attr = memory_v1::attrs_regular;
-    shared_state->regions->add_to_tail(*region);
+    create_caches(shared_state);
+    init_free_space(shared_state);
+    shared_state->free_space.free(0, 0x100000); // 4GiB address space.
+    init_cow_handler(shared_state);
 
     // by this point allocated memory contains
     // @0x1000 PIP, 1 page
@@ -621,7 +1087,7 @@ stretch_allocator_module_v1_create(stretch_allocator_module_v1::closure_t* self,
         memory_v1::address virt;
         size_t n_pages, page_width;
 
-        if (!vm_alloc(shared_state, e->size(), e->start(), &virt, &n_pages, &page_width))
+        if (!vm_alloc(shared_state, e->size(), e->start(), PAGE_WIDTH, &virt, &n_pages, &page_width))
         {
             kconsole << __FUNCTION__ << ": cannot allocate already used VM region. FAIL!" << endl;
             nucleus::debug_stop();
@@ -0,0 +1,413 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+
+struct va_extent_t;
+
+/**
+ * AVL tree links of a free extent.
+ */
+struct va_tree_link_t
+{
+    va_extent_t* left;
+    va_extent_t* right;
+    int          height;
+
+    va_tree_link_t() : left(0), right(0), height(1) {}
+};
+
+/**
+ * Free range of virtual address space, in pages.
+ * Pages rather than addresses are kept so the extent ending at 4GiB does not overflow.
+ */
+struct va_extent_t
+{
+    va_tree_link_t by_start; //!< Links in the address ordered tree.
+    va_tree_link_t by_size;  //!< Links in the size ordered tree.
+    size_t         start_page;
+    size_t         n_pages;
+
+    va_extent_t() : start_page(0), n_pages(0) {}
+
+    size_t end_page() const { return start_page + n_pages; }
+};
+
+/**
+ * Intrusive AVL tree of extents, using @a Link members and ordered by @a Less.
+ * Keys must be unique, extents are found by walking down from the root, there are no parent links.
+ */
+template <va_tree_link_t va_extent_t::*Link, bool (*Less)(const va_extent_t*, const va_extent_t*)>
+class va_index_t
+{
+public:
+    va_index_t() : root(0) {}
+
+    va_extent_t* top() const { return root; }
+
+    void insert(va_extent_t* e)
+    {
+        links(e) = va_tree_link_t();
+        root = insert(root, e);
+    }
+
+    void remove(va_extent_t* e)
+    {
+        root = remove(root, e);
+    }
+
+    static va_extent_t* left(va_extent_t* e)  { return links(e).left; }
+    static va_extent_t* right(va_extent_t* e) { return links(e).right; }
+
+private:
+    static va_tree_link_t& links(va_extent_t* e) { return e->*Link; }
+
+    static int height(va_extent_t* e) { return e ? links(e).height : 0; }
+
+    static void update(va_extent_t* e)
+    {
+        int l = height(left(e)), r = height(right(e));
+        links(e).height = 1 + ((l > r) ? l : r);
+    }
+
+    static va_extent_t* rotate_right(va_extent_t* e)
+    {
+        va_extent_t* l = left(e);
+        links(e).left = right(l);
+        links(l).right = e;
+        update(e);
+        update(l);
+        return l;
+    }
+
+    static va_extent_t* rotate_left(va_extent_t* e)
+    {
+        va_extent_t* r = right(e);
+        links(e).right = left(r);
+        links(r).left = e;
+        update(e);
+        update(r);
+        return r;
+    }
+
+    static va_extent_t* balance(va_extent_t* e)
+    {
+        update(e);
+        int skew = height(left(e)) - height(right(e));
+        if (skew > 1)
+        {
+            if (height(left(left(e))) < height(right(left(e))))
+                links(e).left = rotate_left(left(e));
+            return rotate_right(e);
+        }
+        if (skew < -1)
+        {
+            if (height(right(right(e))) < height(left(right(e))))
+                links(e).right = rotate_right(right(e));
+            return rotate_left(e);
+        }
+        return e;
+    }
+
+    static va_extent_t* insert(va_extent_t* node, va_extent_t* e)
+    {
+        if (!node)
+            return e;
+        if (Less(e, node))
+            links(node).left = insert(left(node), e);
+        else
+            links(node).right = insert(right(node), e);
+        return balance(node);
+    }
+
+    static va_extent_t* remove_min(va_extent_t* node, va_extent_t** min)
+    {
+        if (!left(node))
+        {
+            *min = node;
+            return right(node);
+        }
+        links(node).left = remove_min(left(node), min);
+        return balance(node);
+    }
+
+    static va_extent_t* remove(va_extent_t* node, va_extent_t* e)
+    {
+        if (!node)
+            return 0;
+        if (Less(e, node))
+            links(node).left = remove(left(node), e);
+        else if (Less(node, e))
+            links(node).right = remove(right(node), e);
+        else
+        {
+            if (!right(node))
+                return left(node);
+            va_extent_t* successor;
+            va_extent_t* rest = remove_min(right(node), &successor);
+            links(successor).left = left(node);
+            links(successor).right = rest;
+            return balance(successor);
+        }
+        return balance(node);
+    }
+
+    va_extent_t* root;
+};
+
+inline bool va_start_less(const va_extent_t* a, const va_extent_t* b)
+{
+    return a->start_page < b->start_page;
+}
+
+inline bool va_size_less(const va_extent_t* a, const va_extent_t* b)
+{
+    return (a->n_pages < b->n_pages) || ((a->n_pages == b->n_pages) && (a->start_page < b->start_page));
+}
+
+/**
+ * Free virtual address space of a stretch allocator.
+ *
+ * Every free extent is kept in two balanced trees: by start page for fixed address allocation and for
+ * finding neighbours to coalesce with on free, and by (size, start page) for best fit allocation.
+ * Allocation, fixed address allocation and free take O(log n) in the number of free extents.
+ *
+ * Extent records come from @a Allocator, which provides new_extent() and delete_extent().
+ */
+template <class Allocator>
+class va_space_t
+{
+public:
+    void init(Allocator a)
+    {
+        allocator = a;
+        by_start = start_index_t();
+        by_size = size_index_t();
+    }
+
+    /**
+     * Allocate @a n_pages pages starting at a multiple of @a align pages.
+     * Takes the smallest free extent which fits the request, or if alignment padding makes it
+     * too short, the smallest one guaranteed to fit with any padding.
+     */
+    bool allocate(size_t n_pages, size_t align, size_t* start_page)
+    {
+        if (n_pages == 0 || align == 0)
+            return false;
+
+        va_extent_t* e = smallest_fitting(n_pages);
+        if (e && (aligned_start(e, align) + n_pages > e->end_page()))
+            e = smallest_fitting(n_pages + align - 1);
+        if (!e)
+            return false;
+
+        *start_page = aligned_start(e, align);
+        return carve(e, *start_page, n_pages);
+    }
+
+    /**
+     * Allocate pages [@a start_page, @a start_page + @a n_pages), they must all be free.
+     */
+    bool allocate_at(size_t start_page, size_t n_pages)
+    {
+        if (n_pages == 0)
+            return false;
+
+        va_extent_t* e = floor(start_page);
+        if (!e || (start_page + n_pages > e->end_page()))
+            return false;
+
+        return carve(e, start_page, n_pages);
+    }
+
+    /**
+     * Return pages to the free space, merging them with adjacent free extents.
+     * @return false if the pages overlap free space or no extent record is available.
+     */
+    bool free(size_t start_page, size_t n_pages)
+    {
+        if (n_pages == 0)
+            return true;
+
+        va_extent_t* prev = floor(start_page);
+        va_extent_t* next = ceiling(start_page);
+
+        if (prev && (prev->end_page() > start_page))
+            return false;
+        if (next && (start_page + n_pages > next->start_page))
+            return false;
+
+        bool join_prev = prev && (prev->end_page() == start_page);
+        bool join_next = next && (start_page + n_pages == next->start_page);
+
+        if (join_prev && join_next)
+        {
+            // Pages fill the hole between two extents, the one after goes away.
+            by_size.remove(prev);
+            by_size.remove(next);
+            by_start.remove(next);
+            prev->n_pages += n_pages + next->n_pages;
+            by_size.insert(prev);
+            allocator.delete_extent(next);
+        }
+        else if (join_prev)
+        {
+            by_size.remove(prev);
+            prev->n_pages += n_pages;
+            by_size.insert(prev);
+        }
+        else if (join_next)
+        {
+            // Moving the start down keeps address order, nothing lies between.
+            by_size.remove(next);
+            next->start_page = start_page;
+            next->n_pages += n_pages;
+            by_size.insert(next);
+        }
+        else
+        {
+            va_extent_t* e = allocator.new_extent();
+            if (!e)
+                return false;
+            e->start_page = start_page;
+            e->n_pages = n_pages;
+            by_start.insert(e);
+            by_size.insert(e);
+        }
+        return true;
+    }
+
+    /**
+     * Largest free extent, in pages.
+     */
+    size_t largest_free() const
+    {
+        va_extent_t* e = by_size.top();
+        if (!e)
+            return 0;
+        while (size_index_t::right(e))
+            e = size_index_t::right(e);
+        return e->n_pages;
+    }
+
+private:
+    typedef va_index_t<&va_extent_t::by_start, va_start_less> start_index_t;
+    typedef va_index_t<&va_extent_t::by_size, va_size_less> size_index_t;
+
+    static size_t aligned_start(va_extent_t* e, size_t align)
+    {
+        return (e->start_page + align - 1) / align * align;
+    }
+
+    /**
+     * Extent with the highest start page not above @a page.
+     */
+    va_extent_t* floor(size_t page) const
+    {
+        va_extent_t* found = 0;
+        for (va_extent_t* e = by_start.top(); e; )
+        {
+            if (e->start_page <= page)
+            {
+                found = e;
+                e = start_index_t::right(e);
+            }
+            else
+                e = start_index_t::left(e);
+        }
+        return found;
+    }
+
+    /**
+     * Extent with the lowest start page above @a page.
+     */
+    va_extent_t* ceiling(size_t page) const
+    {
+        va_extent_t* found = 0;
+        for (va_extent_t* e = by_start.top(); e; )
+        {
+            if (e->start_page > page)
+            {
+                found = e;
+                e = start_index_t::left(e);
+            }
+            else
+                e = start_index_t::right(e);
+        }
+        return found;
+    }
+
+    /**
+     * Smallest extent of at least @a n_pages pages, the lowest one among equally sized.
+     */
+    va_extent_t* smallest_fitting(size_t n_pages) const
+    {
+        va_extent_t* found = 0;
+        for (va_extent_t* e = by_size.top(); e; )
+        {
+            if (e->n_pages >= n_pages)
+            {
+                found = e;
+                e = size_index_t::left(e);
+            }
+            else
+                e = size_index_t::right(e);
+        }
+        return found;
+    }
+
+    /**
+     * Take pages [@a start_page, @a start_page + @a n_pages) out of extent @a e which contains them.
+     */
+    bool carve(va_extent_t* e, size_t start_page, size_t n_pages)
+    {
+        size_t head = start_page - e->start_page;
+        size_t tail = e->end_page() - (start_page + n_pages);
+
+        va_extent_t* rest = 0;
+        if (head && tail)
+        {
+            rest = allocator.new_extent();
+            if (!rest)
+                return false;
+            rest->start_page = start_page + n_pages;
+            rest->n_pages = tail;
+        }
+
+        by_size.remove(e);
+
+        if (!head && !tail)
+        {
+            by_start.remove(e);
+            allocator.delete_extent(e);
+            return true;
+        }
+
+        if (head)
+            e->n_pages = head;
+        else
+        {
+            e->start_page = start_page + n_pages;
+            e->n_pages = tail;
+        }
+        by_size.insert(e);
+
+        if (rest)
+        {
+            by_start.insert(rest);
+            by_size.insert(rest);
+        }
+        return true;
+    }
+
+    Allocator     allocator;
+    start_index_t by_start;
+    size_index_t  by_size;
+};
@@ -12,10 +12,12 @@
 #include "stretch_driver_v1_impl.h"
 #include "stretch_table_v1_interface.h"
 #include "stretch_v1_interface.h"
+#include "fault_handler_v1_interface.h"
 #include "default_console.h"
 #include "heap_new.h"
 #include "nucleus.h"
 #include "ia32.h"
+#include "memory.h"
 
 //======================================================================================================================
 // stretch_driver_module_v1 methods
@@ -52,15 +54,14 @@ void null_bind(stretch_driver_v1::closure_t* self, stretch_v1::closure_t* stretc
     }
     else if (page_width > PAGE_WIDTH)
     {
-        // Check size is a multiple of the page width.
+        // Large pages can only be used if both base and size are multiples of the page width.
         memory_v1::address base;
         memory_v1::size size;
         base = stretch->info(&size);
-        UNUSED(base);
-        if (size & ((1UL << page_width) - 1))
+        if (!is_aligned_to_frame_width(base, page_width) || !is_aligned_to_frame_width(size, page_width))
         {
-            kconsole << "Not properly aligned size " << size << endl;
-            nucleus::debug_stop();
+            kconsole << __FUNCTION__ << ": warning - stretch [" << base << ".." << base + size << ") not aligned to page_width " << page_width << ", using " << PAGE_WIDTH << endl;
+            page_width = PAGE_WIDTH;
         }
     }
 
@@ -98,8 +99,21 @@ stretch_driver_v1::result null_map(stretch_driver_v1::closure_t* self, stretch_v
     return stretch_driver_v1::result_success;
 }
 
+/**
+ * Faults with a handler added for their reason go to it (e.g. copy-on-write faults of cloned stretches),
+ * null driver cannot resolve any other.
+ */
 stretch_driver_v1::result null_fault(stretch_driver_v1::closure_t* self, stretch_v1::closure_t* stretch, memory_v1::address virt, memory_v1::fault reason)
 {
+    null_driver_state_t* state = reinterpret_cast<null_driver_state_t*>(self->d_state);
+    if ((reason < memory_v1::fault_max_fault_number) && state->overrides[reason])
+    {
+        if (state->overrides[reason]->handle(stretch, virt, reason))
+            return stretch_driver_v1::result_success;
+        kconsole << __FUNCTION__ << ": handler failed on " << virt << ", fault reason " << reason << endl;
+        return stretch_driver_v1::result_failure;
+    }
+
     kconsole << __FUNCTION__ << ": fault handling not supported!" << endl;
     kconsole << __FUNCTION__ << ": fault reason " << reason << endl;
     nucleus::debug_stop();
@@ -131,9 +145,12 @@ stretch_driver_v1::result null_unlock(stretch_driver_v1::closure_t* self, stretc
     return stretch_driver_v1::result_failure;
 }
 
+/**
+ * Null driver never maps frames on faults, so it holds no optimistic frames to give back.
+ */
 memory_v1::size null_revoke_frames(stretch_driver_v1::closure_t* self, memory_v1::size max_frames)
 {
-    kconsole << __FUNCTION__ << ": revoking frames not supported!" << endl;
+    kconsole << __FUNCTION__ << ": null driver holds no frames to revoke" << endl;
     return 0;
 }
 
@@ -41,6 +41,24 @@ namespace nucleus
         return 0;
     }
 
+    /**
+     * Drop all non-global TLB entries, after mappings were removed or restricted.
+     * With @a global set, translations of global pages are dropped too.
+     */
+    inline void flush_tlb(bool global = false)
+    {
+        asm volatile ("int $99" :: "a"(4), "b"(global));
+    }
+
+    /**
+     * Drop TLB entries of @a count pages at the virtual addresses in @a pages, global ones included.
+     * The nucleus flushes the whole TLB instead if the list is too long or not a valid array.
+     */
+    inline void flush_tlb_pages(const address_t* pages, size_t count)
+    {
+        asm volatile ("int $99" :: "a"(5), "b"(pages), "c"(count) : "memory");
+    }
+
     inline void debug_stop()
     {
         debugger_t::breakpoint();
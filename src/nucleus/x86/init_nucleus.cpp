@@ -19,6 +19,18 @@
 #include "panic.h"
 #include "mmu.h"
 
+#define FLUSH_PAGES_MAX 64 /* Longer page lists for syscall 5 flush the whole TLB instead */
+
+/**
+ * Check that @a count addresses at @a pages form a sane list, so that syscall 5 reads nothing
+ * outside of it.
+ */
+static bool valid_page_list(address_t pages, size_t count)
+{
+    return (pages != 0) && ((pages & (sizeof(address_t) - 1)) == 0) && (count <= FLUSH_PAGES_MAX)
+        && (pages + count * sizeof(address_t) > pages);
+}
+
 static void dump_regs(registers_t* regs)
 {
     kconsole << endl << RED 
@@ -98,6 +110,24 @@ public:
             interrupt_descriptor_table().set_irq_handler(regs->ebx, reinterpret_cast<interrupt_service_routine_t*>(regs->ecx));
         }
         else
+        if (regs->eax == 4)
+        {
+            ia32_mmu_t::flush_page_directory(regs->ebx != 0);
+        }
+        else
+        if (regs->eax == 5)
+        {
+            if (!valid_page_list(regs->ebx, regs->ecx))
+            {
+                // Pages may be global, so drop those too.
+                ia32_mmu_t::flush_page_directory(true);
+                return;
+            }
+            const address_t* pages = reinterpret_cast<const address_t*>(regs->ebx);
+            for (size_t i = 0; i < regs->ecx; ++i)
+                ia32_mmu_t::flush_page_directory_entry(pages[i]);
+        }
+        else
         {
             kconsole << "unknown syscall " << regs->eax << endl;            
         }
@@ -3,6 +3,7 @@
 
 #include <unordered_map>
 #include "heap_allocator.h"
+#include "slab_allocator.h"
 
 #define DECLARE_MAP(name, _keyt, _valuet) \
 typedef _keyt key_type; \
@@ -12,3 +13,11 @@ typedef std::heap_allocator<pair_type> name##_heap_allocator; \
 typedef std::unordered_map<key_type, value_type, std::hash<key_type>, std::equal_to<key_type>, name##_heap_allocator> name##_t
 
 // Usage: DECLARE_MAP(card64_table, card64_t, address_t);
+
+// Same, but map nodes come from slab caches. Construct the table with name##_slab_allocator(heap).
+#define DECLARE_SLAB_MAP(name, _keyt, _valuet) \
+typedef _keyt key_type; \
+typedef _valuet value_type; \
+typedef std::pair<key_type, value_type> pair_type; \
+typedef std::slab_allocator<pair_type> name##_slab_allocator; \
+typedef std::unordered_map<key_type, value_type, std::hash<key_type>, std::equal_to<key_type>, name##_slab_allocator> name##_t
@@ -9,14 +9,157 @@
 #pragma once
 
 #include "types.h"
+#include "cpu_flags.h"
+#include <cpuid.h>
 
 /**
  * @brief Memory utilities similar to standard libc operations.
- * @todo Quite unoptimized at the moment, memory ops should be significantly slow.
- * Easy optimization would be __builtin_memcpy() and friends.
+ * Bulk copies and fills use rep movsb/stosb on CPUs that advertise ERMS or FSRM, elsewhere they run as
+ * word-sized string instructions with byte-sized head and tail. Compares and string scans read a word at a time.
  */
 namespace memutils {
 
+namespace internal {
+
+// Below this size the word-wide setup costs more than byte-wise string instructions.
+const size_t WORD_THRESHOLD = 4 * sizeof(address_t);
+
+const address_t WORD_MASK = sizeof(address_t) - 1;
+const address_t ONES = ~address_t(0) / 0xff;  // 0x0101...01
+const address_t HIGHS = ONES << 7;            // 0x8080...80
+
+// Words read from arbitrary byte buffers.
+typedef address_t __attribute__((__may_alias__)) word_t;
+
+/**
+ * Classic has-zero-byte test: nonzero iff some byte of @a w is zero.
+ */
+inline address_t
+has_zero_byte(address_t w)
+{
+    return (w - ONES) & ~w & HIGHS;
+}
+
+// Bits of string_features().
+const uint32_t FAST_FILL      = 1 << 0;  // rep stosb beats the word path.
+const uint32_t FAST_COPY      = 1 << 1;  // rep movsb beats the word path.
+const uint32_t FEATURES_KNOWN = 1 << 2;  // CPUID has been asked.
+
+/**
+ * String instruction features of this CPU, zero until read_string_features() ran.
+ */
+inline uint32_t&
+string_features()
+{
+    static uint32_t features = 0; // Constant initialised, needs no guard.
+    return features;
+}
+
+/**
+ * Ask CPUID leaf 7 once and keep the answer. With ERMS rep movsb and rep stosb are at least as fast
+ * as the word path for any size, FSRM covers short copies on top. Racing callers store the same value.
+ */
+inline __attribute__((noinline)) uint32_t
+read_string_features()
+{
+    uint32_t eax, ebx = 0, ecx, edx = 0;
+    if (__get_cpuid_max(0, 0) >= 7)
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+    uint32_t features = FEATURES_KNOWN;
+    if (ebx & X86_32_FEAT7_ERMS)
+        features |= FAST_FILL | FAST_COPY;
+    if (edx & X86_32_FEAT7D_FSRM)
+        features |= FAST_COPY;
+
+    string_features() = features;
+    return features;
+}
+
+/**
+ * Check if rep movsb (@a copy) or rep stosb are at least as fast as the word path for any size.
+ */
+inline bool
+fast_byte_strings(bool copy)
+{
+    uint32_t features = string_features();
+    if (!features)
+        features = read_string_features();
+    return features & (copy ? FAST_COPY : FAST_FILL);
+}
+
+inline void
+copy_bytes(void*& dest, const void*& src, size_t count)
+{
+    asm volatile ("cld; rep movsb" : "+c"(count), "+S"(src), "+D"(dest) :: "memory");
+}
+
+inline void
+copy_words(void*& dest, const void*& src, size_t count)
+{
+#if defined(__x86_64__)
+    asm volatile ("cld; rep movsq" : "+c"(count), "+S"(src), "+D"(dest) :: "memory");
+#else
+    asm volatile ("cld; rep movsl" : "+c"(count), "+S"(src), "+D"(dest) :: "memory");
+#endif
+}
+
+inline void
+fill_bytes(void*& dest, address_t pattern, size_t count)
+{
+    asm volatile ("cld; rep stosb" : "+c"(count), "+D"(dest) : "a"(pattern) : "memory");
+}
+
+inline void
+fill_words(void*& dest, address_t pattern, size_t count)
+{
+#if defined(__x86_64__)
+    asm volatile ("cld; rep stosq" : "+c"(count), "+D"(dest) : "a"(pattern) : "memory");
+#else
+    asm volatile ("cld; rep stosl" : "+c"(count), "+D"(dest) : "a"(pattern) : "memory");
+#endif
+}
+
+/**
+ * Word path of fill_memory() for at least WORD_THRESHOLD bytes.
+ * Unaligned first and last words cover the ragged ends, a single rep stos does the aligned rest.
+ */
+inline void*
+fill_memory_words(void* dest, int value, size_t count)
+{
+    address_t pattern = (value & 0xff) * ONES;
+    char* d = reinterpret_cast<char*>(dest);
+    *reinterpret_cast<word_t*>(d) = pattern;
+    *reinterpret_cast<word_t*>(d + count - sizeof(address_t)) = pattern;
+
+    size_t head = sizeof(address_t) - (reinterpret_cast<address_t>(d) & WORD_MASK);
+    void* aligned = d + head;
+    fill_words(aligned, pattern, (count - head) / sizeof(address_t));
+    return dest;
+}
+
+/**
+ * Word path of copy_memory() for at least WORD_THRESHOLD bytes.
+ * Unaligned first and last words cover the ragged ends, a single rep movs does the aligned rest.
+ * The last word is stored before the middle is read, so the areas must not overlap.
+ */
+inline void*
+copy_memory_words(void* dest, const void* src, size_t count)
+{
+    char* d = reinterpret_cast<char*>(dest);
+    const char* s = reinterpret_cast<const char*>(src);
+    *reinterpret_cast<word_t*>(d) = *reinterpret_cast<const word_t*>(s);
+    *reinterpret_cast<word_t*>(d + count - sizeof(address_t)) = *reinterpret_cast<const word_t*>(s + count - sizeof(address_t));
+
+    size_t head = sizeof(address_t) - (reinterpret_cast<address_t>(d) & WORD_MASK);
+    void* aligned = d + head;
+    const void* from = s + head;
+    copy_words(aligned, from, (count - head) / sizeof(address_t));
+    return dest;
+}
+
+} // namespace internal
+
 /**
  * Fill a region of memory with the given value.
  * @param[out] dest  Pointer to the start of the area.
@@ -29,8 +172,15 @@ namespace memutils {
 inline void*
 fill_memory(void* dest, int value, size_t count)
 {
-    asm volatile ("cld; rep stosb" :: "c"(count), "a"(value), "D"(dest) : "memory");
-    return dest;
+    using namespace internal;
+
+    if ((count < WORD_THRESHOLD) || fast_byte_strings(false))
+    {
+        void* d = dest;
+        fill_bytes(d, (value & 0xff) * ONES, count);
+        return dest;
+    }
+    return fill_memory_words(dest, value, count);
 }
 
 /**
@@ -55,14 +205,24 @@ clear_memory(void* dest, size_t count)
  * @param[in]  count The size of the area.
  * @return           Pointer to the start of the destination area.
  *
+ * Without fast byte strings, stores are word-aligned, loads are aligned too when both areas share their misalignment.
+ * The areas must not overlap, use move_memory() for that.
+ *
  * @warning You should not use this function to access IO space, use copy_memory_to_io()
  * or copy_memory_from_io() instead.
  */
 inline void*
 copy_memory(void* dest, const void* src, size_t count)
 {
-    asm volatile ("cld; rep movsb" :: "c"(count), "S"(src), "D"(dest) : "memory");
-    return dest;
+    using namespace internal;
+
+    if ((count < WORD_THRESHOLD) || fast_byte_strings(true))
+    {
+        void* d = dest;
+        copy_bytes(d, src, count);
+        return dest;
+    }
+    return copy_memory_words(dest, src, count);
 }
 
 inline address_t
@@ -78,20 +238,25 @@ copy_memory(address_t dest, address_t src, size_t count)
  * @param[in]  count The size of the area.
  * @return           Pointer to the start of the destination area.
  *
- * Unlike copy_memory(), this function copes with overlapping areas.
+ * Unlike copy_memory(), this function copes with overlapping areas. Those are copied byte by byte,
+ * forwards if @a dest is below @a src and backwards otherwise, the word path would clobber unread source bytes.
  */
 inline void*
 move_memory(void* dest, const void* src, size_t count)
 {
-    char *tmp;
-    const char *s;
+    const char* s = reinterpret_cast<const char*>(src);
+    char* d = reinterpret_cast<char*>(dest);
 
-    if (dest <= src) {
+    if ((s + count <= d) || (d + count <= s)) {
         copy_memory(dest, src, count);
-    } else {
-        tmp = reinterpret_cast<char*>(dest) + count;
-        s = reinterpret_cast<const char*>(src) + count;
-        asm volatile ("std; rep movsb" :: "c"(count), "S"(s), "D"(tmp) : "memory");
+    } else if (d < s) {
+        void* to = dest;
+        internal::copy_bytes(to, src, count);
+    } else if (d > s) {
+        // Copy backwards, starting from the last byte. Direction flag must be clear again on exit.
+        char* tmp = d + count - 1;
+        s += count - 1;
+        asm volatile ("std; rep movsb; cld" : "+c"(count), "+S"(s), "+D"(tmp) :: "memory");
     }
     return dest;
 }
@@ -106,9 +271,18 @@ move_memory(void* dest, const void* src, size_t count)
 inline bool
 is_memory_equal(const void* left, const void* right, size_t count)
 {
+    using namespace internal;
+
     const char* ltmp = reinterpret_cast<const char*>(left);
     const char* rtmp = reinterpret_cast<const char*>(right);
 
+    for (; count >= sizeof(address_t); count -= sizeof(address_t))
+    {
+        if (*reinterpret_cast<const word_t*>(ltmp) != *reinterpret_cast<const word_t*>(rtmp))
+            return false;
+        ltmp += sizeof(address_t);
+        rtmp += sizeof(address_t);
+    }
     while (count--)
         if (*ltmp++ != *rtmp++)
             return false;
@@ -125,11 +299,22 @@ is_memory_equal(const void* left, const void* right, size_t count)
 inline int
 memory_difference(const void* left, const void* right, size_t count)
 {
+    using namespace internal;
+
     signed char __res;
 
     const char* ltmp = reinterpret_cast<const char*>(left);
     const char* rtmp = reinterpret_cast<const char*>(right);
 
+    // Skip the equal prefix a word at a time, the differing word is then resolved bytewise.
+    for (; count >= sizeof(address_t); count -= sizeof(address_t))
+    {
+        if (*reinterpret_cast<const word_t*>(ltmp) != *reinterpret_cast<const word_t*>(rtmp))
+            break;
+        ltmp += sizeof(address_t);
+        rtmp += sizeof(address_t);
+    }
+
     while (count--)
         if ((__res = *ltmp++ - *rtmp++) != 0)
             return __res;
@@ -142,10 +327,15 @@ memory_difference(const void* left, const void* right, size_t count)
  * @param[in] s1 One string
  * @param[in] s2 Another string
  * @return true if @c s1 equals @c s2, false if strings are different.
+ *
+ * Strings with the same alignment are compared a word at a time. Words are read aligned, so the scan
+ * never crosses into a page beyond the terminator.
  */
 inline bool
 is_string_equal(const char *s1, const char *s2)
 {
+    using namespace internal;
+
     signed char __res;
 
     if (!s1 && !s2)
@@ -153,6 +343,22 @@ is_string_equal(const char *s1, const char *s2)
     if (!s1 || !s2)
         return false;
 
+    if (((reinterpret_cast<address_t>(s1) ^ reinterpret_cast<address_t>(s2)) & WORD_MASK) == 0)
+    {
+        for (; reinterpret_cast<address_t>(s1) & WORD_MASK; ++s1, ++s2)
+            if (*s1 != *s2 || !*s1)
+                return *s1 == *s2;
+
+        for (;;)
+        {
+            address_t w = *reinterpret_cast<const word_t*>(s1);
+            if (w != *reinterpret_cast<const word_t*>(s2) || has_zero_byte(w))
+                break;
+            s1 += sizeof(address_t);
+            s2 += sizeof(address_t);
+        }
+    }
+
     while (1) {
         if ((__res = *s1 - *s2++) != 0 || !*s1++)
             break;
@@ -164,15 +370,28 @@ is_string_equal(const char *s1, const char *s2)
  * Return size of a null-terminated string.
  * @param[in] s  Null-terminated string.
  * @returns      String length in bytes.
+ *
+ * Scans aligned words, so the read never crosses into a page beyond the terminator.
  */
 inline size_t
 string_length(const char *s)
 {
-    size_t len = 0;
-    if (s)
-        while (*s++)
-            len++;
-    return len;
+    using namespace internal;
+
+    if (!s)
+        return 0;
+
+    const char* p = s;
+    for (; reinterpret_cast<address_t>(p) & WORD_MASK; ++p)
+        if (!*p)
+            return p - s;
+
+    while (!has_zero_byte(*reinterpret_cast<const word_t*>(p)))
+        p += sizeof(address_t);
+
+    while (*p)
+        ++p;
+    return p - s;
 }
 
 /**
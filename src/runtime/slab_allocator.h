@@ -0,0 +1,125 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <memory>
+#include "infopage.h"
+#include "heap_v1_interface.h"
+#include "slab_factory_v1_interface.h"
+#include "slab_cache_v1_interface.h"
+#include "heap_new.h"
+#include "logger.h"
+
+/**
+ * Object caches shared by all slab_allocators of a module, one per heap and object size.
+ * Tables built on the same heap share slabs instead of each keeping page-sized slabs for a handful of nodes,
+ * and objects freed by a table that goes away are reused by the next one.
+ * A size whose cache could not be created stays with the heap for good, so objects are always freed
+ * where they came from.
+ */
+struct slab_allocator_caches_t
+{
+    static const size_t MAX_CACHES = 8;
+
+    struct entry_t
+    {
+        heap_v1::closure_t*       heap;
+        size_t                    size;
+        slab_cache_v1::closure_t* cache;
+    };
+
+    entry_t entries[MAX_CACHES];
+
+    /**
+     * @return cache for objects of @a size from @a heap, or null if allocations of this size should go to the heap.
+     */
+    slab_cache_v1::closure_t* cache_for(heap_v1::closure_t* heap, size_t size, bool create)
+    {
+        for (size_t i = 0; i < MAX_CACHES; ++i)
+        {
+            if ((entries[i].heap == heap) && (entries[i].size == size))
+                return entries[i].cache;
+            if (!entries[i].heap)
+            {
+                if (!create)
+                    return 0;
+                entries[i].cache = PVS(slab_factory) ? PVS(slab_factory)->create(size, sizeof(void*), heap, NULL) : 0;
+                entries[i].size = size;
+                entries[i].heap = heap;
+                return entries[i].cache;
+            }
+        }
+        return 0;
+    }
+
+    static slab_allocator_caches_t& shared()
+    {
+        static slab_allocator_caches_t caches; // Zero-initialised, needs no construction.
+        return caches;
+    }
+};
+
+namespace std {// @todo: remove std, since it's a custom allocator?
+
+/**
+ * Allocator for node-based containers: single objects (list and hash nodes) come from slab caches,
+ * arrays (hash buckets) and everything else from the heap.
+ */
+template <class T>
+class slab_allocator : public std::allocator<T>
+{
+    typedef heap_v1::closure_t* state_type;
+    state_type heap;
+public:
+    inline state_type get_state() const { return heap; } // accessor for rebind copy ctor
+
+    typedef size_t                                size_type;
+    typedef ptrdiff_t                             difference_type;
+    typedef T*                                    pointer;
+    typedef const T*                              const_pointer;
+    typedef T                                     value_type;
+
+    template <class U> struct rebind {typedef slab_allocator<U> other;};
+
+    explicit slab_allocator(heap_v1::closure_t* h) throw()
+        : heap(h)
+    {
+        logger::trace() << "constructing slab_allocator at " << this << " with heap " << h;
+    }
+
+    slab_allocator(const slab_allocator& other) throw()
+        : heap(other.get_state())
+    {
+    }
+
+    template <class U>
+    slab_allocator(const slab_allocator<U>& other) throw()
+        : heap(other.get_state())
+    {
+    }
+
+    pointer allocate(size_type __n, std::allocator<void>::const_pointer hint = 0)
+    {
+        slab_cache_v1::closure_t* cache = (__n == 1) ? slab_allocator_caches_t::shared().cache_for(heap, sizeof(T), true) : 0;
+        if (cache)
+            return reinterpret_cast<pointer>(cache->allocate());
+        return reinterpret_cast<pointer>(heap->allocate(__n * sizeof(T)));
+    }
+
+    void deallocate(pointer p, size_type __n) throw()
+    {
+        slab_cache_v1::closure_t* cache = (__n == 1) ? slab_allocator_caches_t::shared().cache_for(heap, sizeof(T), false) : 0;
+        if (cache)
+            cache->free(reinterpret_cast<memory_v1::address>(p));
+        else
+            heap->free(reinterpret_cast<memory_v1::address>(p));
+    }
+};
+
+} // namespace std
@@ -0,0 +1,238 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Host benchmark of memutils primitives against the previous bytewise versions.
+// Old string loops must not be turned into libc calls by the compiler, hence -fno-builtin in CMakeLists.txt.
+//
+// Copies and fills are timed as dispatched by memutils (new), forced to the word path (words) and as
+// the old byte string versions. On CPUs with ERMS/FSRM new should match old, that is where memutils
+// switches to rep movsb/stosb.
+//
+#include "memutils.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <cpuid.h>
+#include "cpu_flags.h"
+
+namespace old {
+
+inline void* fill_memory(void* dest, int value, size_t count)
+{
+    asm volatile ("cld; rep stosb" : "+c"(count), "+D"(dest) : "a"(value) : "memory");
+    return dest;
+}
+
+inline void* copy_memory(void* dest, const void* src, size_t count)
+{
+    asm volatile ("cld; rep movsb" : "+c"(count), "+S"(src), "+D"(dest) : : "memory");
+    return dest;
+}
+
+inline bool is_memory_equal(const void* left, const void* right, size_t count)
+{
+    const char* ltmp = reinterpret_cast<const char*>(left);
+    const char* rtmp = reinterpret_cast<const char*>(right);
+
+    while (count--)
+        if (*ltmp++ != *rtmp++)
+            return false;
+    return true;
+}
+
+inline int memory_difference(const void* left, const void* right, size_t count)
+{
+    signed char __res;
+
+    const char* ltmp = reinterpret_cast<const char*>(left);
+    const char* rtmp = reinterpret_cast<const char*>(right);
+
+    while (count--)
+        if ((__res = *ltmp++ - *rtmp++) != 0)
+            return __res;
+
+    return 0;
+}
+
+inline bool is_string_equal(const char *s1, const char *s2)
+{
+    signed char __res;
+
+    while (1) {
+        if ((__res = *s1 - *s2++) != 0 || !*s1++)
+            break;
+    }
+    return __res == 0;
+}
+
+inline size_t string_length(const char *s)
+{
+    size_t len = 0;
+    while (*s++)
+        len++;
+    return len;
+}
+
+} // namespace old
+
+static const size_t BUFFER_SIZE = 64*1024;
+static const size_t TOTAL_BYTES = 256*1024*1024;
+
+static char src_buffer[BUFFER_SIZE + 64];
+static char dst_buffer[BUFFER_SIZE + 64];
+static volatile size_t sink;
+
+static double seconds(clock_t start)
+{
+    clock_t end = clock();
+    end += (start == end);
+    return (double)(end - start) / CLOCKS_PER_SEC;
+}
+
+#define BENCH(name, size, expr)                                        \
+    do {                                                               \
+        size_t __iters = TOTAL_BYTES / (size);                         \
+        clock_t __start = clock();                                     \
+        for (size_t __i = 0; __i < __iters; ++__i)                     \
+            sink += (size_t)(expr);                                    \
+        printf(" %8.3f", seconds(__start));                            \
+    } while (0)
+
+/**
+ * Word path as copy_memory() and fill_memory() take it without ERMS/FSRM.
+ */
+static void* copy_words(void* dest, const void* src, size_t size)
+{
+    if (size < memutils::internal::WORD_THRESHOLD)
+        return old::copy_memory(dest, src, size);
+    return memutils::internal::copy_memory_words(dest, src, size);
+}
+
+static void* fill_words(void* dest, int value, size_t size)
+{
+    if (size < memutils::internal::WORD_THRESHOLD)
+        return old::fill_memory(dest, value, size);
+    return memutils::internal::fill_memory_words(dest, value, size);
+}
+
+static void check(bool ok, const char* what, size_t size, size_t offset)
+{
+    if (!ok)
+    {
+        printf("\nMISMATCH in %s, size %zu offset %zu\n", what, size, offset);
+        exit(1);
+    }
+}
+
+/**
+ * Compare results of old and new versions on all small sizes and misalignments.
+ */
+static void verify()
+{
+    for (size_t size = 0; size < 200; ++size)
+    {
+        for (size_t offset = 0; offset < 2 * sizeof(address_t); ++offset)
+        {
+            char a[256], b[256];
+            for (size_t i = 0; i < sizeof(a); ++i)
+                a[i] = b[i] = rand();
+
+            memutils::copy_memory(a + offset, src_buffer + 3, size);
+            old::copy_memory(b + offset, src_buffer + 3, size);
+            check(old::is_memory_equal(a, b, sizeof(a)), "copy_memory", size, offset);
+
+            memutils::fill_memory(a + offset, 0xa5, size);
+            old::fill_memory(b + offset, 0xa5, size);
+            check(old::is_memory_equal(a, b, sizeof(a)), "fill_memory", size, offset);
+
+            if (size >= memutils::internal::WORD_THRESHOLD)
+            {
+                memutils::internal::copy_memory_words(a + offset, src_buffer + 5, size);
+                old::copy_memory(b + offset, src_buffer + 5, size);
+                check(old::is_memory_equal(a, b, sizeof(a)), "copy_memory_words", size, offset);
+
+                memutils::internal::fill_memory_words(a + offset, 0x5a, size);
+                old::fill_memory(b + offset, 0x5a, size);
+                check(old::is_memory_equal(a, b, sizeof(a)), "fill_memory_words", size, offset);
+            }
+
+            // Overlapping moves both ways, the source is consumed while it is overwritten.
+            memutils::copy_memory(b + offset, src_buffer, size);
+            memutils::copy_memory(a, src_buffer, 256);
+            memutils::move_memory(a + offset, a, size);
+            check(old::is_memory_equal(a + offset, b + offset, size), "move_memory up", size, offset);
+
+            memutils::copy_memory(b, src_buffer + offset, size);
+            memutils::copy_memory(a, src_buffer, 256);
+            memutils::move_memory(a, a + offset, size);
+            check(old::is_memory_equal(a, b, size), "move_memory down", size, offset);
+
+            for (size_t i = 0; i < sizeof(a); ++i)
+                a[i] = b[i] = 'a' + i % 26;
+            if (size)
+                b[offset + rand() % size] ^= 0x81;
+            check(memutils::is_memory_equal(a + offset, b + offset, size) == old::is_memory_equal(a + offset, b + offset, size),
+                "is_memory_equal", size, offset);
+            check(memutils::memory_difference(a + offset, b + offset, size) == old::memory_difference(a + offset, b + offset, size),
+                "memory_difference", size, offset);
+
+            a[offset + size] = b[offset + size] = 0;
+            check(memutils::string_length(a + offset) == size, "string_length", size, offset);
+            check(memutils::is_string_equal(a + offset, b + offset) == old::is_string_equal(a + offset, b + offset),
+                "is_string_equal", size, offset);
+            check(memutils::is_string_equal(a + offset, a + (offset ^ 1)) == old::is_string_equal(a + offset, a + (offset ^ 1)),
+                "is_string_equal", size, offset);
+        }
+    }
+    printf("verified against old versions\n");
+}
+
+int main()
+{
+    for (size_t i = 0; i < sizeof(src_buffer); ++i)
+        src_buffer[i] = 'a' + i % 26;
+
+    verify();
+
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+    printf("host ERMS %s, FSRM %s\n", (ebx & X86_32_FEAT7_ERMS) ? "yes" : "no", (edx & X86_32_FEAT7D_FSRM) ? "yes" : "no");
+
+    const size_t sizes[] = { 8, 32, 128, 512, 4096, BUFFER_SIZE };
+
+    printf("%8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "size",
+        "copy", "words", "old", "ucopy", "words", "old", "fill", "words", "old", "cmp", "old", "strlen", "old");
+
+    for (size_t k = 0; k < sizeof(sizes)/sizeof(sizes[0]); ++k)
+    {
+        size_t size = sizes[k];
+        memutils::copy_memory(dst_buffer, src_buffer, size);
+        src_buffer[size] = 0;
+
+        printf("%8zu", size);
+        BENCH("copy",    size, memutils::copy_memory(dst_buffer, src_buffer, size));
+        BENCH("copy",    size, copy_words(dst_buffer, src_buffer, size));
+        BENCH("copy",    size, old::copy_memory(dst_buffer, src_buffer, size));
+        BENCH("ucopy",   size, memutils::copy_memory(dst_buffer + 1, src_buffer + 3, size));
+        BENCH("ucopy",   size, copy_words(dst_buffer + 1, src_buffer + 3, size));
+        BENCH("ucopy",   size, old::copy_memory(dst_buffer + 1, src_buffer + 3, size));
+        BENCH("fill",    size, memutils::fill_memory(dst_buffer, 0, size));
+        BENCH("fill",    size, fill_words(dst_buffer, 0, size));
+        BENCH("fill",    size, old::fill_memory(dst_buffer, 0, size));
+        memutils::copy_memory(dst_buffer, src_buffer, size);
+        BENCH("cmp",     size, memutils::memory_difference(dst_buffer, src_buffer, size));
+        BENCH("cmp",     size, old::memory_difference(dst_buffer, src_buffer, size));
+        BENCH("strlen",  size, memutils::string_length(src_buffer));
+        BENCH("strlen",  size, old::string_length(src_buffer));
+        printf("\n");
+
+        src_buffer[size] = 'a' + size % 26;
+    }
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test buddy_bitmap used by frames_mod.
+ */
+
+/*============================================================================*/
+
+#include <vector>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "../modules/tcb/frames_mod/buddy_bitmap.h"
+
+BOOST_AUTO_TEST_SUITE( test_suite )
+
+// Region of 1MiB..32MiB in 4KiB frames, like the low RAM on a PC.
+static const size_t BASE = 256;
+static const size_t N_FRAMES = 8192 - 256;
+
+BOOST_AUTO_TEST_CASE(test_aligned_allocation)
+{
+    std::vector<uint32_t> storage(buddy_bitmap_t::required_size(BASE, N_FRAMES) / sizeof(uint32_t));
+    buddy_bitmap_t buddy;
+    buddy.init(&storage[0], BASE, N_FRAMES);
+    buddy.free_range(0, N_FRAMES);
+
+    size_t first;
+    BOOST_CHECK(buddy.allocate(1, 0, buddy_bitmap_t::NONE, &first));
+    BOOST_CHECK_EQUAL(first, 0);
+
+    // 4MiB aligned in physical memory, not relative to the region start.
+    BOOST_CHECK(buddy.allocate(1024, 10, buddy_bitmap_t::NONE, &first));
+    BOOST_CHECK_EQUAL((BASE + first) % 1024, 0);
+
+    // Non power of two sizes give the tail back.
+    BOOST_CHECK(buddy.allocate(3, 0, buddy_bitmap_t::NONE, &first));
+    BOOST_CHECK_EQUAL(buddy.claim_range(first + 3, 1), 1);
+
+    BOOST_CHECK(!buddy.allocate(1, 0, 1, &first));
+}
+
+BOOST_AUTO_TEST_CASE(test_claim_and_merge)
+{
+    std::vector<uint32_t> storage(buddy_bitmap_t::required_size(BASE, N_FRAMES) / sizeof(uint32_t));
+    buddy_bitmap_t buddy;
+    buddy.init(&storage[0], BASE, N_FRAMES);
+    buddy.free_range(0, N_FRAMES);
+
+    BOOST_CHECK_EQUAL(buddy.claim_range(100, 50), 50);
+    BOOST_CHECK_EQUAL(buddy.claim_range(120, 50), 0);
+    BOOST_CHECK_EQUAL(buddy.claim_range(90, 20), 10);
+
+    // Everything merges back into the original blocks once freed.
+    buddy.free_range(90, 60);
+    BOOST_CHECK_EQUAL(buddy.claim_range(0, N_FRAMES), N_FRAMES);
+    buddy.free_range(0, N_FRAMES);
+
+    size_t first;
+    BOOST_CHECK(buddy.allocate(4096, 12, buddy_bitmap_t::NONE, &first));
+    BOOST_CHECK_EQUAL(BASE + first, 4096);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,125 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test host_memutils kernels against plain byte loops.
+ */
+
+/*============================================================================*/
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+#include "host_memutils.h"
+
+BOOST_AUTO_TEST_SUITE( test_suite )
+
+// Covers the short paths, vector bodies with tails and the streaming stores past 1 MiB.
+static const size_t sizes[] = { 0, 1, 3, 15, 16, 17, 31, 32, 33, 63, 64, 65, 255, 4096 + 7, (1 << 20) + 37 };
+static const size_t offsets[] = { 0, 1, 7, 31 };
+static const size_t SLACK = 64;
+
+static void pattern(std::vector<uint8_t>& buf, uint8_t seed)
+{
+    for (size_t i = 0; i < buf.size(); ++i)
+        buf[i] = uint8_t(i * 131 + seed);
+}
+
+static uint32_t naive_checksum(const uint8_t* data, size_t count)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; ++i)
+        sum += uint32_t(data[i]) << (8 * (i % 4));
+    return sum;
+}
+
+BOOST_AUTO_TEST_CASE(test_variant)
+{
+    BOOST_CHECK(host_memutils::variant() != 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_copy)
+{
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s)
+        for (size_t o = 0; o < sizeof(offsets)/sizeof(offsets[0]); ++o)
+        {
+            size_t size = sizes[s], off = offsets[o];
+            std::vector<uint8_t> src(size + 2 * SLACK), dest(size + 2 * SLACK);
+            pattern(src, 1);
+            pattern(dest, 2);
+            std::vector<uint8_t> expected(dest);
+            for (size_t i = 0; i < size; ++i)
+                expected[SLACK + i] = src[off + i];
+
+            BOOST_CHECK(host_memutils::copy_memory(&dest[SLACK], &src[off], size) == &dest[SLACK]);
+            BOOST_CHECK_MESSAGE(dest == expected, "copy of " << size << " bytes from offset " << off);
+        }
+}
+
+BOOST_AUTO_TEST_CASE(test_fill)
+{
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s)
+        for (size_t o = 0; o < sizeof(offsets)/sizeof(offsets[0]); ++o)
+        {
+            size_t size = sizes[s], off = offsets[o];
+            std::vector<uint8_t> dest(size + 2 * SLACK);
+            pattern(dest, 3);
+            std::vector<uint8_t> expected(dest);
+            for (size_t i = 0; i < size; ++i)
+                expected[off + i] = 0xa5;
+
+            BOOST_CHECK(host_memutils::fill_memory(&dest[off], 0x1a5, size) == &dest[off]);
+            BOOST_CHECK_MESSAGE(dest == expected, "fill of " << size << " bytes at offset " << off);
+        }
+}
+
+BOOST_AUTO_TEST_CASE(test_equal)
+{
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s)
+    {
+        size_t size = sizes[s];
+        std::vector<uint8_t> left(size + 1), right(size + 1);
+        pattern(left, 4);
+        pattern(right, 4);
+        right[size] ^= 1; // Past the compared range.
+
+        BOOST_CHECK(host_memutils::is_memory_equal(&left[0], &right[0], size));
+        if (size == 0)
+            continue;
+
+        // A difference in the first, middle and last byte must all be seen.
+        size_t spots[] = { 0, size / 2, size - 1 };
+        for (size_t i = 0; i < 3; ++i)
+        {
+            right[spots[i]] ^= 0x80;
+            BOOST_CHECK_MESSAGE(!host_memutils::is_memory_equal(&left[0], &right[0], size),
+                "difference at " << spots[i] << " of " << size);
+            right[spots[i]] ^= 0x80;
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_checksum)
+{
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s)
+        for (size_t o = 0; o < sizeof(offsets)/sizeof(offsets[0]); ++o)
+        {
+            size_t size = sizes[s], off = offsets[o];
+            std::vector<uint8_t> data(size + SLACK);
+            pattern(data, 5);
+
+            BOOST_CHECK_EQUAL(host_memutils::checksum(&data[off], size), naive_checksum(&data[off], size));
+        }
+
+    // Zero padding of the tail word.
+    const uint8_t bytes[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
+    BOOST_CHECK_EQUAL(host_memutils::checksum(bytes, 5), 0x04030201u + 0x05u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
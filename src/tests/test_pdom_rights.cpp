@@ -0,0 +1,79 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test pdom_rights_t used by the pc99 mmu_mod.
+ */
+
+/*============================================================================*/
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "../modules/tcb/platform/pc99/mmu_mod/pdom_rights.h"
+
+BOOST_AUTO_TEST_SUITE( test_suite )
+
+struct counting_leaves_t
+{
+    int live;
+
+    counting_leaves_t() : live(0) {}
+    uint8_t* new_leaf() { ++live; return new uint8_t[128]; }
+    void delete_leaf(uint8_t* leaf) { --live; delete [] leaf; }
+};
+
+typedef pdom_rights_t<counting_leaves_t, 16384> rights_t;
+
+BOOST_AUTO_TEST_CASE(test_dense_first_leaf)
+{
+    counting_leaves_t leaves;
+    rights_t r;
+    r.init();
+
+    for (size_t sid = 0; sid < rights_t::SIDS_PER_LEAF; ++sid)
+        BOOST_CHECK(r.set(leaves, sid, sid & 0xf));
+    BOOST_CHECK_EQUAL(leaves.live, 0);
+
+    for (size_t sid = 0; sid < rights_t::SIDS_PER_LEAF; ++sid)
+        BOOST_CHECK_EQUAL(r.get(sid), sid & 0xf);
+
+    // Neighbouring sids share a byte.
+    BOOST_CHECK(r.set(leaves, 7, 0));
+    BOOST_CHECK_EQUAL(r.get(6), 6);
+    BOOST_CHECK_EQUAL(r.get(7), 0);
+    BOOST_CHECK_EQUAL(r.get(8), 8);
+}
+
+BOOST_AUTO_TEST_CASE(test_sparse_leaves)
+{
+    counting_leaves_t leaves;
+    rights_t r;
+    r.init();
+
+    // Clearing rights nobody has allocates nothing.
+    BOOST_CHECK(r.set(leaves, 5000, 0));
+    BOOST_CHECK_EQUAL(leaves.live, 0);
+    BOOST_CHECK_EQUAL(r.get(5000), 0);
+
+    BOOST_CHECK(r.set(leaves, 5000, 0xb));
+    BOOST_CHECK(r.set(leaves, 5001, 0x3));
+    BOOST_CHECK(r.set(leaves, 16383, 0x1f)); // Only 4 bits are kept.
+    BOOST_CHECK_EQUAL(leaves.live, 2);
+    BOOST_CHECK_EQUAL(r.get(5000), 0xb);
+    BOOST_CHECK_EQUAL(r.get(5001), 0x3);
+    BOOST_CHECK_EQUAL(r.get(4999), 0);
+    BOOST_CHECK_EQUAL(r.get(16383), 0xf);
+
+    r.clear(leaves);
+    BOOST_CHECK_EQUAL(leaves.live, 0);
+    BOOST_CHECK_EQUAL(r.get(5000), 0);
+    BOOST_CHECK_EQUAL(r.get(16383), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,115 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test tlb_model_t used by the hosted mmu_mod.
+ */
+
+/*============================================================================*/
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "../modules/tcb/platform/hosted/mmu_mod/tlb_model.h"
+
+BOOST_AUTO_TEST_SUITE( test_suite )
+
+static const size_t W4K = tlb_model_t::WIDTH_4K;
+static const size_t W4M = tlb_model_t::WIDTH_4M;
+
+BOOST_AUTO_TEST_CASE(test_geometry)
+{
+    tlb_model_t tlb;
+
+    BOOST_CHECK(!tlb.enabled());
+    BOOST_CHECK_EQUAL(tlb.access(0x1000, W4K, false), 0);
+    BOOST_CHECK_EQUAL(tlb.stats().misses, 0);
+
+    BOOST_CHECK(!tlb.configure(64, 0, false));
+    BOOST_CHECK(!tlb.configure(64, 3, false));
+    BOOST_CHECK(!tlb.configure(tlb_model_t::MAX_ENTRIES * 2, 4, false));
+    BOOST_CHECK(!tlb.enabled());
+    BOOST_CHECK(tlb.configure(64, 4, false));
+    BOOST_CHECK(tlb.enabled());
+    BOOST_CHECK(tlb.configure(0, 0, false));
+    BOOST_CHECK(!tlb.enabled());
+}
+
+BOOST_AUTO_TEST_CASE(test_hits_walks_and_lru)
+{
+    tlb_model_t tlb;
+    BOOST_CHECK(tlb.configure(4, 2, false)); // 2 sets of 2 ways
+
+    // A miss walks two levels for 4K pages and one for 4M pages.
+    BOOST_CHECK_EQUAL(tlb.access(0x1000, W4K, false), 2);
+    BOOST_CHECK_EQUAL(tlb.access(0x1fff, W4K, false), 0);
+    BOOST_CHECK_EQUAL(tlb.access(0x800000, W4M, false), 1);
+    BOOST_CHECK_EQUAL(tlb.access(0xbff000, W4M, false), 0);
+
+    // Pages 0x1000, 0x3000 and 0x5000 share a set, the least recently used one goes.
+    BOOST_CHECK_EQUAL(tlb.access(0x3000, W4K, false), 2);
+    BOOST_CHECK_EQUAL(tlb.access(0x1000, W4K, false), 0);
+    BOOST_CHECK_EQUAL(tlb.access(0x5000, W4K, false), 2);
+    BOOST_CHECK_EQUAL(tlb.access(0x1000, W4K, false), 0);
+    BOOST_CHECK_EQUAL(tlb.access(0x3000, W4K, false), 2);
+
+    BOOST_CHECK_EQUAL(tlb.stats().hits, 4);
+    BOOST_CHECK_EQUAL(tlb.stats().misses, 5);
+    BOOST_CHECK_EQUAL(tlb.stats().walk_steps, 9);
+    BOOST_CHECK_EQUAL(tlb.stats().evictions, 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_flushes)
+{
+    tlb_model_t tlb;
+    BOOST_CHECK(tlb.configure(16, 4, false));
+
+    tlb.access(0x1000, W4K, false);
+    tlb.access(0x2000, W4K, true);
+    tlb.access(0x400000, W4M, false);
+
+    // invlpg drops the page in either size.
+    tlb.flush_page(0x401000);
+    BOOST_CHECK_EQUAL(tlb.access(0x400000, W4M, false), 1);
+    BOOST_CHECK_EQUAL(tlb.stats().page_flushes, 1);
+
+    tlb.flush(false);
+    BOOST_CHECK_EQUAL(tlb.access(0x2000, W4K, true), 0);
+    BOOST_CHECK_EQUAL(tlb.access(0x1000, W4K, false), 2);
+
+    tlb.flush(true);
+    BOOST_CHECK_EQUAL(tlb.access(0x2000, W4K, true), 2);
+    BOOST_CHECK_EQUAL(tlb.stats().flushes, 1);
+    BOOST_CHECK_EQUAL(tlb.stats().global_flushes, 1);
+    BOOST_CHECK_EQUAL(tlb.stats().flushed_entries, 1 + 2 + 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_address_space_tags)
+{
+    tlb_model_t untagged;
+    BOOST_CHECK(untagged.configure(16, 4, false));
+
+    untagged.access(0x1000, W4K, false);
+    untagged.access(0x2000, W4K, true);
+    untagged.switch_asn(1);
+    BOOST_CHECK_EQUAL(untagged.stats().flushes, 1);
+    BOOST_CHECK_EQUAL(untagged.access(0x2000, W4K, true), 0);
+    BOOST_CHECK_EQUAL(untagged.access(0x1000, W4K, false), 2);
+
+    tlb_model_t tagged;
+    BOOST_CHECK(tagged.configure(16, 4, true));
+
+    tagged.access(0x1000, W4K, false);
+    tagged.switch_asn(1);
+    BOOST_CHECK_EQUAL(tagged.stats().flushes, 0);
+    BOOST_CHECK_EQUAL(tagged.access(0x1000, W4K, false), 2); // Other domain's entry does not match.
+    tagged.switch_asn(0);
+    BOOST_CHECK_EQUAL(tagged.access(0x1000, W4K, false), 0); // Survived the switches.
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,107 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Test va_space_t used by stretch_allocator_mod.
+ */
+
+/*============================================================================*/
+
+#include <vector>
+#include <stdlib.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "../modules/tcb/stretch_allocator_mod/va_tree.h"
+
+BOOST_AUTO_TEST_SUITE( test_suite )
+
+struct heap_extents_t
+{
+    va_extent_t* new_extent() { return new va_extent_t; }
+    void delete_extent(va_extent_t* e) { delete e; }
+};
+
+// Whole 4GiB address space in 4KiB pages.
+static const size_t N_PAGES = 0x100000;
+
+BOOST_AUTO_TEST_CASE(test_best_fit_and_coalescing)
+{
+    va_space_t<heap_extents_t> space;
+    space.init(heap_extents_t());
+    BOOST_CHECK(space.free(0, N_PAGES));
+
+    BOOST_CHECK(space.allocate_at(0x100, 0x100));
+    BOOST_CHECK(!space.allocate_at(0x1ff, 2));
+    BOOST_CHECK(space.allocate_at(0x10, 0x10));
+
+    // Best fit takes the 0x10 page hole below 0x10, not the large space.
+    size_t start;
+    BOOST_CHECK(space.allocate(8, 1, &start));
+    BOOST_CHECK_EQUAL(start, 0);
+
+    // Alignment padding does not fit the rest of that hole, the next larger one is used.
+    BOOST_CHECK(space.allocate(8, 16, &start));
+    BOOST_CHECK_EQUAL(start, 0x20);
+
+    // Overlapping frees are refused.
+    BOOST_CHECK(!space.free(0x100 - 1, 2));
+
+    BOOST_CHECK(space.free(start, 8));
+    BOOST_CHECK(space.free(0, 8));
+    BOOST_CHECK(space.free(0x10, 0x10));
+    BOOST_CHECK(space.free(0x100, 0x100));
+    BOOST_CHECK_EQUAL(space.largest_free(), N_PAGES);
+}
+
+BOOST_AUTO_TEST_CASE(test_random_against_bitmap)
+{
+    const size_t PAGES = 4096;
+    va_space_t<heap_extents_t> space;
+    space.init(heap_extents_t());
+    space.free(0, PAGES);
+
+    std::vector<bool> used(PAGES, false);
+    std::vector<std::pair<size_t,size_t>> live;
+    srand(1);
+
+    for (int i = 0; i < 20000; ++i)
+    {
+        if (live.empty() || (rand() % 3))
+        {
+            size_t n = 1 + rand() % 64;
+            size_t align = size_t(1) << (rand() % 4);
+            size_t start;
+            if (!space.allocate(n, align, &start))
+                continue;
+            BOOST_REQUIRE_EQUAL(start % align, 0);
+            for (size_t p = start; p < start + n; ++p)
+            {
+                BOOST_REQUIRE(!used[p]);
+                used[p] = true;
+            }
+            live.push_back(std::make_pair(start, n));
+        }
+        else
+        {
+            size_t k = rand() % live.size();
+            BOOST_REQUIRE(space.free(live[k].first, live[k].second));
+            for (size_t p = live[k].first; p < live[k].first + live[k].second; ++p)
+                used[p] = false;
+            live[k] = live.back();
+            live.pop_back();
+        }
+    }
+
+    for (size_t k = 0; k < live.size(); ++k)
+        BOOST_REQUIRE(space.free(live[k].first, live[k].second));
+    BOOST_CHECK_EQUAL(space.largest_free(), PAGES);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
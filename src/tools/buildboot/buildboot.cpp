@@ -30,6 +30,7 @@
 #include "bootimage_private.h"
 #include "raiifile.h"
 #include "config.h"
+#include "host_memutils.h"
 
 #if TOOLS_DEBUG
 #define D(...) __VA_ARGS__
@@ -43,6 +44,7 @@ using namespace bootimage_n;
 
 const uint32_t version = 1;
 const uint32_t ALIGN = 4;
+const size_t COPY_CHUNK = 1024*1024;
 
 //======================================================================================================================
 // helper functions
@@ -434,15 +436,19 @@ bool module_info::write(file& out, uintptr_t& data_offset)
         namesp.write(out, data_offset);
     align_output(out, data_offset);
 
-    // Write module data
-    char buf[4096];
+    // Write module data, modules are up to several megabytes so move them in large chunks.
+    vector<char> buf(COPY_CHUNK);
     size_t out_size = 0;
-    size_t bytes = in_data.read(buf, 4096);
+    D(uint32_t checksum = 0);
+    size_t bytes = in_data.read(&buf[0], buf.size());
     while (bytes > 0) {
-        out.write(buf, bytes);
+        out.write(&buf[0], bytes);
+        D(checksum += host_memutils::checksum(&buf[0], bytes));
         out_size += bytes;
-        bytes = in_data.read(buf, 4096);
+        bytes = in_data.read(&buf[0], buf.size());
     }
+    D(cout << name << ": " << out_size << " bytes, checksum " << hex << checksum << dec
+           << " (" << host_memutils::variant() << ")" << endl);
     if (in_size != out_size)
     {
         throw file_error("File was not entirely copied.");
@@ -0,0 +1,324 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "host_memutils.h"
+#include "memutils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_VECTORS 1
+#include <immintrin.h>
+#endif
+
+// Stores at or above this size bypass the cache, the destination would evict everything else anyway.
+#define STREAMING_THRESHOLD (1024*1024)
+
+namespace host_memutils {
+
+//======================================================================================================================
+// Generic implementation
+//======================================================================================================================
+
+static uint32_t checksum_tail(const uint8_t* p, size_t count, uint32_t sum)
+{
+    for (; count >= 4; p += 4, count -= 4)
+        sum += p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+
+    uint32_t last = 0;
+    for (size_t i = 0; i < count; ++i)
+        last |= uint32_t(p[i]) << (8 * i);
+    return sum + last;
+}
+
+static void* generic_copy(void* dest, const void* src, size_t count)
+{
+    return memutils::copy_memory(dest, src, count);
+}
+
+static void* generic_fill(void* dest, int value, size_t count)
+{
+    return memutils::fill_memory(dest, value, count);
+}
+
+static bool generic_equal(const void* left, const void* right, size_t count)
+{
+    return memutils::is_memory_equal(left, right, count);
+}
+
+static uint32_t generic_checksum(const void* data, size_t count)
+{
+    return checksum_tail(reinterpret_cast<const uint8_t*>(data), count, 0);
+}
+
+#if HAVE_X86_VECTORS
+
+//======================================================================================================================
+// SSE2 implementation
+//======================================================================================================================
+
+__attribute__((target("sse2")))
+static void* sse2_copy(void* dest, const void* src, size_t count)
+{
+    char* d = reinterpret_cast<char*>(dest);
+    const char* s = reinterpret_cast<const char*>(src);
+
+    if (count >= STREAMING_THRESHOLD)
+    {
+        size_t head = -reinterpret_cast<address_t>(d) & 15;
+        memutils::copy_memory(d, s, head);
+        d += head;
+        s += head;
+        count -= head;
+        for (; count >= 64; d += 64, s += 64, count -= 64)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16));
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 32));
+            __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 48));
+            _mm_stream_si128(reinterpret_cast<__m128i*>(d), a);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(d + 16), b);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(d + 32), c);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(d + 48), e);
+        }
+        _mm_sfence();
+    }
+    else
+    {
+        for (; count >= 64; d += 64, s += 64, count -= 64)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16));
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 32));
+            __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 48));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d), a);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 16), b);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 32), c);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 48), e);
+        }
+    }
+    memutils::copy_memory(d, s, count);
+    return dest;
+}
+
+__attribute__((target("sse2")))
+static void* sse2_fill(void* dest, int value, size_t count)
+{
+    char* d = reinterpret_cast<char*>(dest);
+    __m128i v = _mm_set1_epi8(char(value));
+
+    for (; count >= 64; d += 64, count -= 64)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d), v);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 16), v);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 32), v);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 48), v);
+    }
+    memutils::fill_memory(d, value, count);
+    return dest;
+}
+
+__attribute__((target("sse2")))
+static bool sse2_equal(const void* left, const void* right, size_t count)
+{
+    const char* l = reinterpret_cast<const char*>(left);
+    const char* r = reinterpret_cast<const char*>(right);
+
+    for (; count >= 16; l += 16, r += 16, count -= 16)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(l));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff)
+            return false;
+    }
+    return memutils::is_memory_equal(l, r, count);
+}
+
+__attribute__((target("sse2")))
+static uint32_t sse2_checksum(const void* data, size_t count)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    __m128i sum = _mm_setzero_si128();
+
+    for (; count >= 16; p += 16, count -= 16)
+        sum = _mm_add_epi32(sum, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+
+    uint32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sum);
+    return checksum_tail(p, count, lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+//======================================================================================================================
+// AVX2 implementation
+//======================================================================================================================
+
+__attribute__((target("avx2")))
+static void* avx2_copy(void* dest, const void* src, size_t count)
+{
+    char* d = reinterpret_cast<char*>(dest);
+    const char* s = reinterpret_cast<const char*>(src);
+
+    if (count >= STREAMING_THRESHOLD)
+    {
+        size_t head = -reinterpret_cast<address_t>(d) & 31;
+        memutils::copy_memory(d, s, head);
+        d += head;
+        s += head;
+        count -= head;
+        for (; count >= 128; d += 128, s += 128, count -= 128)
+        {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 32));
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 64));
+            __m256i e = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 96));
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(d), a);
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(d + 32), b);
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(d + 64), c);
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(d + 96), e);
+        }
+        _mm_sfence();
+    }
+    else
+    {
+        for (; count >= 128; d += 128, s += 128, count -= 128)
+        {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 32));
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 64));
+            __m256i e = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 96));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d), a);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 32), b);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 64), c);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 96), e);
+        }
+    }
+    _mm256_zeroupper();
+    memutils::copy_memory(d, s, count);
+    return dest;
+}
+
+__attribute__((target("avx2")))
+static void* avx2_fill(void* dest, int value, size_t count)
+{
+    char* d = reinterpret_cast<char*>(dest);
+    __m256i v = _mm256_set1_epi8(char(value));
+
+    for (; count >= 128; d += 128, count -= 128)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d), v);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 32), v);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 64), v);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 96), v);
+    }
+    _mm256_zeroupper();
+    memutils::fill_memory(d, value, count);
+    return dest;
+}
+
+__attribute__((target("avx2")))
+static bool avx2_equal(const void* left, const void* right, size_t count)
+{
+    const char* l = reinterpret_cast<const char*>(left);
+    const char* r = reinterpret_cast<const char*>(right);
+    bool equal = true;
+
+    for (; count >= 32; l += 32, r += 32, count -= 32)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(l));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) != -1)
+        {
+            equal = false;
+            break;
+        }
+    }
+    _mm256_zeroupper();
+    return equal && memutils::is_memory_equal(l, r, count);
+}
+
+__attribute__((target("avx2")))
+static uint32_t avx2_checksum(const void* data, size_t count)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    __m256i sum = _mm256_setzero_si256();
+
+    for (; count >= 32; p += 32, count -= 32)
+        sum = _mm256_add_epi32(sum, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), sum);
+    _mm256_zeroupper();
+    uint32_t total = 0;
+    for (int i = 0; i < 8; ++i)
+        total += lanes[i];
+    return checksum_tail(p, count, total);
+}
+
+#endif // HAVE_X86_VECTORS
+
+//======================================================================================================================
+// Dispatch
+//======================================================================================================================
+
+struct kernels_t
+{
+    const char* name;
+    void*    (*copy)(void*, const void*, size_t);
+    void*    (*fill)(void*, int, size_t);
+    bool     (*equal)(const void*, const void*, size_t);
+    uint32_t (*checksum)(const void*, size_t);
+};
+
+static const kernels_t generic_kernels = { "generic", generic_copy, generic_fill, generic_equal, generic_checksum };
+#if HAVE_X86_VECTORS
+static const kernels_t sse2_kernels = { "sse2", sse2_copy, sse2_fill, sse2_equal, sse2_checksum };
+static const kernels_t avx2_kernels = { "avx2", avx2_copy, avx2_fill, avx2_equal, avx2_checksum };
+#endif
+
+static const kernels_t& select_kernels()
+{
+#if HAVE_X86_VECTORS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return avx2_kernels;
+    if (__builtin_cpu_supports("sse2"))
+        return sse2_kernels;
+#endif
+    return generic_kernels;
+}
+
+static const kernels_t& kernels()
+{
+    static const kernels_t& selected = select_kernels();
+    return selected;
+}
+
+void* copy_memory(void* dest, const void* src, size_t count)
+{
+    return kernels().copy(dest, src, count);
+}
+
+void* fill_memory(void* dest, int value, size_t count)
+{
+    return kernels().fill(dest, value, count);
+}
+
+bool is_memory_equal(const void* left, const void* right, size_t count)
+{
+    return kernels().equal(left, right, count);
+}
+
+uint32_t checksum(const void* data, size_t count)
+{
+    return kernels().checksum(data, count);
+}
+
+const char* variant()
+{
+    return kernels().name;
+}
+
+} // namespace host_memutils
@@ -0,0 +1,35 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+
+/**
+ * @brief Vectorized memory kernels for host tools.
+ * Implementation is picked on first use by the CPU features of the build host: AVX2, SSE2 or the
+ * plain memutils versions. Kernel code cannot use these, see fpu_memutils.h there.
+ */
+namespace host_memutils {
+
+void* copy_memory(void* dest, const void* src, size_t count);
+void* fill_memory(void* dest, int value, size_t count);
+bool is_memory_equal(const void* left, const void* right, size_t count);
+
+/**
+ * Sum of little-endian 32 bit words modulo 2^32, a trailing partial word is zero-padded.
+ * Good for catching corrupted copies, not an integrity hash.
+ */
+uint32_t checksum(const void* data, size_t count);
+
+/**
+ * @return name of the selected implementation, for diagnostics.
+ */
+const char* variant();
+
+} // namespace host_memutils
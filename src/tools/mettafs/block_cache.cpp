@@ -8,7 +8,7 @@
 //
 #include "block_cache.h"
 #include "block_device_mapper.h"
-#include "memutils.h"
+#include "host_memutils.h"
 #include <cstdio>
 #include <cassert>
 #include <iostream> // debug
@@ -275,7 +275,7 @@ size_t block_cache_t::cached_read(deviceno_t device, block_device_t::blockno_t b
             {
                 assert(entry->block_size == block_size);
                 if (entry->dirty)
-                    memutils::copy_memory(entry->data, buffer, block_size); // Update read data with cache data (e.g. dirty blocks).
+                    host_memutils::copy_memory(buffer, entry->data, block_size); // Update read data with cache data (e.g. dirty blocks).
             }
             block_n++;
             nblocks--;
@@ -293,7 +293,7 @@ size_t block_cache_t::cached_read(deviceno_t device, block_device_t::blockno_t b
             assert(entry->block_size == block_size);
             // Block is found in cache.
             entry->unlink_from(&blocks); // Remove it from the list it is in, because it's going to be modified.
-            memutils::copy_memory(buffer, entry->data, block_size); // FIXME: replace this with a visitor pattern?
+            host_memutils::copy_memory(buffer, entry->data, block_size); // FIXME: replace this with a visitor pattern?
             // Add block back at the start of the MRU list.
             entry->link_at_mru(&blocks);
 
@@ -352,7 +352,7 @@ size_t block_cache_t::cached_write(deviceno_t device, block_device_t::blockno_t
             assert(entry->block_size == block_size);
             std::cerr << "Block is found in the cache." << std::endl;
             entry->unlink_from(&blocks); // Remove it from the list it is in, because it's going to be modified.
-            memutils::copy_memory(entry->data, buffer, block_size); // FIXME: replace this with a visitor pattern?
+            host_memutils::copy_memory(entry->data, buffer, block_size); // FIXME: replace this with a visitor pattern?
 
             entry->set_dirty();
             entry->device = device;
@@ -373,7 +373,7 @@ size_t block_cache_t::cached_write(deviceno_t device, block_device_t::blockno_t
             std::cerr << "New blocks allocated: " << ents.size() << std::endl;
 
             entry = ents[0];
-            memutils::copy_memory(entry->data, buffer, block_size);
+            host_memutils::copy_memory(entry->data, buffer, block_size);
 
             entry->set_dirty();
             entry->device = device;